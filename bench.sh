@@ -0,0 +1,68 @@
+#!/bin/bash
+
+# Times each bench/*.pk with one or more builds of pikey, best of $RUNS runs
+# (three by default), so that a change can be measured against the build from
+# before it:
+#
+#   ./bench.sh old/pikey dist/pikey
+#
+# With no arguments it times ./dist/pikey. Pass bench names after -- to run
+# only those, as in ./bench.sh dist/pikey -- loop fib.
+
+binaries=()
+labels=()
+while [ $# -gt 0 ] && [ "$1" != "--" ]; do
+	binaries+=("$(realpath "$1")")
+	labels+=("$1")
+	shift
+done
+[ "$1" = "--" ] && shift
+if [ ${#binaries[@]} = 0 ]; then
+	binaries=("$(dirname "$(realpath "$0")")/dist/pikey")
+	labels=("dist/pikey")
+fi
+
+cd "$(dirname "$0")"
+
+if [ $# -gt 0 ]; then
+	benches=()
+	for name in "$@"; do
+		benches+=("bench/$name.pk")
+	done
+else
+	benches=(bench/*.pk)
+fi
+
+printf "%-12s" "bench"
+for label in "${labels[@]}"; do
+	[ ${#label} -gt 14 ] && label="${label: -14}"
+	printf " %14s" "$label"
+done
+echo
+
+for bench in "${benches[@]}"; do
+	name=$(basename "$bench" .pk)
+	printf "%-12s" "$name"
+
+	# The builds take turns within each round, so that a machine getting
+	# faster or slower over time favours none of them.
+	best=()
+	failed=()
+	for (( run=0; run < ${RUNS:-3}; run++ )); do
+		for i in "${!binaries[@]}"; do
+			start=$(date +%s%N)
+			"${binaries[$i]}" "$bench" > /dev/null 2>&1 || failed[$i]=1
+			elapsed=$(( ($(date +%s%N) - start) / 1000000 ))
+			if [ -z "${best[$i]}" ] || [ $elapsed -lt ${best[$i]} ]; then best[$i]=$elapsed; fi
+		done
+	done
+
+	for i in "${!binaries[@]}"; do
+		if [ -n "${failed[$i]}" ]; then
+			printf " %14s" "error"
+		else
+			printf " %10d.%02ds" $(( best[i] / 1000 )) $(( best[i] % 1000 / 10 ))
+		fi
+	done
+	echo
+done
@@ -0,0 +1,70 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "aot.h"
+#include "memory.h"
+
+static void build_function(VM* vm, const AotFunction* source, ObjFunction* function, ObjFunction** functions) {
+	function->arity = source->arity;
+	function->upvalue_count = source->upvalue_count;
+	function->compiled = (void*)source->compiled;
+
+	for ( int i=0; i < source->count; i++ ) {
+		write_chunk(vm, &function->chunk, source->code[i], source->lines[i]);
+	}
+
+	for ( int i=0; i < source->cache_count; i++ ) {
+		add_call_cache(vm, &function->chunk);
+	}
+
+	for ( int i=0; i < source->constant_count; i++ ) {
+		const AotConstant* constant = &source->constants[i];
+		Value value = NULL_VAL;
+
+		switch ( constant->type ) {
+			case AOT_NUMBER:   value = NUMBER_VAL(vm, constant->number); break;
+			case AOT_INT:      value = INT32_VAL(vm, (int32_t)constant->number); break;
+			case AOT_STRING:   value = OBJ_VAL(copy_string(vm, constant->chars, constant->length)); break;
+			case AOT_FUNCTION: value = OBJ_VAL(functions[constant->function]); break;
+			case AOT_CLOSURE:  value = OBJ_VAL(new_closure(vm, functions[constant->function])); break;
+		}
+
+		// A string or closure stays on the stack until the chunk holds it.
+		push(vm, value);
+		add_constant(vm, &function->chunk, value);
+		pop(vm);
+	}
+
+	if ( source->name != NULL ) {
+		function->name = copy_string(vm, source->name, (int)strlen(source->name));
+	}
+}
+
+int aot_main(const AotFunction* functions, int function_count) {
+	VM vm;
+	init_vm(&vm);
+
+	// Every function is kept on the stack while the others are built.
+	ObjFunction** built = (ObjFunction**)malloc(sizeof(ObjFunction*) * function_count);
+	if ( built == NULL ) exit(1);
+
+	ensure_stack(&vm, function_count);
+	for ( int i=0; i < function_count; i++ ) {
+		built[i] = new_function(&vm);
+		push(&vm, OBJ_VAL(built[i]));
+	}
+
+	for ( int i=0; i < function_count; i++ ) {
+		build_function(&vm, &functions[i], built[i], built);
+	}
+
+	ObjClosure* script = new_closure(&vm, built[0]);
+	vm.stack_top = vm.stack;
+	free(built);
+
+	Value result;
+	InterpretResult status = call_from_host(&vm, OBJ_VAL(script), 0, NULL, &result);
+	free_vm(&vm);
+
+	return status == INTERPRET_OK ? 0 : 70;
+}
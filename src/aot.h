@@ -0,0 +1,70 @@
+#ifndef pikey_aot_h
+#define pikey_aot_h
+
+// What the C written by --emit-c is built against. The emitted file carries
+// each function's bytecode next to the C translated from it, and main()
+// hands the lot to aot_main().
+//
+//   pikey --emit-c script.pk script.c
+//   gcc -O2 -I src script.c dist/libpikey.a -lm -o script
+
+#include "chunk.h"
+#include "object.h"
+#include "runtime.h"
+#include "vm.h"
+
+typedef enum {
+	AOT_NUMBER,
+	// A number boxed as an int, held in `number`.
+	AOT_INT,
+	AOT_STRING,
+	AOT_FUNCTION,
+	// The shared closure of a function without upvalues.
+	AOT_CLOSURE,
+} AotConstantType;
+
+typedef struct {
+	AotConstantType type;
+	double number;
+	const char* chars;
+	int length;
+	// An index into the program's functions.
+	int function;
+} AotConstant;
+
+// The bytecode stays alongside the C, for the line numbers of error traces
+// and for functions --emit-c could not translate, which are interpreted.
+typedef struct {
+	const char* name;
+	int arity;
+	int upvalue_count;
+	const uint8_t* code;
+	const int* lines;
+	int count;
+	const AotConstant* constants;
+	int constant_count;
+	int cache_count;
+	CompiledFn compiled;
+} AotFunction;
+
+// Builds the functions, the script first, and runs the script. Returns the
+// exit status pikey would for it.
+int aot_main(const AotFunction* functions, int function_count);
+
+// The emitted code keeps the stack depth of every instruction in mind, so a
+// stack slot is just slots[n]. It writes the depth back to the VM and records
+// the instruction after the current one before calling into the runtime,
+// then reloads the slots, which a call may have moved.
+#define AOT_SYNC(depth, next) \
+	(vm->stack_top = slots + (depth), frame->ip = frame->closure->function->chunk.code + (next))
+
+#define AOT_CALL(depth, next, call) \
+	do { \
+		AOT_SYNC(depth, next); \
+		if ( !(call) ) return false; \
+		slots = frame->slots; \
+	} while (false)
+
+#define AOT_FALSEY(value) (IS_NULL(value) || (IS_BOOL(value) && !AS_BOOL(value)))
+
+#endif // !pikey_aot_h
@@ -0,0 +1,373 @@
+#include <dirent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "vm.h"
+
+typedef enum {
+	JOB_OK,
+	JOB_COMPILE_ERROR,
+	JOB_RUNTIME_ERROR,
+	JOB_UNREADABLE,
+} JobStatus;
+
+typedef struct {
+	char* path;
+	JobStatus status;
+	double millis;
+
+	char* out;
+	size_t out_size;
+	char* err;
+	size_t err_size;
+} Job;
+
+// The jobs a worker still has to run, as the range [head, tail) of job
+// indices. The owner takes from the tail and thieves take from the head, so
+// both ends stay contiguous and a steal is just a split of the range.
+typedef struct {
+	pthread_mutex_t lock;
+	int head;
+	int tail;
+} WorkQueue;
+
+typedef struct {
+	Job* jobs;
+	int job_count;
+
+	WorkQueue* queues;
+	int worker_count;
+} Batch;
+
+typedef struct {
+	pthread_t thread;
+	Batch* batch;
+	int id;
+	VM vm;
+} Worker;
+
+static double now_millis() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static char* read_script(const char* path) {
+	FILE* file = fopen(path, "rb");
+	if ( file == NULL ) return NULL;
+
+	fseek(file, 0L, SEEK_END);
+	long file_size = ftell(file);
+	rewind(file);
+
+	char* buffer = file_size < 0 ? NULL : (char*)malloc(file_size + 1);
+	if ( buffer == NULL ) {
+		fclose(file);
+		return NULL;
+	}
+
+	size_t bytes_read = fread(buffer, sizeof(char), file_size, file);
+	buffer[bytes_read] = '\0';
+
+	fclose(file);
+	return buffer;
+}
+
+static void add_job(Job** jobs, int* count, int* capacity, const char* path, size_t length) {
+	if ( *count == *capacity ) {
+		*capacity = *capacity < 8 ? 8 : *capacity * 2;
+		*jobs = (Job*)realloc(*jobs, sizeof(Job) * *capacity);
+		if ( *jobs == NULL ) exit(1);
+	}
+
+	Job* job = &(*jobs)[(*count)++];
+	memset(job, 0, sizeof(Job));
+	job->path = (char*)malloc(length + 1);
+	if ( job->path == NULL ) exit(1);
+	memcpy(job->path, path, length);
+	job->path[length] = '\0';
+}
+
+static bool is_script(const char* name) {
+	const char* dot = strrchr(name, '.');
+	return dot != NULL && (strcmp(dot, ".pikey") == 0 || strcmp(dot, ".pk") == 0);
+}
+
+static int compare_jobs(const void* a, const void* b) {
+	return strcmp(((const Job*)a)->path, ((const Job*)b)->path);
+}
+
+static bool collect_dir(const char* dir_path, Job** jobs, int* count, int* capacity) {
+	DIR* dir = opendir(dir_path);
+	if ( dir == NULL ) return false;
+
+	struct dirent* entry;
+	while ( (entry = readdir(dir)) != NULL ) {
+		if ( entry->d_name[0] == '.' || !is_script(entry->d_name) ) continue;
+
+		size_t length = strlen(dir_path) + 1 + strlen(entry->d_name);
+		char* path = (char*)malloc(length + 1);
+		if ( path == NULL ) exit(1);
+		snprintf(path, length + 1, "%s/%s", dir_path, entry->d_name);
+
+		struct stat st;
+		if ( stat(path, &st) == 0 && S_ISREG(st.st_mode) ) {
+			add_job(jobs, count, capacity, path, length);
+		}
+		free(path);
+	}
+
+	closedir(dir);
+	qsort(*jobs, *count, sizeof(Job), compare_jobs);
+	return true;
+}
+
+// A list has one path per line. Blank lines and lines starting with '#' are
+// skipped.
+static bool collect_list(const char* list_path, Job** jobs, int* count, int* capacity) {
+	char* list = read_script(list_path);
+	if ( list == NULL ) return false;
+
+	char* line = list;
+	while ( *line != '\0' ) {
+		size_t length = strcspn(line, "\r\n");
+		if ( length > 0 && line[0] != '#' ) {
+			add_job(jobs, count, capacity, line, length);
+		}
+
+		line += length;
+		line += strspn(line, "\r\n");
+	}
+
+	free(list);
+	return true;
+}
+
+static void run_job(VM* vm, Job* job) {
+	double start = now_millis();
+
+	char* source = read_script(job->path);
+	if ( source == NULL ) {
+		job->status = JOB_UNREADABLE;
+		job->millis = now_millis() - start;
+		return;
+	}
+
+	FILE* out = open_memstream(&job->out, &job->out_size);
+	FILE* err = open_memstream(&job->err, &job->err_size);
+	if ( out == NULL || err == NULL ) exit(1);
+
+	vm->out = out;
+	vm->err = err;
+
+	switch ( interpret(vm, source) ) {
+		case INTERPRET_OK:            job->status = JOB_OK; break;
+		case INTERPRET_COMPILE_ERROR: job->status = JOB_COMPILE_ERROR; break;
+		case INTERPRET_RUNTIME_ERROR: job->status = JOB_RUNTIME_ERROR; break;
+	}
+
+	// Nothing the script defined is visible to the next one.
+	reset_vm(vm);
+	free(source);
+	fclose(out);
+	fclose(err);
+
+	job->millis = now_millis() - start;
+}
+
+static int take_job(WorkQueue* queue) {
+	int index = -1;
+
+	pthread_mutex_lock(&queue->lock);
+	if ( queue->head < queue->tail ) index = --queue->tail;
+	pthread_mutex_unlock(&queue->lock);
+
+	return index;
+}
+
+// Moves the older half of another worker's queue into this worker's own
+// queue, which is empty. Jobs never create more jobs, so once every queue is
+// empty the whole batch has been handed out.
+static bool steal_jobs(Batch* batch, int thief) {
+	for ( int i=1; i < batch->worker_count; i++ ) {
+		WorkQueue* victim = &batch->queues[(thief + i) % batch->worker_count];
+
+		pthread_mutex_lock(&victim->lock);
+		int available = victim->tail - victim->head;
+		int head = victim->head;
+		int taken = (available + 1) / 2;
+		victim->head += taken;
+		pthread_mutex_unlock(&victim->lock);
+
+		if ( taken > 0 ) {
+			WorkQueue* own = &batch->queues[thief];
+			pthread_mutex_lock(&own->lock);
+			own->head = head;
+			own->tail = head + taken;
+			pthread_mutex_unlock(&own->lock);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void* run_worker(void* arg) {
+	Worker* worker = (Worker*)arg;
+	Batch* batch = worker->batch;
+
+	init_vm(&worker->vm);
+
+	for ( ;; ) {
+		int index = take_job(&batch->queues[worker->id]);
+
+		if ( index < 0 ) {
+			if ( !steal_jobs(batch, worker->id) ) break;
+			continue;
+		}
+
+		run_job(&worker->vm, &batch->jobs[index]);
+	}
+
+	free_vm(&worker->vm);
+	return NULL;
+}
+
+static int worker_count(int job_count) {
+	int count = 0;
+
+	const char* jobs_env = getenv("PIKEY_JOBS");
+	if ( jobs_env != NULL ) count = atoi(jobs_env);
+	if ( count <= 0 ) count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if ( count > job_count ) count = job_count;
+	if ( count < 1 ) count = 1;
+
+	return count;
+}
+
+static const char* status_name(JobStatus status) {
+	switch ( status ) {
+		case JOB_OK:            return "ok";
+		case JOB_COMPILE_ERROR: return "compile";
+		case JOB_RUNTIME_ERROR: return "runtime";
+		case JOB_UNREADABLE:    return "unreadable";
+	}
+
+	return "";
+}
+
+static int status_exit_code(JobStatus status) {
+	switch ( status ) {
+		case JOB_OK:            return 0;
+		case JOB_COMPILE_ERROR: return 65;
+		case JOB_RUNTIME_ERROR: return 70;
+		case JOB_UNREADABLE:    return 74;
+	}
+
+	return 0;
+}
+
+static int report(Batch* batch, double total_millis) {
+	int counts[JOB_UNREADABLE + 1] = {0};
+	int exit_code = 0;
+
+	for ( int i=0; i < batch->job_count; i++ ) {
+		Job* job = &batch->jobs[i];
+
+		if ( job->out_size > 0 || job->err_size > 0 ) {
+			fflush(stderr);
+			printf("==> %s <==\n", job->path);
+			fwrite(job->out, 1, job->out_size, stdout);
+			fflush(stdout);
+			fwrite(job->err, 1, job->err_size, stderr);
+		}
+
+		counts[job->status]++;
+		if ( exit_code == 0 ) exit_code = status_exit_code(job->status);
+	}
+	fflush(stderr);
+
+	printf("\n%10s  %-10s  %s\n", "ms", "result", "script");
+	for ( int i=0; i < batch->job_count; i++ ) {
+		Job* job = &batch->jobs[i];
+		printf("%10.2f  %-10s  %s\n", job->millis, status_name(job->status), job->path);
+	}
+
+	printf("\n%d scripts: %d ok, %d compile errors, %d runtime errors, %d unreadable in %.2f ms on %d threads\n",
+		batch->job_count, counts[JOB_OK], counts[JOB_COMPILE_ERROR], counts[JOB_RUNTIME_ERROR],
+		counts[JOB_UNREADABLE], total_millis, batch->worker_count);
+
+	return exit_code;
+}
+
+int run_batch(const char* target) {
+	Job* jobs = NULL;
+	int count = 0;
+	int capacity = 0;
+
+	struct stat st;
+	bool collected = false;
+	if ( stat(target, &st) == 0 ) {
+		collected = S_ISDIR(st.st_mode)
+			? collect_dir(target, &jobs, &count, &capacity)
+			: collect_list(target, &jobs, &count, &capacity);
+	}
+
+	if ( !collected ) {
+		fprintf(stderr, "Could not open \"%s\".\n", target);
+		return 74;
+	}
+
+	Batch batch;
+	batch.jobs = jobs;
+	batch.job_count = count;
+	batch.worker_count = worker_count(count);
+	batch.queues = (WorkQueue*)malloc(sizeof(WorkQueue) * batch.worker_count);
+	Worker* workers = (Worker*)malloc(sizeof(Worker) * batch.worker_count);
+	if ( batch.queues == NULL || workers == NULL ) exit(1);
+
+	// Each worker starts with an even, contiguous share of the scripts and
+	// steals from the others once it runs out.
+	for ( int i=0; i < batch.worker_count; i++ ) {
+		pthread_mutex_init(&batch.queues[i].lock, NULL);
+		batch.queues[i].head = (int)((long)count * i / batch.worker_count);
+		batch.queues[i].tail = (int)((long)count * (i + 1) / batch.worker_count);
+	}
+
+	double start = now_millis();
+
+	for ( int i=0; i < batch.worker_count; i++ ) {
+		workers[i].batch = &batch;
+		workers[i].id = i;
+		if ( pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0 ) {
+			fprintf(stderr, "Could not start worker thread.\n");
+			exit(71);
+		}
+	}
+
+	for ( int i=0; i < batch.worker_count; i++ ) {
+		pthread_join(workers[i].thread, NULL);
+	}
+
+	int exit_code = report(&batch, now_millis() - start);
+
+	for ( int i=0; i < batch.worker_count; i++ ) {
+		pthread_mutex_destroy(&batch.queues[i].lock);
+	}
+	for ( int i=0; i < count; i++ ) {
+		free(jobs[i].path);
+		free(jobs[i].out);
+		free(jobs[i].err);
+	}
+	free(batch.queues);
+	free(workers);
+	free(jobs);
+
+	return exit_code;
+}
@@ -0,0 +1,9 @@
+#ifndef pikey_batch_h
+#define pikey_batch_h
+
+// Runs every script in a directory, or every path listed in a file, on a
+// pool of worker threads and prints each script's output followed by a
+// timing summary. Returns the exit status for the process.
+int run_batch(const char* target);
+
+#endif // !pikey_batch_h
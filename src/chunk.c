@@ -2,6 +2,7 @@
 
 #include "chunk.h"
 #include "memory.h"
+#include "object.h"
 #include "vm.h"
 
 void init_chunk(Chunk* chunk) {
@@ -10,21 +11,26 @@ void init_chunk(Chunk* chunk) {
 	chunk->code = NULL;
 	chunk->lines = NULL;
 	init_value_array(&chunk->constants);
+	chunk->cache_count = 0;
+	chunk->cache_capacity = 0;
+	chunk->caches = NULL;
 }
 
-void free_chunk(Chunk* chunk) {
-	FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-	FREE_ARRAY(int, chunk->lines, chunk->capacity);
+void free_chunk(VM* vm, Chunk* chunk) {
+	FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
+	FREE_ARRAY(vm, int, chunk->lines, chunk->capacity);
+	FREE_ARRAY(vm, CallCache, chunk->caches, chunk->cache_capacity);
+	free_value_array(vm, &chunk->constants);
 	init_chunk(chunk);
 }
 
-void write_chunk(Chunk* chunk, uint8_t byte, int line) {
+void write_chunk(VM* vm, Chunk* chunk, uint8_t byte, int line) {
 	if ( chunk->capacity < chunk->count + 1 ) {
 		int old_capacity = chunk->capacity;
 		chunk->capacity = GROW_CAPACITY(old_capacity);
-		chunk->code = GROW_ARRAY(uint8_t, chunk->code,
+		chunk->code = GROW_ARRAY(vm, uint8_t, chunk->code,
 			old_capacity, chunk->capacity);
-		chunk->lines = GROW_ARRAY(int, chunk->lines,
+		chunk->lines = GROW_ARRAY(vm, int, chunk->lines,
 			old_capacity, chunk->capacity);
 	}
 
@@ -33,9 +39,50 @@ void write_chunk(Chunk* chunk, uint8_t byte, int line) {
 	chunk->count++;
 }
 
-int add_constant(Chunk *chunk, Value value) {
-	push(value);
-	write_value_array(&chunk->constants, value);
-	pop();
+int add_constant(VM* vm, Chunk *chunk, Value value) {
+	push(vm, value);
+	write_value_array(vm, &chunk->constants, value);
+	pop(vm);
 	return chunk->constants.count - 1;
 }
+
+int add_call_cache(VM* vm, Chunk* chunk) {
+	if ( chunk->cache_capacity < chunk->cache_count + 1 ) {
+		int old_capacity = chunk->cache_capacity;
+		chunk->cache_capacity = GROW_CAPACITY(old_capacity);
+		chunk->caches = GROW_ARRAY(vm, CallCache, chunk->caches,
+			old_capacity, chunk->cache_capacity);
+	}
+
+	chunk->caches[chunk->cache_count].callee = NULL;
+	chunk->caches[chunk->cache_count].is_native = false;
+	return chunk->cache_count++;
+}
+
+int instruction_length(Chunk* chunk, int offset) {
+	switch ( chunk->code[offset] ) {
+		case OP_CONSTANT:
+		case OP_GET_LOCAL:
+		case OP_GET_GLOBAL:
+		case OP_DEFINE_GLOBAL:
+		case OP_GET_UPVALUE:
+		case OP_GET_ENCLOSING:
+		case OP_CREATE_LIST:
+			return 2;
+		case OP_JUMP:
+		case OP_JUMP_IF_FALSE:
+		case OP_LOOP:
+		case OP_CALL_NATIVE:
+			return 3;
+		case OP_CALL:
+		case OP_ITER_NEXT:
+			return 4;
+		case OP_CLOSURE: {
+			ObjFunction* function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+			return 2 + 2 * function->upvalue_count;
+		}
+		default:
+			if ( chunk->code[offset] >= OP_SET_LOCAL && chunk->code[offset] <= OP_DEC_ENCLOSING ) return 2;
+			return 1;
+	}
+}
@@ -13,16 +13,66 @@ typedef enum {
 	OP_GET_LOCAL,
 	OP_GET_GLOBAL,
 	OP_DEFINE_GLOBAL,
+	OP_GET_UPVALUE,
+	// A local of the calling frame, read by closures the compiler proved are
+	// only ever called by the function that created them.
+	OP_GET_ENCLOSING,
+
+	// The compound assignment opcodes of each storage class follow their
+	// OP_SET_* opcode in the same order, the compiler relies on it.
 	OP_SET_LOCAL,
 	OP_ADD_SET_LOCAL,
 	OP_SUB_SET_LOCAL,
+	OP_MUL_SET_LOCAL,
+	OP_DIV_SET_LOCAL,
+	OP_MOD_SET_LOCAL,
+	OP_SHIFTL_SET_LOCAL,
+	OP_SHIFTR_SET_LOCAL,
+	OP_ANDB_SET_LOCAL,
+	OP_ORB_SET_LOCAL,
+	OP_XORB_SET_LOCAL,
+	OP_INC_LOCAL,
+	OP_DEC_LOCAL,
 	OP_SET_GLOBAL,
 	OP_ADD_SET_GLOBAL,
 	OP_SUB_SET_GLOBAL,
-	OP_GET_UPVALUE,
+	OP_MUL_SET_GLOBAL,
+	OP_DIV_SET_GLOBAL,
+	OP_MOD_SET_GLOBAL,
+	OP_SHIFTL_SET_GLOBAL,
+	OP_SHIFTR_SET_GLOBAL,
+	OP_ANDB_SET_GLOBAL,
+	OP_ORB_SET_GLOBAL,
+	OP_XORB_SET_GLOBAL,
+	OP_INC_GLOBAL,
+	OP_DEC_GLOBAL,
 	OP_SET_UPVALUE,
 	OP_ADD_SET_UPVALUE,
 	OP_SUB_SET_UPVALUE,
+	OP_MUL_SET_UPVALUE,
+	OP_DIV_SET_UPVALUE,
+	OP_MOD_SET_UPVALUE,
+	OP_SHIFTL_SET_UPVALUE,
+	OP_SHIFTR_SET_UPVALUE,
+	OP_ANDB_SET_UPVALUE,
+	OP_ORB_SET_UPVALUE,
+	OP_XORB_SET_UPVALUE,
+	OP_INC_UPVALUE,
+	OP_DEC_UPVALUE,
+	OP_SET_ENCLOSING,
+	OP_ADD_SET_ENCLOSING,
+	OP_SUB_SET_ENCLOSING,
+	OP_MUL_SET_ENCLOSING,
+	OP_DIV_SET_ENCLOSING,
+	OP_MOD_SET_ENCLOSING,
+	OP_SHIFTL_SET_ENCLOSING,
+	OP_SHIFTR_SET_ENCLOSING,
+	OP_ANDB_SET_ENCLOSING,
+	OP_ORB_SET_ENCLOSING,
+	OP_XORB_SET_ENCLOSING,
+	OP_INC_ENCLOSING,
+	OP_DEC_ENCLOSING,
+
 	OP_EQUAL,
 	OP_GREATER,
 	OP_LESSER,
@@ -44,6 +94,7 @@ typedef enum {
 	OP_JUMP_IF_FALSE,
 	OP_LOOP,
 	OP_CALL,
+	OP_CALL_NATIVE,
 	OP_CLOSURE,
 	OP_CLOSE_UPVALUE,
 	OP_RETURN,
@@ -51,22 +102,55 @@ typedef enum {
 	OP_CREATE_LIST,
 	OP_SUBSCRIPT,
 	OP_SET_SUBSCRIPT,
+	OP_ITER_INIT,
+	OP_ITER_NEXT,
+
+	// Quickened forms of generic opcodes. The compiler never emits them, the
+	// VM writes them over the generic opcode once it has seen the operand types
+	// and writes the generic opcode back when the types change.
+	OP_ADD_NUM_Q,
+	OP_ADD_STR_Q,
+	OP_SUBSCRIPT_LIST_Q,
 } OpCode;
 
+// How a variable captured by OP_CLOSURE is found, the first byte of each of
+// its operand pairs. The second is the upvalue or the local slot.
+typedef enum {
+	CAPTURE_UPVALUE,
+	CAPTURE_LOCAL,
+	// Read in place by OP_*_ENCLOSING, the closure holds no upvalue for it.
+	CAPTURE_ENCLOSING,
+} CaptureKind;
+
+// The callee last seen by an OP_CALL site. Its arity was checked against the
+// site's argument count when it was cached, so a hit can call it directly.
+typedef struct {
+	Obj* callee;
+	bool is_native;
+} CallCache;
+
 typedef struct {
 	int count;
 	int capacity;
 	uint8_t* code;
 	int* lines;
 	ValueArray constants;
+	int cache_count;
+	int cache_capacity;
+	CallCache* caches;
 } Chunk;
 
 void init_chunk(Chunk* chunk);
 
-void free_chunk(Chunk* chunk);
+void free_chunk(VM* vm, Chunk* chunk);
+
+void write_chunk(VM* vm, Chunk* chunk, uint8_t byte, int line);
+
+int add_constant(VM* vm, Chunk* chunk, Value value);
 
-void write_chunk(Chunk* chunk, uint8_t byte, int line);
+int add_call_cache(VM* vm, Chunk* chunk);
 
-int add_constant(Chunk* chunk, Value value);
+// The size in bytes of the instruction at `offset`, operands included.
+int instruction_length(Chunk* chunk, int offset);
 
 #endif // !pikey_chunk_h
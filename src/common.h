@@ -6,12 +6,21 @@
 #include <stdint.h>
 
 #define NAN_BOXING
+// #define COMPACT_VALUES
+// #define PIKEY_JIT
 // #define DEBUG_PRINT_CODE
 // #define DEBUG_TRACE_EXECUTION
 //
 // #define DEBUG_STRESS_GC
 // #define DEBUG_LOG_GC
 
+// Compact values replace NaN boxing, see value.h.
+#ifdef COMPACT_VALUES
+#undef NAN_BOXING
+#endif
+
 #define UINT8_COUNT (UINT8_MAX + 1)
 
+typedef struct VM VM;
+
 #endif // !pikey_common_h
@@ -6,6 +6,7 @@
 #include "common.h"
 #include "compiler.h"
 #include "memory.h"
+#include "natives.h"
 #include "scanner.h"
 
 #ifdef DEBUG_PRINT_CODE
@@ -15,10 +16,13 @@
 #define PARAMS_MAX 255
 
 typedef struct {
+	VM* vm;
 	Token current;
 	Token previous;
 	bool had_error;
 	bool panic_mode;
+	// The builtins whose names the script declares or assigns anywhere.
+	bool shadowed_natives[UINT8_COUNT];
 } Parser;
 
 typedef enum {
@@ -47,7 +51,13 @@ typedef struct {
 typedef struct {
 	Token name;
 	int depth;
-	bool is_captured;
+	// How many closures capture the local through an upvalue.
+	int captures;
+	// The OP_CLOSURE of a function declared into the local, -1 otherwise, and
+	// whether the closure can outlive the call, by being used as anything
+	// else than the callee of a direct call.
+	int closure;
+	bool escapes;
 } Local;
 
 typedef struct {
@@ -69,10 +79,13 @@ typedef struct Compiler {
 	int local_count;
 	Upvalue upvalues[UINT8_COUNT];
 	int scope_depth;
+
+	int increment_start;
+	int increment_end;
 } Compiler;
 
-Parser parser;
-Compiler* current = NULL;
+_Thread_local Parser parser;
+_Thread_local Compiler* current = NULL;
 
 static Chunk* current_chunk() {
 	return &current->function->chunk;
@@ -81,16 +94,16 @@ static Chunk* current_chunk() {
 static void error_at(Token* token, const char* message) {
 	if ( parser.panic_mode ) return;
 	parser.panic_mode = true;
-	fprintf(stderr, "[line %d] Error", token->line);
+	fprintf(parser.vm->err, "[line %d] Error", token->line);
 
 	if ( token->type == TOKEN_EOF ) {
-		fprintf(stderr, " at end");
+		fprintf(parser.vm->err, " at end");
 	} else if ( token->type == TOKEN_ERROR ) {
 	} else {
-		fprintf(stderr, " at '%.*s'", token->length, token->start);
+		fprintf(parser.vm->err, " at '%.*s'", token->length, token->start);
 	}
 
-	fprintf(stderr, ": %s\n", message);
+	fprintf(parser.vm->err, ": %s\n", message);
 	parser.had_error = true;
 }
 
@@ -134,7 +147,7 @@ static bool match(TokenType type) {
 }
 
 static void emit_byte(uint8_t byte) {
-	write_chunk(current_chunk(), byte, parser.previous.line);
+	write_chunk(parser.vm, current_chunk(), byte, parser.previous.line);
 }
 
 static void emit_bytes(uint8_t byte1, uint8_t byte2) {
@@ -165,7 +178,7 @@ static void emit_return() {
 }
 
 static uint8_t make_constant(Value value) {
-	int constant = add_constant(current_chunk(), value);
+	int constant = add_constant(parser.vm, current_chunk(), value);
 	if ( constant > UINT8_MAX ) {
 		error("Too many constants in one chunk.");
 		return 0;
@@ -183,25 +196,29 @@ static void init_compiler(Compiler* compiler, FunctionType type) {
 	compiler->function = NULL;
 	compiler->type = type;
 
-	compiler->function = new_function();
+	compiler->function = new_function(parser.vm);
 
 	compiler->local_count = 0;
 	compiler->scope_depth = 0;
+	compiler->increment_start = -1;
+	compiler->increment_end = -1;
 
 	current = compiler;
 
 	if ( type != TYPE_SCRIPT ) {
-		current->function->name = copy_string(parser.previous.start, parser.previous.length);
+		current->function->name = copy_string(parser.vm, parser.previous.start, parser.previous.length);
 	}
 
 	Local* local = &current->locals[current->local_count++];
 	local->depth = 0;
-	local->is_captured = false;
+	local->captures = 0;
+	local->closure = -1;
+	local->escapes = false;
 	local->name.start = "";
 	local->name.length = 0;
 
 	if ( type != TYPE_SCRIPT ) {
-		current->function->name = copy_string(parser.previous.start, parser.previous.length);
+		current->function->name = copy_string(parser.vm, parser.previous.start, parser.previous.length);
 	}
 }
 
@@ -216,13 +233,71 @@ static void patch_jump(int offset) {
 	current_chunk()->code[offset + 1] = jump &  0xff;
 }
 
+// A closure that never escapes is only ever called by the frame that created
+// it, from right above that frame. The locals it captured stay alive in that
+// frame for as long as the closure can run, so once every use of the closure
+// has been seen its upvalue instructions are rewritten to read them there and
+// OP_CLOSURE no longer allocates upvalues for them.
+//
+// Upvalues it passes on to closures of its own are left alone, those closures
+// need a real upvalue to capture.
+static void resolve_escape(Local* local) {
+	if ( local->closure == -1 || local->escapes ) return;
+
+	Chunk* chunk = current_chunk();
+	uint8_t* captures = &chunk->code[local->closure + 2];
+	ObjFunction* function = AS_FUNCTION(chunk->constants.values[chunk->code[local->closure + 1]]);
+	Chunk* body = &function->chunk;
+	bool in_place[UINT8_COUNT] = { false };
+
+	for ( int i=0; i < function->upvalue_count; i++ ) {
+		in_place[i] = captures[2 * i] == CAPTURE_LOCAL;
+	}
+
+	for ( int offset=0; offset < body->count; offset += instruction_length(body, offset) ) {
+		if ( body->code[offset] != OP_CLOSURE ) continue;
+
+		ObjFunction* inner = AS_FUNCTION(body->constants.values[body->code[offset + 1]]);
+		for ( int i=0; i < inner->upvalue_count; i++ ) {
+			if ( body->code[offset + 2 + 2 * i] == CAPTURE_UPVALUE ) {
+				in_place[body->code[offset + 3 + 2 * i]] = false;
+			}
+		}
+	}
+
+	for ( int offset=0; offset < body->count; offset += instruction_length(body, offset) ) {
+		uint8_t instruction = body->code[offset];
+		bool is_upvalue = instruction == OP_GET_UPVALUE ||
+			(instruction >= OP_SET_UPVALUE && instruction <= OP_DEC_UPVALUE);
+		if ( !is_upvalue ) continue;
+
+		uint8_t upvalue = body->code[offset + 1];
+		if ( !in_place[upvalue] ) continue;
+
+		body->code[offset] = instruction == OP_GET_UPVALUE ? OP_GET_ENCLOSING :
+			OP_SET_ENCLOSING + (instruction - OP_SET_UPVALUE);
+		body->code[offset + 1] = captures[2 * upvalue + 1];
+	}
+
+	for ( int i=0; i < function->upvalue_count; i++ ) {
+		if ( !in_place[i] ) continue;
+
+		captures[2 * i] = CAPTURE_ENCLOSING;
+		current->locals[captures[2 * i + 1]].captures--;
+	}
+}
+
 static ObjFunction* end_compiler() {
+	for ( int i=current->local_count - 1; i >= 0; i-- ) {
+		resolve_escape(&current->locals[i]);
+	}
+
 	emit_return();
 	ObjFunction* function = current->function;
 
 #ifdef DEBUG_PRINT_CODE
 	if ( !parser.had_error ) {
-		dissasemble_chunk(current_chunk(), function->name != NULL ? function->name->chars : "<script>");
+		disassemble_chunk(current_chunk(), function->name != NULL ? function->name->chars : "<script>");
 	}
 #endif
 
@@ -241,7 +316,10 @@ static void end_scope() {
 		current->locals[current->local_count - 1].depth >
 			current->scope_depth) {
 
-		if ( current->locals[current->local_count - 1].is_captured ) {
+		Local* local = &current->locals[current->local_count - 1];
+		resolve_escape(local);
+
+		if ( local->captures > 0 ) {
 			emit_byte(OP_CLOSE_UPVALUE);
 		} else {
 			emit_byte(OP_POP);
@@ -259,7 +337,7 @@ static void parse_precedence(Precedence precedence);
 static uint8_t argument_list();
 
 static uint8_t identifier_constant(Token* name) {
-	return make_constant(OBJ_VAL(copy_string(name->start, name->length)));
+	return make_constant(OBJ_VAL(copy_string(parser.vm, name->start, name->length)));
 }
 
 static bool identifiers_equal(Token* a, Token* b) {
@@ -308,8 +386,13 @@ static int resolve_upvalue(Compiler* compiler, Token* name) {
 
 	int local = resolve_local(compiler->enclosing, name);
 	if ( local != -1 ) {
-		compiler->enclosing->locals[local].is_captured = true;
-		return add_upvalue(compiler, (uint8_t)local, true);
+		Local* captured = &compiler->enclosing->locals[local];
+		int upvalue_count = compiler->function->upvalue_count;
+		int upvalue = add_upvalue(compiler, (uint8_t)local, true);
+
+		if ( compiler->function->upvalue_count > upvalue_count ) captured->captures++;
+		captured->escapes = true;
+		return upvalue;
 	}
 
 	int upvalue = resolve_upvalue(compiler->enclosing, name);
@@ -329,7 +412,9 @@ static void add_local(Token name) {
 	Local* local = &current->locals[current->local_count++];
 	local->name = name;
 	local->depth = -1;
-	local->is_captured = false;
+	local->captures = 0;
+	local->closure = -1;
+	local->escapes = false;
 }
 
 static void declare_variable() {
@@ -381,7 +466,43 @@ static void binary(bool can_assign) {
 
 static void call(bool can_assign) {
 	uint8_t arg_count = argument_list();
+	int cache = add_call_cache(parser.vm, current_chunk());
+
+	if ( cache > UINT16_MAX ) {
+		error("Too many calls in one function.");
+	}
+
 	emit_bytes(OP_CALL, arg_count);
+	emit_bytes((cache >> 8) & 0xff, cache & 0xff);
+}
+
+// A call through a builtin's name can skip the callee lookup and have its
+// argument count checked right here, as long as the name holds the builtin:
+// the script never gives it another value, and no earlier script run on the
+// VM did. OP_CALL_NATIVE still checks at run time, for a name given another
+// value by a script compiled later.
+static bool holds_builtin(int native) {
+	return !parser.shadowed_natives[native] && !parser.vm->shadowed_natives[native];
+}
+
+static void native_call(int native) {
+	uint8_t arg_count = argument_list();
+	const NativeDef* def = &natives[native];
+
+	if ( arg_count < def->min_arity || arg_count > def->max_arity ) {
+		char message[64];
+
+		if ( def->min_arity == def->max_arity ) {
+			snprintf(message, sizeof(message), "Expected %d arguments but got %d.", def->min_arity, arg_count);
+		} else {
+			snprintf(message, sizeof(message), "Expected %d to %d arguments but got %d.", def->min_arity, def->max_arity, arg_count);
+		}
+
+		error(message);
+	}
+
+	emit_bytes(OP_CALL_NATIVE, (uint8_t)native);
+	emit_byte(arg_count);
 }
 
 static void literal(bool can_assign) {
@@ -438,8 +559,16 @@ static void subscript(bool can_assign) {
 }
 
 static void number(bool can_assign) {
-	double value = strtod(parser.previous.start, NULL);
-	emit_constant(NUMBER_VAL(value));
+	Value value = NUMBER_VAL(parser.vm, strtod(parser.previous.start, NULL));
+
+	// Numbers written without a fraction start out as ints. One written as
+	// 1.0 stays a double, so that arithmetic on doubles isn't mixed.
+	int32_t integer;
+	if ( memchr(parser.previous.start, '.', parser.previous.length) == NULL && number_to_int(value, &integer) ) {
+		value = INT32_VAL(parser.vm, integer);
+	}
+
+	emit_constant(value);
 }
 
 static void and_(bool can_assign) {
@@ -463,43 +592,80 @@ static void or_(bool can_assign) {
 }
 
 static void string(bool can_assign) {
-	emit_constant(OBJ_VAL(copy_string(parser.previous.start + 1, parser.previous.length - 2)));
+	emit_constant(OBJ_VAL(copy_string(parser.vm, parser.previous.start + 1, parser.previous.length - 2)));
+}
+
+static int compound_assign_offset(TokenType type) {
+	switch ( type ) {
+		case TOKEN_PLUS_EQUAL:              return 1;
+		case TOKEN_MINUS_EQUAL:             return 2;
+		case TOKEN_STAR_EQUAL:              return 3;
+		case TOKEN_SLASH_EQUAL:             return 4;
+		case TOKEN_PERCENT_EQUAL:           return 5;
+		case TOKEN_LESSER_LESSER_EQUAL:     return 6;
+		case TOKEN_GREATER_GREATER_EQUAL:   return 7;
+		case TOKEN_AMPERSAND_EQUAL:         return 8;
+		case TOKEN_PIPE_EQUAL:              return 9;
+		case TOKEN_CARET_EQUAL:             return 10;
+		case TOKEN_PLUS_PLUS:               return 11;
+		case TOKEN_MINUS_MINUS:             return 12;
+		default:                            return -1;
+	}
+}
+
+static bool is_assignment_operator(TokenType type) {
+	return type == TOKEN_EQUAL || compound_assign_offset(type) != -1;
 }
 
 static void named_variable(Token name, bool can_assign) {
-	uint8_t getOp, setOp, addOp, subOp;
+	uint8_t getOp, setOp;
 	int arg = resolve_local(current, &name);
 
 	if ( arg != -1 ) {
 		getOp = OP_GET_LOCAL;
 		setOp = OP_SET_LOCAL;
-		addOp = OP_ADD_SET_LOCAL;
-		subOp = OP_SUB_SET_LOCAL;
+
+		bool is_assigned = can_assign && is_assignment_operator(parser.current.type);
+		if ( is_assigned || !check(TOKEN_LEFT_PAREN) ) {
+			current->locals[arg].escapes = true;
+		}
 	} else if ( (arg = resolve_upvalue(current, &name)) != -1 ) {
 		getOp = OP_GET_UPVALUE;
 		setOp = OP_SET_UPVALUE;
-		addOp = OP_ADD_SET_UPVALUE;
-		subOp = OP_SUB_SET_UPVALUE;
 	} else {
+		int native = find_native(name.start, name.length);
+
+		if ( native != -1 && holds_builtin(native) && match(TOKEN_LEFT_PAREN) ) {
+			native_call(native);
+			return;
+		}
+
 		arg = identifier_constant(&name);
 		getOp = OP_GET_GLOBAL;
 		setOp = OP_SET_GLOBAL;
-		addOp = OP_ADD_SET_GLOBAL;
-		subOp = OP_SUB_SET_GLOBAL;
 	}
 
 	if ( can_assign ) {
+		int offset = compound_assign_offset(parser.current.type);
+
 		if ( match(TOKEN_EQUAL) ) {
 			expression();
 			emit_bytes(setOp, (uint8_t)arg);
 			return;
-		} else if ( match(TOKEN_PLUS_EQUAL) ) {
-			expression();
-			emit_bytes(addOp, (uint8_t)arg);
+		} else if ( check(TOKEN_PLUS_PLUS) || check(TOKEN_MINUS_MINUS) ) {
+			advance();
+
+			// The old value is the result of the expression, the increment
+			// itself happens in place without touching the stack.
+			current->increment_start = current_chunk()->count;
+			emit_bytes(getOp, (uint8_t)arg);
+			emit_bytes(setOp + offset, (uint8_t)arg);
+			current->increment_end = current_chunk()->count;
 			return;
-		} else if ( match(TOKEN_MINUS_EQUAL) ) {
+		} else if ( offset != -1 ) {
+			advance();
 			expression();
-			emit_bytes(subOp, (uint8_t)arg);
+			emit_bytes(setOp + offset, (uint8_t)arg);
 			return;
 		}
 	}
@@ -573,6 +739,16 @@ ParseRule rules[] = {
 	[TOKEN_CARET]           = {NULL,   binary,      PREC_TERM},
 	[TOKEN_GREATER_GREATER] = {NULL,   binary,      PREC_TERM},
 	[TOKEN_LESSER_LESSER]   = {NULL,   binary,      PREC_TERM},
+	[TOKEN_STAR_EQUAL]      = {NULL,     NULL,      PREC_NONE},
+	[TOKEN_SLASH_EQUAL]     = {NULL,     NULL,      PREC_NONE},
+	[TOKEN_PERCENT_EQUAL]   = {NULL,     NULL,      PREC_NONE},
+	[TOKEN_LESSER_LESSER_EQUAL]   = {NULL, NULL,    PREC_NONE},
+	[TOKEN_GREATER_GREATER_EQUAL] = {NULL, NULL,    PREC_NONE},
+	[TOKEN_AMPERSAND_EQUAL] = {NULL,     NULL,      PREC_NONE},
+	[TOKEN_PIPE_EQUAL]      = {NULL,     NULL,      PREC_NONE},
+	[TOKEN_CARET_EQUAL]     = {NULL,     NULL,      PREC_NONE},
+	[TOKEN_PLUS_PLUS]       = {NULL,     NULL,      PREC_NONE},
+	[TOKEN_MINUS_MINUS]     = {NULL,     NULL,      PREC_NONE},
 };
 
 static void parse_precedence(Precedence precedence) {
@@ -592,7 +768,8 @@ static void parse_precedence(Precedence precedence) {
 		infix_rule(can_assign);
 	}
 
-	if ( can_assign && match(TOKEN_EQUAL) ) {
+	if ( can_assign && is_assignment_operator(parser.current.type) ) {
+		advance();
 		error("Invalid assignment target.");
 	}
 }
@@ -679,10 +856,22 @@ static void function(FunctionType type) {
 	block();
 
 	ObjFunction* function = end_compiler();
+
+	// A function that captures nothing gets the same closure every time its
+	// declaration runs, so it is made once here and loaded as a constant.
+	if ( function->upvalue_count == 0 ) {
+		push(parser.vm, OBJ_VAL(function));
+		ObjClosure* closure = new_closure(parser.vm, function);
+		pop(parser.vm);
+
+		emit_constant(OBJ_VAL(closure));
+		return;
+	}
+
 	emit_bytes(OP_CLOSURE, make_constant(OBJ_VAL(function)));
 
 	for ( int i=0; i < function->upvalue_count; i++ ) {
-		emit_byte(compiler.upvalues[i].is_local ? 1 : 0);
+		emit_byte(compiler.upvalues[i].is_local ? CAPTURE_LOCAL : CAPTURE_UPVALUE);
 		emit_byte(compiler.upvalues[i].index);
 	}
 }
@@ -690,7 +879,13 @@ static void function(FunctionType type) {
 static void function_declaration() {
 	uint8_t global = parse_variable("Expect function name.");
 	mark_initialized();
+
+	int closure = current_chunk()->count;
 	function(TYPE_FUNCTION);
+
+	if ( current->scope_depth > 0 && current_chunk()->code[closure] == OP_CLOSURE ) {
+		current->locals[current->local_count - 1].closure = closure;
+	}
 	define_variable(global);
 }
 
@@ -708,16 +903,72 @@ static void var_declaration() {
 	define_variable(global);
 }
 
-static void expression_statement() {
+static void discard_expression() {
+	int start = current_chunk()->count;
 	expression();
-	consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
+
+	// A lone `x++` does not need its old value, drop the leading get so the
+	// update is a single in-place instruction.
+	if ( current->increment_start == start &&
+		current->increment_end == current_chunk()->count ) {
+
+		Chunk* chunk = current_chunk();
+		memmove(&chunk->code[start], &chunk->code[start + 2], 2);
+		chunk->count -= 2;
+		return;
+	}
+
 	emit_byte(OP_POP);
 }
 
+static void expression_statement() {
+	discard_expression();
+	consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
+}
+
+static void for_each_statement() {
+	Token name = parser.current;
+	advance();
+	consume(TOKEN_SEMICOLON, "Expect ';' after loop variable.");
+
+	expression();
+	consume(TOKEN_RIGHT_PAREN, "Expect ')' after sequence.");
+
+	// The sequence and the index of the next item live in two hidden locals.
+	Token hidden = { .start = "", .length = 0 };
+	add_local(hidden);
+	mark_initialized();
+	uint8_t sequence_slot = (uint8_t)(current->local_count - 1);
+
+	emit_byte(OP_ITER_INIT);
+	add_local(hidden);
+	mark_initialized();
+
+	int loop_start = current_chunk()->count;
+	emit_bytes(OP_ITER_NEXT, sequence_slot);
+	emit_bytes(0xff, 0xff);
+	int exit_jump = current_chunk()->count - 2;
+
+	begin_scope();
+	add_local(name);
+	mark_initialized();
+	statement();
+	end_scope();
+
+	emit_loop(loop_start);
+	patch_jump(exit_jump);
+}
+
 static void for_statement() {
 	begin_scope();
 	consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
 
+	if ( check(TOKEN_IDENTIFIER) && peek_token().type == TOKEN_SEMICOLON ) {
+		for_each_statement();
+		end_scope();
+		return;
+	}
+
 	if ( match(TOKEN_SEMICOLON ) ) {
 	} else if ( match(TOKEN_VAR) ) {
 		var_declaration();
@@ -740,8 +991,7 @@ static void for_statement() {
 		int body_jump = emit_jump(OP_JUMP);
 		int increment_start = current_chunk()->count;
 
-		expression();
-		emit_byte(OP_POP);
+		discard_expression();
 		consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
 		emit_loop(loop_start);
@@ -877,9 +1127,39 @@ static void declaration() {
 	if ( parser.panic_mode ) synchronize();
 }
 
-ObjFunction* compile(const char* source) {
+// Looks through the whole script for the builtins it declares or assigns,
+// since a function can call one before the script gets to the line that
+// gives its name another value. A local of that name counts too, which only
+// costs the calls the direct path.
+static void find_shadowed_natives(const char* source) {
+	memset(parser.shadowed_natives, 0, sizeof(parser.shadowed_natives));
+	init_scanner(source);
+
+	Token previous = scan_token();
+	while ( previous.type != TOKEN_EOF ) {
+		Token token = scan_token();
+		Token* name = NULL;
+
+		if ( previous.type == TOKEN_IDENTIFIER && is_assignment_operator(token.type) ) {
+			name = &previous;
+		} else if ( (previous.type == TOKEN_FUNCTION || previous.type == TOKEN_VAR) && token.type == TOKEN_IDENTIFIER ) {
+			name = &token;
+		}
+
+		if ( name != NULL ) {
+			int native = find_native(name->start, name->length);
+			if ( native != -1 ) parser.shadowed_natives[native] = true;
+		}
+
+		previous = token;
+	}
+}
+
+ObjFunction* compile(VM* vm, const char* source) {
+	find_shadowed_natives(source);
 	init_scanner(source);
 
+	parser.vm = vm;
 	Compiler compiler;
 	init_compiler(&compiler, TYPE_SCRIPT);
 
@@ -896,11 +1176,11 @@ ObjFunction* compile(const char* source) {
 	return parser.had_error ? NULL : function;
 }
 
-void mark_compiler_roots() {
+void mark_compiler_roots(VM* vm) {
 	Compiler* compiler = current;
 
 	while ( compiler != NULL ) {
-		mark_object((Obj*)compiler->function);
+		mark_object(vm, (Obj*)compiler->function);
 		compiler = compiler->enclosing;
 	}
 }
@@ -4,8 +4,8 @@
 #include "object.h"
 #include "vm.h"
 
-ObjFunction* compile(const char* source);
+ObjFunction* compile(VM* vm, const char* source);
 
-void mark_compiler_roots();
+void mark_compiler_roots(VM* vm);
 
 #endif // !pikey_compiler_h
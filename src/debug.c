@@ -1,6 +1,7 @@
 #include <stdio.h>
 
 #include "debug.h"
+#include "natives.h"
 #include "object.h"
 #include "value.h"
 
@@ -15,7 +16,7 @@ void disassemble_chunk(Chunk *chunk, const char *name) {
 static int constant_instruction(const char* name, Chunk *chunk, int offset) {
 	uint8_t constant = chunk->code[offset + 1];
 	printf("%-16s %4d '", name, constant);
-	print_value(chunk->constants.values[constant]);
+	print_value(stdout, chunk->constants.values[constant]);
 	printf("'\n");
 
 	return offset + 2;
@@ -24,7 +25,7 @@ static int constant_instruction(const char* name, Chunk *chunk, int offset) {
 static int simple_instruction(const char* name, int offset) {
 	printf("%s\n", name);
 
-	return offset - 1;
+	return offset + 1;
 }
 
 static int byte_instruction(const char* name, Chunk* chunk, int offset) {
@@ -33,6 +34,29 @@ static int byte_instruction(const char* name, Chunk* chunk, int offset) {
 	return offset + 2;
 }
 
+static int iter_instruction(const char* name, Chunk* chunk, int offset) {
+	uint8_t slot = chunk->code[offset + 1];
+	uint16_t jump = (uint16_t)(chunk->code[offset + 2] << 8);
+	jump |= chunk->code[offset + 3];
+	printf("%-16s %4d -> %d\n", name, slot, offset + 4 + jump);
+	return offset + 4;
+}
+
+static int call_instruction(const char* name, Chunk* chunk, int offset) {
+	uint8_t arg_count = chunk->code[offset + 1];
+	uint16_t cache = (uint16_t)(chunk->code[offset + 2] << 8);
+	cache |= chunk->code[offset + 3];
+	printf("%-16s %4d (cache %d)\n", name, arg_count, cache);
+	return offset + 4;
+}
+
+static int native_instruction(const char* name, Chunk* chunk, int offset) {
+	uint8_t native = chunk->code[offset + 1];
+	uint8_t arg_count = chunk->code[offset + 2];
+	printf("%-16s %4d '%s' (%d args)\n", name, native, natives[native].name, arg_count);
+	return offset + 3;
+}
+
 static int jump_instruction(const char* name, int sign, Chunk* chunk, int offset) {
 	uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
 	jump |= chunk->code[offset + 2];
@@ -63,6 +87,56 @@ int disassemble_instruction(Chunk* chunk, int offset) {
 		case OP_SET_LOCAL:     return byte_instruction("OP_SET_LOCAL",         chunk, offset);
 		case OP_SET_GLOBAL:    return constant_instruction("OP_SET_GLOBAL",    chunk, offset);
 		case OP_SET_UPVALUE:   return byte_instruction("OP_SET_UPVALUE",       chunk, offset);
+		case OP_GET_ENCLOSING: return byte_instruction("OP_GET_ENCLOSING",     chunk, offset);
+		case OP_ADD_SET_LOCAL:     return byte_instruction("OP_ADD_SET_LOCAL",           chunk, offset);
+		case OP_SUB_SET_LOCAL:     return byte_instruction("OP_SUB_SET_LOCAL",           chunk, offset);
+		case OP_MUL_SET_LOCAL:     return byte_instruction("OP_MUL_SET_LOCAL",           chunk, offset);
+		case OP_DIV_SET_LOCAL:     return byte_instruction("OP_DIV_SET_LOCAL",           chunk, offset);
+		case OP_MOD_SET_LOCAL:     return byte_instruction("OP_MOD_SET_LOCAL",           chunk, offset);
+		case OP_SHIFTL_SET_LOCAL:  return byte_instruction("OP_SHIFTL_SET_LOCAL",        chunk, offset);
+		case OP_SHIFTR_SET_LOCAL:  return byte_instruction("OP_SHIFTR_SET_LOCAL",        chunk, offset);
+		case OP_ANDB_SET_LOCAL:    return byte_instruction("OP_ANDB_SET_LOCAL",          chunk, offset);
+		case OP_ORB_SET_LOCAL:     return byte_instruction("OP_ORB_SET_LOCAL",           chunk, offset);
+		case OP_XORB_SET_LOCAL:    return byte_instruction("OP_XORB_SET_LOCAL",          chunk, offset);
+		case OP_INC_LOCAL:         return byte_instruction("OP_INC_LOCAL",               chunk, offset);
+		case OP_DEC_LOCAL:         return byte_instruction("OP_DEC_LOCAL",               chunk, offset);
+		case OP_ADD_SET_GLOBAL:    return constant_instruction("OP_ADD_SET_GLOBAL",      chunk, offset);
+		case OP_SUB_SET_GLOBAL:    return constant_instruction("OP_SUB_SET_GLOBAL",      chunk, offset);
+		case OP_MUL_SET_GLOBAL:    return constant_instruction("OP_MUL_SET_GLOBAL",      chunk, offset);
+		case OP_DIV_SET_GLOBAL:    return constant_instruction("OP_DIV_SET_GLOBAL",      chunk, offset);
+		case OP_MOD_SET_GLOBAL:    return constant_instruction("OP_MOD_SET_GLOBAL",      chunk, offset);
+		case OP_SHIFTL_SET_GLOBAL: return constant_instruction("OP_SHIFTL_SET_GLOBAL",   chunk, offset);
+		case OP_SHIFTR_SET_GLOBAL: return constant_instruction("OP_SHIFTR_SET_GLOBAL",   chunk, offset);
+		case OP_ANDB_SET_GLOBAL:   return constant_instruction("OP_ANDB_SET_GLOBAL",     chunk, offset);
+		case OP_ORB_SET_GLOBAL:    return constant_instruction("OP_ORB_SET_GLOBAL",      chunk, offset);
+		case OP_XORB_SET_GLOBAL:   return constant_instruction("OP_XORB_SET_GLOBAL",     chunk, offset);
+		case OP_INC_GLOBAL:        return constant_instruction("OP_INC_GLOBAL",          chunk, offset);
+		case OP_DEC_GLOBAL:        return constant_instruction("OP_DEC_GLOBAL",          chunk, offset);
+		case OP_ADD_SET_UPVALUE:   return byte_instruction("OP_ADD_SET_UPVALUE",         chunk, offset);
+		case OP_SUB_SET_UPVALUE:   return byte_instruction("OP_SUB_SET_UPVALUE",         chunk, offset);
+		case OP_MUL_SET_UPVALUE:   return byte_instruction("OP_MUL_SET_UPVALUE",         chunk, offset);
+		case OP_DIV_SET_UPVALUE:   return byte_instruction("OP_DIV_SET_UPVALUE",         chunk, offset);
+		case OP_MOD_SET_UPVALUE:   return byte_instruction("OP_MOD_SET_UPVALUE",         chunk, offset);
+		case OP_SHIFTL_SET_UPVALUE:return byte_instruction("OP_SHIFTL_SET_UPVALUE",      chunk, offset);
+		case OP_SHIFTR_SET_UPVALUE:return byte_instruction("OP_SHIFTR_SET_UPVALUE",      chunk, offset);
+		case OP_ANDB_SET_UPVALUE:  return byte_instruction("OP_ANDB_SET_UPVALUE",        chunk, offset);
+		case OP_ORB_SET_UPVALUE:   return byte_instruction("OP_ORB_SET_UPVALUE",         chunk, offset);
+		case OP_XORB_SET_UPVALUE:  return byte_instruction("OP_XORB_SET_UPVALUE",        chunk, offset);
+		case OP_INC_UPVALUE:       return byte_instruction("OP_INC_UPVALUE",             chunk, offset);
+		case OP_DEC_UPVALUE:       return byte_instruction("OP_DEC_UPVALUE",             chunk, offset);
+		case OP_SET_ENCLOSING:     return byte_instruction("OP_SET_ENCLOSING",           chunk, offset);
+		case OP_ADD_SET_ENCLOSING: return byte_instruction("OP_ADD_SET_ENCLOSING",       chunk, offset);
+		case OP_SUB_SET_ENCLOSING: return byte_instruction("OP_SUB_SET_ENCLOSING",       chunk, offset);
+		case OP_MUL_SET_ENCLOSING: return byte_instruction("OP_MUL_SET_ENCLOSING",       chunk, offset);
+		case OP_DIV_SET_ENCLOSING: return byte_instruction("OP_DIV_SET_ENCLOSING",       chunk, offset);
+		case OP_MOD_SET_ENCLOSING: return byte_instruction("OP_MOD_SET_ENCLOSING",       chunk, offset);
+		case OP_SHIFTL_SET_ENCLOSING:return byte_instruction("OP_SHIFTL_SET_ENCLOSING",    chunk, offset);
+		case OP_SHIFTR_SET_ENCLOSING:return byte_instruction("OP_SHIFTR_SET_ENCLOSING",    chunk, offset);
+		case OP_ANDB_SET_ENCLOSING:return byte_instruction("OP_ANDB_SET_ENCLOSING",      chunk, offset);
+		case OP_ORB_SET_ENCLOSING: return byte_instruction("OP_ORB_SET_ENCLOSING",       chunk, offset);
+		case OP_XORB_SET_ENCLOSING:return byte_instruction("OP_XORB_SET_ENCLOSING",      chunk, offset);
+		case OP_INC_ENCLOSING:     return byte_instruction("OP_INC_ENCLOSING",           chunk, offset);
+		case OP_DEC_ENCLOSING:     return byte_instruction("OP_DEC_ENCLOSING",           chunk, offset);
 		case OP_EQUAL:         return simple_instruction("OP_EQUAL",                  offset);
 		case OP_GREATER:       return simple_instruction("OP_GREATER",                offset);
 		case OP_LESSER:        return simple_instruction("OP_LESSER",                 offset);
@@ -76,28 +150,35 @@ int disassemble_instruction(Chunk* chunk, int offset) {
 		case OP_JUMP:          return jump_instruction("OP_JUMP",           1, chunk, offset);
 		case OP_JUMP_IF_FALSE: return jump_instruction("OP_JUMP_IF_FALSE",  1, chunk, offset);
 		case OP_LOOP:          return jump_instruction("OP_LOOP",          -1, chunk, offset);
-		case OP_CALL:          return byte_instruction("OP_CALL",              chunk, offset);
+		case OP_CALL:          return call_instruction("OP_CALL",              chunk, offset);
+		case OP_CALL_NATIVE:   return native_instruction("OP_CALL_NATIVE",     chunk, offset);
 		case OP_CLOSE_UPVALUE: return simple_instruction("OP_CLOSE_UPVALUE",          offset);
 		case OP_CLOSURE: {
 			offset ++;
 			uint8_t constant = chunk->code[offset];
 			printf("%-16s %4d ", "OP_CLOSURE", constant);
-			print_value(chunk->constants.values[constant]);
+			print_value(stdout, chunk->constants.values[constant]);
 			printf("\n");
 
 			ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
 			for ( int j=0; j < function->upvalue_count; j++ ) {
 				int is_local = chunk->code[offset++];
 				int index = chunk->code[offset++];
-				printf("%04d      |                     %s %d\n", offset - 2, is_local ? "local" : "upvalue", index);
+				printf("%04d      |                     %s %d\n", offset - 2, is_local == CAPTURE_LOCAL ? "local" :
+					is_local == CAPTURE_ENCLOSING ? "enclosing" : "upvalue", index);
 			}
 
 			return offset;
 		}
+		case OP_ITER_INIT:     return simple_instruction("OP_ITER_INIT",              offset);
+		case OP_ITER_NEXT:     return iter_instruction("OP_ITER_NEXT",         chunk, offset);
 		case OP_RETURN:        return simple_instruction("OP_RETURN",                 offset);
+		case OP_ADD_NUM_Q:        return simple_instruction("OP_ADD_NUM_Q",        offset);
+		case OP_ADD_STR_Q:        return simple_instruction("OP_ADD_STR_Q",        offset);
+		case OP_SUBSCRIPT_LIST_Q: return simple_instruction("OP_SUBSCRIPT_LIST_Q", offset);
 		default: {
-			printf("Unknown opcode %d", instruction);
-			return offset - 1;
+			printf("Unknown opcode %d\n", instruction);
+			return offset + 1;
 		}
 	}
 }
@@ -0,0 +1,598 @@
+#include <math.h>
+#include <stdlib.h>
+
+#include "chunk.h"
+#include "compiler.h"
+#include "emit.h"
+#include "object.h"
+
+// Every instruction of a function the compiler produces is reached with the
+// same number of values on the stack, whichever way control gets there. The
+// emitter works that depth out for each instruction and turns the stack
+// into slots[depth] accesses with constant offsets, so the C has no stack
+// pointer to maintain and no dispatch. Numbers, locals, upvalues and
+// branches are handled in the emitted code, everything else goes through the
+// runtime paths in runtime.h.
+
+#define UNREACHED -1
+
+typedef struct {
+	ObjFunction** items;
+	int count;
+	int capacity;
+} FunctionList;
+
+static int function_index(FunctionList* functions, ObjFunction* function) {
+	for ( int i=0; i < functions->count; i++ ) {
+		if ( functions->items[i] == function ) return i;
+	}
+
+	return -1;
+}
+
+// Lists the function and everything nested in it, the script first.
+static void collect_functions(FunctionList* functions, ObjFunction* function) {
+	if ( functions->count == functions->capacity ) {
+		functions->capacity = functions->capacity < 8 ? 8 : functions->capacity * 2;
+		functions->items = (ObjFunction**)realloc(functions->items, sizeof(ObjFunction*) * functions->capacity);
+		if ( functions->items == NULL ) exit(1);
+	}
+	functions->items[functions->count++] = function;
+
+	ValueArray* constants = &function->chunk.constants;
+	for ( int i=0; i < constants->count; i++ ) {
+		if ( IS_FUNCTION(constants->values[i]) ) {
+			collect_functions(functions, AS_FUNCTION(constants->values[i]));
+		} else if ( IS_CLOSURE(constants->values[i]) ) {
+			collect_functions(functions, AS_CLOSURE(constants->values[i])->function);
+		}
+	}
+}
+
+// How many values the instruction leaves on the stack compared to before.
+static int stack_effect(Chunk* chunk, int offset) {
+	uint8_t* code = &chunk->code[offset];
+
+	switch ( code[0] ) {
+		case OP_CONSTANT:
+		case OP_NULL:
+		case OP_TRUE:
+		case OP_FALSE:
+		case OP_GET_LOCAL:
+		case OP_GET_GLOBAL:
+		case OP_GET_UPVALUE:
+		case OP_GET_ENCLOSING:
+		case OP_CLOSURE:
+		case OP_ITER_INIT:
+			return 1;
+		case OP_POP:
+		case OP_DEFINE_GLOBAL:
+		case OP_CLOSE_UPVALUE:
+		case OP_TYPE:
+		case OP_WAIT:
+		case OP_SUBSCRIPT:
+		case OP_SUBSCRIPT_LIST_Q:
+		case OP_ADD_NUM_Q:
+		case OP_ADD_STR_Q:
+			return -1;
+		case OP_SET_SUBSCRIPT:
+			return -2;
+		case OP_CALL:
+			return -code[1];
+		case OP_CALL_NATIVE:
+			return 1 - code[2];
+		case OP_CREATE_LIST:
+			return 1 - code[1];
+		default:
+			if ( code[0] >= OP_EQUAL && code[0] <= OP_SHIFTL ) return -1;
+			return 0;
+	}
+}
+
+static bool reach(int* depths, int* work, int* work_count, int offset, int depth) {
+	if ( depths[offset] == UNREACHED ) {
+		depths[offset] = depth;
+		work[(*work_count)++] = offset;
+		return true;
+	}
+
+	return depths[offset] == depth;
+}
+
+// Finds the stack depth at each instruction, UNREACHED for dead code, or
+// returns NULL if the depths don't agree and the function can't be emitted.
+static int* stack_depths(ObjFunction* function) {
+	Chunk* chunk = &function->chunk;
+	int* depths = (int*)malloc(sizeof(int) * chunk->count);
+	int* work = (int*)malloc(sizeof(int) * chunk->count);
+	if ( depths == NULL || work == NULL ) exit(1);
+
+	for ( int i=0; i < chunk->count; i++ ) {
+		depths[i] = UNREACHED;
+	}
+
+	int work_count = 0;
+	bool consistent = reach(depths, work, &work_count, 0, function->arity + 1);
+
+	while ( consistent && work_count > 0 ) {
+		int offset = work[--work_count];
+		int depth = depths[offset];
+		uint8_t* code = &chunk->code[offset];
+		int next = offset + instruction_length(chunk, offset);
+		uint16_t jump = (uint16_t)(code[1] << 8 | code[2]);
+
+		switch ( code[0] ) {
+			case OP_RETURN:
+				break;
+			case OP_JUMP:
+				consistent = reach(depths, work, &work_count, next + jump, depth);
+				break;
+			case OP_LOOP:
+				consistent = reach(depths, work, &work_count, next - jump, depth);
+				break;
+			case OP_JUMP_IF_FALSE:
+				consistent = reach(depths, work, &work_count, next + jump, depth) &&
+					reach(depths, work, &work_count, next, depth);
+				break;
+			case OP_ITER_NEXT:
+				jump = (uint16_t)(code[2] << 8 | code[3]);
+				consistent = reach(depths, work, &work_count, next + jump, depth) &&
+					reach(depths, work, &work_count, next, depth + 1);
+				break;
+			default:
+				consistent = next < chunk->count &&
+					reach(depths, work, &work_count, next, depth + stack_effect(chunk, offset));
+				break;
+		}
+	}
+
+	free(work);
+	if ( !consistent ) {
+		free(depths);
+		return NULL;
+	}
+
+	return depths;
+}
+
+static void emit_string(FILE* out, const char* chars, int length) {
+	fputc('"', out);
+	for ( int i=0; i < length; i++ ) {
+		unsigned char c = (unsigned char)chars[i];
+
+		if ( c == '"' || c == '\\' ) {
+			fprintf(out, "\\%c", c);
+		} else if ( c < 32 || c >= 127 || c == '?' ) {
+			fprintf(out, "\\%03o", c);
+		} else {
+			fputc(c, out);
+		}
+	}
+	fputc('"', out);
+}
+
+static void emit_number(FILE* out, double number) {
+	if ( isnan(number) ) {
+		fprintf(out, "NAN");
+	} else if ( isinf(number) ) {
+		fprintf(out, number < 0 ? "-HUGE_VAL" : "HUGE_VAL");
+	} else {
+		fprintf(out, "%a", number);
+	}
+}
+
+static const char* binary_name(uint8_t op) {
+	switch ( op ) {
+		case OP_GREATER:  return "OP_GREATER";
+		case OP_LESSER:   return "OP_LESSER";
+		case OP_ADD:      return "OP_ADD";
+		case OP_SUBTRACT: return "OP_SUBTRACT";
+		case OP_MULTIPLY: return "OP_MULTIPLY";
+		case OP_DIVIDE:   return "OP_DIVIDE";
+		case OP_MODULO:   return "OP_MODULO";
+		case OP_POW:      return "OP_POW";
+		case OP_ANDB:     return "OP_ANDB";
+		case OP_ORB:      return "OP_ORB";
+		case OP_XORB:     return "OP_XORB";
+		case OP_SHIFTR:   return "OP_SHIFTR";
+		default:          return "OP_SHIFTL";
+	}
+}
+
+static const char* comparison_operator(uint8_t op) {
+	return op == OP_GREATER ? ">" : "<";
+}
+
+// The helpers in value.h that keep ints as ints where they can.
+static const char* arithmetic_function(uint8_t op) {
+	switch ( op ) {
+		case OP_ADD:      return "add_numbers";
+		case OP_SUBTRACT: return "subtract_numbers";
+		case OP_MULTIPLY: return "multiply_numbers";
+		case OP_DIVIDE:   return "divide_numbers";
+		default:          return NULL;
+	}
+}
+
+static void emit_instruction(FILE* out, ObjFunction* function, int offset, int d) {
+	Chunk* chunk = &function->chunk;
+	uint8_t* code = &chunk->code[offset];
+	int next = offset + instruction_length(chunk, offset);
+	uint8_t op = code[0];
+
+	if ( op == OP_ADD_NUM_Q || op == OP_ADD_STR_Q ) op = OP_ADD;
+	if ( op == OP_SUBSCRIPT_LIST_Q ) op = OP_SUBSCRIPT;
+
+	switch ( op ) {
+		case OP_CONSTANT: {
+			Value constant = chunk->constants.values[code[1]];
+			if ( IS_INT(constant) ) {
+				fprintf(out, "\tslots[%d] = INT_VAL(%d);\n", d, AS_INT(constant));
+			} else if ( IS_NUMBER(constant) && isfinite(AS_NUMBER(constant)) ) {
+				fprintf(out, "\tslots[%d] = NUMBER_VAL(vm, %a);\n", d, AS_NUMBER(constant));
+			} else {
+				fprintf(out, "\tslots[%d] = constants[%d];\n", d, code[1]);
+			}
+			break;
+		}
+		case OP_NULL:  fprintf(out, "\tslots[%d] = NULL_VAL;\n", d); break;
+		case OP_TRUE:  fprintf(out, "\tslots[%d] = TRUE_VAL;\n", d); break;
+		case OP_FALSE: fprintf(out, "\tslots[%d] = FALSE_VAL;\n", d); break;
+		case OP_POP: break;
+		case OP_GET_LOCAL:
+			fprintf(out, "\tslots[%d] = slots[%d];\n", d, code[1]);
+			break;
+		case OP_SET_LOCAL:
+			fprintf(out, "\tslots[%d] = slots[%d];\n", code[1], d - 1);
+			break;
+		case OP_GET_UPVALUE:
+			fprintf(out, "\tslots[%d] = *frame->closure->upvalues[%d]->location;\n", d, code[1]);
+			break;
+		case OP_SET_UPVALUE:
+			fprintf(out, "\t*frame->closure->upvalues[%d]->location = slots[%d];\n", code[1], d - 1);
+			break;
+		case OP_GET_ENCLOSING:
+			fprintf(out, "\tslots[%d] = frame[-1].slots[%d];\n", d, code[1]);
+			break;
+		case OP_SET_ENCLOSING:
+			fprintf(out, "\tframe[-1].slots[%d] = slots[%d];\n", code[1], d - 1);
+			break;
+		case OP_GET_GLOBAL:
+			fprintf(out, "\tAOT_CALL(%d, %d, rt_get_global(vm, AS_STRING(constants[%d])));\n", d, next, code[1]);
+			break;
+		case OP_SET_GLOBAL:
+			fprintf(out, "\tAOT_CALL(%d, %d, rt_set_global(vm, AS_STRING(constants[%d])));\n", d, next, code[1]);
+			break;
+		case OP_DEFINE_GLOBAL:
+			fprintf(out, "\tAOT_CALL(%d, %d, rt_define_global(vm, AS_STRING(constants[%d])));\n", d, next, code[1]);
+			break;
+		case OP_ADD_SET_LOCAL:
+		case OP_SUB_SET_LOCAL:
+		case OP_MUL_SET_LOCAL:
+		case OP_DIV_SET_LOCAL: {
+			const char* function = arithmetic_function(OP_ADD + (op - OP_ADD_SET_LOCAL));
+			fprintf(out,
+				"\tif ( IS_NUMBER(slots[%d]) && IS_NUMBER(slots[%d]) ) {\n"
+				"\t\tslots[%d] = slots[%d] = %s(vm, slots[%d], slots[%d]);\n"
+				"\t} else {\n"
+				"\t\tAOT_CALL(%d, %d, rt_compound_local(vm, frame, %d, %d));\n"
+				"\t}\n",
+				code[1], d - 1, code[1], d - 1, function, code[1], d - 1,
+				d, next, op - OP_SET_LOCAL, code[1]);
+			break;
+		}
+		case OP_MOD_SET_LOCAL:
+		case OP_SHIFTL_SET_LOCAL:
+		case OP_SHIFTR_SET_LOCAL:
+		case OP_ANDB_SET_LOCAL:
+		case OP_ORB_SET_LOCAL:
+		case OP_XORB_SET_LOCAL:
+			fprintf(out, "\tAOT_CALL(%d, %d, rt_compound_local(vm, frame, %d, %d));\n", d, next, op - OP_SET_LOCAL, code[1]);
+			break;
+		case OP_INC_LOCAL:
+		case OP_DEC_LOCAL:
+			fprintf(out,
+				"\tif ( IS_NUMBER(slots[%d]) ) {\n"
+				"\t\tslots[%d] = add_numbers(vm, slots[%d], INT_VAL(%d));\n"
+				"\t} else {\n"
+				"\t\tAOT_CALL(%d, %d, rt_inc_local(vm, frame, %d, %d));\n"
+				"\t}\n",
+				code[1], code[1], code[1], op == OP_INC_LOCAL ? 1 : -1,
+				d, next, op - OP_SET_LOCAL, code[1]);
+			break;
+		case OP_EQUAL:
+			fprintf(out, "\tslots[%d] = BOOL_VAL(values_equal(slots[%d], slots[%d]));\n", d - 2, d - 2, d - 1);
+			break;
+		case OP_GREATER:
+		case OP_LESSER:
+			fprintf(out,
+				"\tif ( IS_NUMBER(slots[%d]) && IS_NUMBER(slots[%d]) ) {\n"
+				"\t\tslots[%d] = BOOL_VAL(AS_NUMBER(slots[%d]) %s AS_NUMBER(slots[%d]));\n"
+				"\t} else {\n"
+				"\t\tAOT_CALL(%d, %d, rt_binary(vm, %s));\n"
+				"\t}\n",
+				d - 2, d - 1, d - 2, d - 2, comparison_operator(op), d - 1, d, next, binary_name(op));
+			break;
+		case OP_ADD:
+		case OP_SUBTRACT:
+		case OP_MULTIPLY:
+		case OP_DIVIDE:
+			fprintf(out,
+				"\tif ( IS_NUMBER(slots[%d]) && IS_NUMBER(slots[%d]) ) {\n"
+				"\t\tslots[%d] = %s(vm, slots[%d], slots[%d]);\n"
+				"\t} else {\n"
+				"\t\tAOT_CALL(%d, %d, rt_binary(vm, %s));\n"
+				"\t}\n",
+				d - 2, d - 1, d - 2, arithmetic_function(op), d - 2, d - 1, d, next, binary_name(op));
+			break;
+		case OP_MODULO:
+		case OP_POW:
+		case OP_ANDB:
+		case OP_ORB:
+		case OP_XORB:
+		case OP_SHIFTR:
+		case OP_SHIFTL:
+			fprintf(out, "\tAOT_CALL(%d, %d, rt_binary(vm, %s));\n", d, next, binary_name(op));
+			break;
+		case OP_NOT:
+			fprintf(out, "\tslots[%d] = BOOL_VAL(AOT_FALSEY(slots[%d]));\n", d - 1, d - 1);
+			break;
+		case OP_NEGATE:
+			fprintf(out,
+				"\tif ( IS_NUMBER(slots[%d]) ) {\n"
+				"\t\tslots[%d] = negate_number(vm, slots[%d]);\n"
+				"\t} else {\n"
+				"\t\tAOT_CALL(%d, %d, rt_negate(vm));\n"
+				"\t}\n",
+				d - 1, d - 1, d - 1, d, next);
+			break;
+		case OP_TYPE:
+			fprintf(out, "\tAOT_CALL(%d, %d, rt_type(vm));\n", d, next);
+			break;
+		case OP_WAIT:
+			fprintf(out, "\tAOT_CALL(%d, %d, rt_wait(vm));\n", d, next);
+			break;
+		case OP_JUMP:
+			fprintf(out, "\tgoto L%d;\n", next + (uint16_t)(code[1] << 8 | code[2]));
+			break;
+		case OP_JUMP_IF_FALSE:
+			fprintf(out, "\tif ( AOT_FALSEY(slots[%d]) ) goto L%d;\n", d - 1, next + (uint16_t)(code[1] << 8 | code[2]));
+			break;
+		case OP_LOOP:
+			fprintf(out, "\tgoto L%d;\n", next - (uint16_t)(code[1] << 8 | code[2]));
+			break;
+		case OP_CALL:
+			fprintf(out,
+				"\tAOT_SYNC(%d, %d);\n"
+				"\tframe = rt_call(vm, %d);\n"
+				"\tif ( frame == NULL ) return false;\n"
+				"\tslots = frame->slots;\n",
+				d, next, code[1]);
+			break;
+		case OP_CALL_NATIVE:
+			fprintf(out,
+				"\tAOT_SYNC(%d, %d);\n"
+				"\tframe = rt_call_native(vm, %d, %d);\n"
+				"\tif ( frame == NULL ) return false;\n"
+				"\tslots = frame->slots;\n",
+				d, next, code[1], code[2]);
+			break;
+		case OP_CLOSURE:
+			fprintf(out, "\tAOT_CALL(%d, %d, rt_closure(vm, frame, %d));\n", d, next, offset);
+			break;
+		case OP_CLOSE_UPVALUE:
+			fprintf(out, "\tAOT_CALL(%d, %d, rt_close_upvalue(vm));\n", d, next);
+			break;
+		case OP_RETURN:
+			fprintf(out,
+				"\tAOT_SYNC(%d, %d);\n"
+				"\treturn rt_return(vm, frame);\n",
+				d, next);
+			break;
+		case OP_CREATE_LIST:
+			fprintf(out, "\tAOT_CALL(%d, %d, rt_create_list(vm, %d));\n", d, next, code[1]);
+			break;
+		case OP_SUBSCRIPT:
+			fprintf(out,
+				"\tif ( IS_LIST(slots[%d]) && IS_NUMBER(slots[%d]) && AS_NUMBER(slots[%d]) >= 0 &&\n"
+				"\t\t\tAS_NUMBER(slots[%d]) < AS_LIST(slots[%d])->count && AS_NUMBER(slots[%d]) == (int)AS_NUMBER(slots[%d]) ) {\n"
+				"\t\tslots[%d] = AS_LIST(slots[%d])->items[(int)AS_NUMBER(slots[%d])];\n"
+				"\t} else {\n"
+				"\t\tAOT_CALL(%d, %d, rt_subscript(vm));\n"
+				"\t}\n",
+				d - 2, d - 1, d - 1, d - 1, d - 2, d - 1, d - 1, d - 2, d - 2, d - 1, d, next);
+			break;
+		case OP_SET_SUBSCRIPT:
+			fprintf(out, "\tAOT_CALL(%d, %d, rt_set_subscript(vm));\n", d, next);
+			break;
+		case OP_ITER_INIT:
+			fprintf(out, "\tAOT_CALL(%d, %d, rt_iter_init(vm));\n", d, next);
+			break;
+		case OP_ITER_NEXT: {
+			int slot = code[1];
+			int done = next + (uint16_t)(code[2] << 8 | code[3]);
+			fprintf(out,
+				"\tif ( IS_LIST(slots[%d]) ) {\n"
+				"\t\tint index = AS_INT(slots[%d]);\n"
+				"\t\tif ( index >= AS_LIST(slots[%d])->count ) goto L%d;\n"
+				"\t\tslots[%d] = AS_LIST(slots[%d])->items[index];\n"
+				"\t\tslots[%d] = INT_VAL(index + 1);\n"
+				"\t} else {\n"
+				"\t\tAOT_SYNC(%d, %d);\n"
+				"\t\tif ( !rt_iter_next(vm, frame, %d) ) goto L%d;\n"
+				"\t\tslots = frame->slots;\n"
+				"\t}\n",
+				slot, slot + 1, slot, done, d, slot, slot + 1,
+				d, next, slot, done);
+			break;
+		}
+		default:
+			if ( op >= OP_ADD_SET_GLOBAL && op <= OP_DEC_GLOBAL ) {
+				fprintf(out, "\tAOT_CALL(%d, %d, rt_compound_global(vm, AS_STRING(constants[%d]), %d));\n",
+					d, next, code[1], op - OP_SET_GLOBAL);
+			} else if ( op >= OP_ADD_SET_UPVALUE && op <= OP_DEC_UPVALUE ) {
+				fprintf(out, "\tAOT_CALL(%d, %d, rt_compound_upvalue(vm, frame, %d, %d));\n",
+					d, next, code[1], op - OP_SET_UPVALUE);
+			} else {
+				fprintf(out, "\tAOT_CALL(%d, %d, rt_compound_enclosing(vm, frame, %d, %d));\n",
+					d, next, code[1], op - OP_SET_ENCLOSING);
+			}
+			break;
+	}
+}
+
+// Marks the instructions reachable code jumps to, which get a label.
+static bool* jump_targets(Chunk* chunk, int* depths) {
+	bool* targets = (bool*)calloc(chunk->count, sizeof(bool));
+	if ( targets == NULL ) exit(1);
+
+	for ( int offset=0; offset < chunk->count; offset += instruction_length(chunk, offset) ) {
+		if ( depths[offset] == UNREACHED ) continue;
+
+		uint8_t* code = &chunk->code[offset];
+		int next = offset + instruction_length(chunk, offset);
+
+		switch ( code[0] ) {
+			case OP_JUMP:
+			case OP_JUMP_IF_FALSE:
+				targets[next + (uint16_t)(code[1] << 8 | code[2])] = true;
+				break;
+			case OP_LOOP:
+				targets[next - (uint16_t)(code[1] << 8 | code[2])] = true;
+				break;
+			case OP_ITER_NEXT:
+				targets[next + (uint16_t)(code[2] << 8 | code[3])] = true;
+				break;
+			default:
+				break;
+		}
+	}
+
+	return targets;
+}
+
+// Writes the function as C, or returns false if it is left to the interpreter.
+static bool emit_function(FILE* out, ObjFunction* function, int index) {
+	int* depths = stack_depths(function);
+	if ( depths == NULL ) return false;
+
+	Chunk* chunk = &function->chunk;
+	bool* targets = jump_targets(chunk, depths);
+
+	fprintf(out, "static bool function_%d(VM* vm, CallFrame* frame) {\n", index);
+	fprintf(out, "\tValue* slots = frame->slots;\n");
+	fprintf(out, "\tValue* constants = frame->closure->function->chunk.constants.values;\n");
+	fprintf(out, "\t(void)constants;\n\n");
+
+	for ( int offset=0; offset < chunk->count; offset += instruction_length(chunk, offset) ) {
+		if ( depths[offset] == UNREACHED ) continue;
+
+		if ( targets[offset] ) {
+			fprintf(out, "L%d:;\n", offset);
+		}
+		emit_instruction(out, function, offset, depths[offset]);
+	}
+
+	fprintf(out, "}\n\n");
+	free(targets);
+	free(depths);
+	return true;
+}
+
+static void emit_tables(FILE* out, FunctionList* functions, ObjFunction* function, int index) {
+	Chunk* chunk = &function->chunk;
+
+	fprintf(out, "static const uint8_t code_%d[] = {", index);
+	for ( int i=0; i < chunk->count; i++ ) {
+		fprintf(out, "%s%d", i % 16 == 0 ? "\n\t" : " ", chunk->code[i]);
+		if ( i < chunk->count - 1 ) fputc(',', out);
+	}
+	fprintf(out, "\n};\n\n");
+
+	fprintf(out, "static const int lines_%d[] = {", index);
+	for ( int i=0; i < chunk->count; i++ ) {
+		fprintf(out, "%s%d", i % 16 == 0 ? "\n\t" : " ", chunk->lines[i]);
+		if ( i < chunk->count - 1 ) fputc(',', out);
+	}
+	fprintf(out, "\n};\n\n");
+
+	if ( chunk->constants.count == 0 ) return;
+
+	fprintf(out, "static const AotConstant constants_%d[] = {\n", index);
+	for ( int i=0; i < chunk->constants.count; i++ ) {
+		Value constant = chunk->constants.values[i];
+
+		if ( IS_NUMBER(constant) ) {
+			fprintf(out, "\t{ %s, ", IS_INT(constant) ? "AOT_INT" : "AOT_NUMBER");
+			emit_number(out, AS_NUMBER(constant));
+			fprintf(out, ", NULL, 0, 0 },\n");
+		} else if ( IS_STRING(constant) ) {
+			fprintf(out, "\t{ AOT_STRING, 0, ");
+			emit_string(out, AS_STRING(constant)->chars, AS_STRING(constant)->length);
+			fprintf(out, ", %d, 0 },\n", AS_STRING(constant)->length);
+		} else if ( IS_CLOSURE(constant) ) {
+			fprintf(out, "\t{ AOT_CLOSURE, 0, NULL, 0, %d },\n", function_index(functions, AS_CLOSURE(constant)->function));
+		} else {
+			fprintf(out, "\t{ AOT_FUNCTION, 0, NULL, 0, %d },\n", function_index(functions, AS_FUNCTION(constant)));
+		}
+	}
+	fprintf(out, "};\n\n");
+}
+
+bool emit_c(VM* vm, const char* source, FILE* out) {
+	ObjFunction* script = compile(vm, source);
+	if ( script == NULL ) return false;
+
+	FunctionList functions = { NULL, 0, 0 };
+	collect_functions(&functions, script);
+
+	bool* emitted = (bool*)malloc(sizeof(bool) * functions.count);
+	if ( emitted == NULL ) exit(1);
+
+	fprintf(out, "// Generated by pikey --emit-c.\n\n");
+	fprintf(out, "#include <math.h>\n\n");
+	fprintf(out, "#include \"aot.h\"\n\n");
+
+	for ( int i=0; i < functions.count; i++ ) {
+		emit_tables(out, &functions, functions.items[i], i);
+	}
+
+	for ( int i=0; i < functions.count; i++ ) {
+		emitted[i] = emit_function(out, functions.items[i], i);
+	}
+
+	fprintf(out, "static const AotFunction functions[] = {\n");
+	for ( int i=0; i < functions.count; i++ ) {
+		ObjFunction* function = functions.items[i];
+
+		fprintf(out, "\t{ ");
+		if ( function->name == NULL ) {
+			fprintf(out, "NULL");
+		} else {
+			emit_string(out, function->name->chars, function->name->length);
+		}
+		fprintf(out, ", %d, %d, code_%d, lines_%d, %d, ", function->arity, function->upvalue_count, i, i, function->chunk.count);
+
+		if ( function->chunk.constants.count == 0 ) {
+			fprintf(out, "NULL, 0, ");
+		} else {
+			fprintf(out, "constants_%d, %d, ", i, function->chunk.constants.count);
+		}
+
+		fprintf(out, "%d, ", function->chunk.cache_count);
+		if ( emitted[i] ) {
+			fprintf(out, "function_%d },\n", i);
+		} else {
+			fprintf(out, "NULL },\n");
+		}
+	}
+	fprintf(out, "};\n\n");
+
+	fprintf(out, "int main(void) {\n");
+	fprintf(out, "\treturn aot_main(functions, %d);\n", functions.count);
+	fprintf(out, "}\n");
+
+	free(emitted);
+	free(functions.items);
+	return true;
+}
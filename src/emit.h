@@ -0,0 +1,14 @@
+#ifndef pikey_emit_h
+#define pikey_emit_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "vm.h"
+
+// Compiles the script and writes it to `out` as a C program, one C function
+// per PiKey function, to be built against libpikey as described in aot.h.
+// Returns false after reporting a compile error.
+bool emit_c(VM* vm, const char* source, FILE* out);
+
+#endif // !pikey_emit_h
@@ -0,0 +1,559 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "jit.h"
+#include "memory.h"
+#include "natives.h"
+#include "object.h"
+#include "table.h"
+
+#define IMAGE_MAGIC "PIKEYIMG"
+#define IMAGE_VERSION 2
+
+#define ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+// Turns an image offset into a pointer-typed placeholder and back again.
+#define AS_OFFSET(type, offset) ((type)(uintptr_t)(offset))
+#define RELOCATE(base, pointer) \
+	((pointer) = (pointer) == NULL ? NULL : (void*)((base) + (uintptr_t)(pointer)))
+
+// Every pointer in an image is stored as its offset from the start of the
+// file, with 0 standing for NULL. Object values keep their tag and carry the
+// offset as their payload. The header comes first, so no object is ever at
+// offset 0.
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t layout;
+	uint32_t native_count;
+	uint32_t object_count;
+	uint64_t size;
+
+	// The table of object offsets, one per object.
+	uint64_t objects;
+
+	uint64_t globals;
+	int32_t globals_count;
+	int32_t globals_capacity;
+	uint64_t strings;
+	int32_t strings_count;
+	int32_t strings_capacity;
+} ImageHeader;
+
+_Static_assert(sizeof(Obj*) <= sizeof(uint64_t), "The object table is relocated in place.");
+
+typedef struct {
+	VM* vm;
+	char* buffer;
+
+	// The objects being saved, sorted by address, and where each one goes.
+	Obj** objects;
+	uint64_t* offsets;
+	int count;
+} ImageWriter;
+
+#ifdef COMPACT_VALUES
+#define VALUE_ENCODING 1u
+#else
+#define VALUE_ENCODING 0u
+#endif
+
+// Images only load into the build that wrote them.
+static uint32_t layout_fingerprint() {
+	return (uint32_t)(sizeof(Value) ^ sizeof(ObjFunction) << 6 ^ sizeof(ObjString) << 12 ^
+		sizeof(Chunk) << 18 ^ sizeof(ObjList) << 24 ^ sizeof(Entry) << 27 ^ VALUE_ENCODING << 31);
+}
+
+static int compare_objects(const void* a, const void* b) {
+	uintptr_t left = (uintptr_t)*(Obj* const*)a;
+	uintptr_t right = (uintptr_t)*(Obj* const*)b;
+	return left < right ? -1 : left > right;
+}
+
+static uint64_t offset_of(ImageWriter* writer, Obj* object) {
+	if ( object == NULL ) return 0;
+
+	int low = 0;
+	int high = writer->count - 1;
+
+	while ( low <= high ) {
+		int middle = low + (high - low) / 2;
+		uintptr_t found = (uintptr_t)writer->objects[middle];
+
+		if ( found == (uintptr_t)object ) return writer->offsets[middle];
+		if ( found < (uintptr_t)object ) {
+			low = middle + 1;
+		} else {
+			high = middle - 1;
+		}
+	}
+
+	return 0;
+}
+
+static Value write_value(ImageWriter* writer, Value value) {
+	if ( IS_OBJ(value) ) {
+		return OBJ_VAL(AS_OFFSET(Obj*, offset_of(writer, AS_OBJ(value))));
+	}
+#ifdef COMPACT_VALUES
+	if ( IS_BOXED(value) ) {
+		return BOXED_VAL(AS_OFFSET(Obj*, offset_of(writer, AS_BOXED(value))));
+	}
+#endif
+
+	return value;
+}
+
+static size_t object_size(Obj* object) {
+	switch ( object->type ) {
+		case OBJ_CLOSURE: {
+			ObjClosure* closure = (ObjClosure*)object;
+			return ALIGN(sizeof(ObjClosure) + sizeof(ObjUpvalue*) * closure->upvalue_count);
+		}
+		case OBJ_FUNCTION: {
+			Chunk* chunk = &((ObjFunction*)object)->chunk;
+			return ALIGN(sizeof(ObjFunction)) + ALIGN(chunk->count) + ALIGN(sizeof(int) * chunk->count) +
+				ALIGN(sizeof(Value) * chunk->constants.count) + ALIGN(sizeof(CallCache) * chunk->cache_count);
+		}
+		case OBJ_NATIVE:
+			return ALIGN(sizeof(ObjNative));
+		case OBJ_STRING:
+			return ALIGN(sizeof(ObjString)) + ALIGN(((ObjString*)object)->length + 1);
+		case OBJ_UPVALUE:
+			return ALIGN(sizeof(ObjUpvalue));
+		case OBJ_LIST:
+			return ALIGN(sizeof(ObjList)) + ALIGN(sizeof(Value) * ((ObjList*)object)->count);
+		case OBJ_MEMO:
+			return ALIGN(sizeof(ObjMemo));
+		case OBJ_NUMBER:
+			return ALIGN(sizeof(ObjNumber));
+	}
+
+	return 0;
+}
+
+// Copies `size` bytes to the cursor and returns the offset they were put at.
+static uint64_t place(ImageWriter* writer, uint64_t* cursor, const void* data, size_t size) {
+	uint64_t offset = *cursor;
+	if ( size > 0 ) memcpy(writer->buffer + offset, data, size);
+	*cursor += ALIGN(size);
+	return offset;
+}
+
+static bool write_object(ImageWriter* writer, int index) {
+	Obj* object = writer->objects[index];
+	uint64_t offset = writer->offsets[index];
+	uint64_t cursor = offset;
+
+	switch ( object->type ) {
+		case OBJ_CLOSURE: {
+			ObjClosure* closure = (ObjClosure*)object;
+			ObjClosure copy = *closure;
+			copy.function = AS_OFFSET(ObjFunction*, offset_of(writer, (Obj*)copy.function));
+			memcpy(writer->buffer + offset, &copy, sizeof(copy));
+
+			ObjUpvalue** upvalues = (ObjUpvalue**)(writer->buffer + offset + offsetof(ObjClosure, upvalues));
+			for ( int i=0; i < closure->upvalue_count; i++ ) {
+				upvalues[i] = AS_OFFSET(ObjUpvalue*, offset_of(writer, (Obj*)closure->upvalues[i]));
+			}
+			break;
+		}
+		case OBJ_FUNCTION: {
+			ObjFunction copy = *(ObjFunction*)object;
+			Chunk* chunk = &copy.chunk;
+			cursor += ALIGN(sizeof(ObjFunction));
+
+			chunk->code = AS_OFFSET(uint8_t*, place(writer, &cursor, chunk->code, chunk->count));
+			chunk->lines = AS_OFFSET(int*, place(writer, &cursor, chunk->lines, sizeof(int) * chunk->count));
+			chunk->capacity = chunk->count;
+
+			Value* constants = (Value*)(writer->buffer + cursor);
+			for ( int i=0; i < chunk->constants.count; i++ ) {
+				constants[i] = write_value(writer, chunk->constants.values[i]);
+			}
+			chunk->constants.values = AS_OFFSET(Value*, cursor);
+			chunk->constants.capacity = chunk->constants.count;
+			cursor += ALIGN(sizeof(Value) * chunk->constants.count);
+
+			// The inline caches start out empty again.
+			memset(writer->buffer + cursor, 0, sizeof(CallCache) * chunk->cache_count);
+			chunk->caches = AS_OFFSET(CallCache*, cursor);
+			chunk->cache_capacity = chunk->cache_count;
+
+			copy.name = AS_OFFSET(ObjString*, offset_of(writer, (Obj*)copy.name));
+			copy.next_marked = NULL;
+			copy.compiled = NULL;
+#ifdef PIKEY_JIT
+			// Compiled code is not saved, the function warms up again.
+			copy.jit_code = NULL;
+			copy.jit_size = 0;
+			copy.jit_entries = NULL;
+			copy.hotness = 0;
+			copy.jit_failed = false;
+#endif
+			memcpy(writer->buffer + offset, &copy, sizeof(copy));
+			break;
+		}
+		case OBJ_NATIVE: {
+			ObjNative copy = *(ObjNative*)object;
+			ptrdiff_t native = copy.def - natives;
+
+			if ( native < 0 || native >= native_count ) {
+				fprintf(writer->vm->err, "Cannot save the host native '%s' in an image.\n", copy.def->name);
+				return false;
+			}
+
+			copy.def = AS_OFFSET(const NativeDef*, native);
+			memcpy(writer->buffer + offset, &copy, sizeof(copy));
+			break;
+		}
+		case OBJ_STRING: {
+			ObjString copy = *(ObjString*)object;
+			cursor += ALIGN(sizeof(ObjString));
+
+			// A string from a buffer is saved with its own characters, which
+			// may not be terminated where it ends.
+			uint64_t chars = place(writer, &cursor, copy.chars, copy.length + 1);
+			writer->buffer[chars + copy.length] = '\0';
+			copy.chars = AS_OFFSET(char*, chars);
+			copy.buffer = NULL;
+			memcpy(writer->buffer + offset, &copy, sizeof(copy));
+			break;
+		}
+		case OBJ_UPVALUE: {
+			ObjUpvalue* upvalue = (ObjUpvalue*)object;
+			ObjUpvalue copy = *upvalue;
+
+			if ( upvalue->location != &upvalue->closed ) {
+				fprintf(writer->vm->err, "Cannot save an image while a function is running.\n");
+				return false;
+			}
+
+			copy.location = AS_OFFSET(Value*, offset + offsetof(ObjUpvalue, closed));
+			copy.closed = write_value(writer, copy.closed);
+			copy.next = NULL;
+			memcpy(writer->buffer + offset, &copy, sizeof(copy));
+			break;
+		}
+		case OBJ_LIST: {
+			ObjList copy = *(ObjList*)object;
+			cursor += ALIGN(sizeof(ObjList));
+
+			Value* items = (Value*)(writer->buffer + cursor);
+			for ( int i=0; i < copy.count; i++ ) {
+				items[i] = write_value(writer, copy.items[i]);
+			}
+
+			copy.items = copy.count > 0 ? AS_OFFSET(Value*, cursor) : NULL;
+			copy.capacity = copy.count;
+			memcpy(writer->buffer + offset, &copy, sizeof(copy));
+			break;
+		}
+		case OBJ_MEMO: {
+			// The cache is not saved, the memo starts out empty.
+			ObjMemo copy = *(ObjMemo*)object;
+			copy.function = write_value(writer, copy.function);
+			init_memo_table(&copy.cache, copy.cache.limit);
+			copy.next_marked = NULL;
+			memcpy(writer->buffer + offset, &copy, sizeof(copy));
+			break;
+		}
+		case OBJ_NUMBER:
+			memcpy(writer->buffer + offset, object, sizeof(ObjNumber));
+			break;
+	}
+
+	Obj* placed = (Obj*)(writer->buffer + offset);
+	placed->next = NULL;
+	placed->is_marked = true;
+	return true;
+}
+
+static void write_table(ImageWriter* writer, uint64_t offset, Table* table) {
+	Entry* entries = (Entry*)(writer->buffer + offset);
+
+	for ( int i=0; i < table->capacity; i++ ) {
+		entries[i].key = AS_OFFSET(ObjString*, offset_of(writer, (Obj*)table->entries[i].key));
+		entries[i].value = write_value(writer, table->entries[i].value);
+	}
+}
+
+bool save_image(VM* vm, const char* path) {
+	if ( vm->image != NULL ) {
+		fprintf(vm->err, "Cannot save an image from a VM that was loaded from one.\n");
+		return false;
+	}
+
+	collect_garbage(vm);
+
+	ImageWriter writer;
+	writer.vm = vm;
+	writer.count = 0;
+	for ( Obj* object = vm->objects; object != NULL; object = object->next ) {
+		writer.count++;
+	}
+
+	writer.objects = (Obj**)malloc(sizeof(Obj*) * (writer.count + 1));
+	writer.offsets = (uint64_t*)malloc(sizeof(uint64_t) * (writer.count + 1));
+	if ( writer.objects == NULL || writer.offsets == NULL ) exit(1);
+
+	int count = 0;
+	for ( Obj* object = vm->objects; object != NULL; object = object->next ) {
+		writer.objects[count++] = object;
+	}
+	qsort(writer.objects, writer.count, sizeof(Obj*), compare_objects);
+
+	ImageHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+	header.version = IMAGE_VERSION;
+	header.layout = layout_fingerprint();
+	header.native_count = native_count;
+	header.object_count = writer.count;
+
+	uint64_t cursor = ALIGN(sizeof(ImageHeader));
+	for ( int i=0; i < writer.count; i++ ) {
+		writer.offsets[i] = cursor;
+		cursor += object_size(writer.objects[i]);
+	}
+
+	header.objects = cursor;
+	cursor += sizeof(uint64_t) * writer.count;
+	header.globals = cursor;
+	header.globals_count = vm->globals.count;
+	header.globals_capacity = vm->globals.capacity;
+	cursor += ALIGN(sizeof(Entry) * vm->globals.capacity);
+	header.strings = cursor;
+	header.strings_count = vm->strings.count;
+	header.strings_capacity = vm->strings.capacity;
+	cursor += ALIGN(sizeof(Entry) * vm->strings.capacity);
+	header.size = cursor;
+
+	writer.buffer = (char*)calloc(1, header.size);
+	if ( writer.buffer == NULL ) exit(1);
+
+	bool written = true;
+	for ( int i=0; i < writer.count && written; i++ ) {
+		written = write_object(&writer, i);
+	}
+
+	if ( written ) {
+		memcpy(writer.buffer + header.objects, writer.offsets, sizeof(uint64_t) * writer.count);
+		write_table(&writer, header.globals, &vm->globals);
+		write_table(&writer, header.strings, &vm->strings);
+		memcpy(writer.buffer, &header, sizeof(header));
+
+		FILE* file = fopen(path, "wb");
+		written = file != NULL && fwrite(writer.buffer, 1, header.size, file) == header.size;
+		if ( file != NULL && fclose(file) != 0 ) written = false;
+
+		if ( !written ) fprintf(vm->err, "Could not write image \"%s\".\n", path);
+	}
+
+	free(writer.buffer);
+	free(writer.objects);
+	free(writer.offsets);
+	return written;
+}
+
+static Value relocate_value(char* base, Value value) {
+	if ( IS_OBJ(value) ) return OBJ_VAL(base + (uintptr_t)AS_OBJ(value));
+#ifdef COMPACT_VALUES
+	if ( IS_BOXED(value) ) return BOXED_VAL(base + (uintptr_t)AS_BOXED(value));
+#endif
+	return value;
+}
+
+static void relocate_object(VM* vm, char* base, Obj* object) {
+	switch ( object->type ) {
+		case OBJ_CLOSURE: {
+			ObjClosure* closure = (ObjClosure*)object;
+			RELOCATE(base, closure->function);
+
+			for ( int i=0; i < closure->upvalue_count; i++ ) {
+				RELOCATE(base, closure->upvalues[i]);
+			}
+			break;
+		}
+		case OBJ_FUNCTION: {
+			ObjFunction* function = (ObjFunction*)object;
+			Chunk* chunk = &function->chunk;
+			RELOCATE(base, function->name);
+			RELOCATE(base, chunk->code);
+			RELOCATE(base, chunk->lines);
+			RELOCATE(base, chunk->constants.values);
+			RELOCATE(base, chunk->caches);
+
+			for ( int i=0; i < chunk->constants.count; i++ ) {
+				chunk->constants.values[i] = relocate_value(base, chunk->constants.values[i]);
+			}
+			break;
+		}
+		case OBJ_NATIVE: {
+			ObjNative* native = (ObjNative*)object;
+			native->def = &natives[(uintptr_t)native->def];
+			break;
+		}
+		case OBJ_STRING:
+			RELOCATE(base, ((ObjString*)object)->chars);
+			break;
+		case OBJ_UPVALUE: {
+			ObjUpvalue* upvalue = (ObjUpvalue*)object;
+			RELOCATE(base, upvalue->location);
+			upvalue->closed = relocate_value(base, upvalue->closed);
+			break;
+		}
+		case OBJ_LIST: {
+			// Lists can grow, so their items move out to the heap.
+			ObjList* list = (ObjList*)object;
+			RELOCATE(base, list->items);
+
+			Value* items = list->count > 0 ? ALLOCATE(vm, Value, list->count) : NULL;
+			for ( int i=0; i < list->count; i++ ) {
+				items[i] = relocate_value(base, list->items[i]);
+			}
+			list->items = items;
+			break;
+		}
+		case OBJ_MEMO: {
+			ObjMemo* memo = (ObjMemo*)object;
+			memo->function = relocate_value(base, memo->function);
+			break;
+		}
+		case OBJ_NUMBER:
+			break;
+	}
+}
+
+static void load_table(VM* vm, char* base, Table* table, uint64_t offset, int count, int capacity) {
+	Entry* entries = (Entry*)(base + offset);
+
+	table->entries = capacity > 0 ? ALLOCATE(vm, Entry, capacity) : NULL;
+	table->count = count;
+	table->capacity = capacity;
+
+	for ( int i=0; i < capacity; i++ ) {
+		table->entries[i].key = entries[i].key;
+		RELOCATE(base, table->entries[i].key);
+		table->entries[i].value = relocate_value(base, entries[i].value);
+	}
+}
+
+// Maps and relocates the image open on `fd`, which stays open.
+static bool map_image(VM* vm, int fd, const char* path) {
+	struct stat st;
+	if ( fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(ImageHeader) ) {
+		fprintf(vm->err, "\"%s\" is not an image.\n", path);
+		return false;
+	}
+
+	// A private mapping lets the objects be written where they lie without
+	// touching the file, and only the pages that are used get read.
+	char* base = (char*)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if ( base == MAP_FAILED ) {
+		fprintf(vm->err, "Could not map image \"%s\".\n", path);
+		return false;
+	}
+
+	ImageHeader* header = (ImageHeader*)base;
+	if ( memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) != 0 || header->size != (uint64_t)st.st_size ) {
+		fprintf(vm->err, "\"%s\" is not an image.\n", path);
+		munmap(base, st.st_size);
+		return false;
+	}
+	if ( header->version != IMAGE_VERSION || header->layout != layout_fingerprint() ||
+			header->native_count != (uint32_t)native_count ) {
+		fprintf(vm->err, "Image \"%s\" was made by a different build.\n", path);
+		munmap(base, st.st_size);
+		return false;
+	}
+
+	// Pointers are no wider than the offsets, so each one only overwrites
+	// offsets that have already been read.
+	uint64_t* offsets = (uint64_t*)(base + header->objects);
+	Obj** objects = (Obj**)offsets;
+	for ( uint32_t i=0; i < header->object_count; i++ ) {
+		uint64_t offset = offsets[i];
+		objects[i] = (Obj*)(base + offset);
+	}
+
+	// Nothing below can be collected: the heap is empty and the image is
+	// only handed to the collector once it is fully relocated.
+	for ( uint32_t i=0; i < header->object_count; i++ ) {
+		relocate_object(vm, base, objects[i]);
+	}
+
+	load_table(vm, base, &vm->globals, header->globals, header->globals_count, header->globals_capacity);
+	load_table(vm, base, &vm->strings, header->strings, header->strings_count, header->strings_capacity);
+
+	vm->image = base;
+	vm->image_size = st.st_size;
+	vm->image_objects = objects;
+	vm->image_object_count = header->object_count;
+	return true;
+}
+
+bool load_image(VM* vm, const char* path) {
+	int fd = open(path, O_RDONLY);
+	if ( fd < 0 ) {
+		fprintf(vm->err, "Could not open image \"%s\".\n", path);
+		return false;
+	}
+
+	if ( !map_image(vm, fd, path) ) {
+		close(fd);
+		return false;
+	}
+
+	vm->image_fd = fd;
+	return true;
+}
+
+// The file is kept open, so this maps the same image even if the path has
+// since been given to another file.
+bool reload_image(VM* vm) {
+	int fd = vm->image_fd;
+	vm->image_fd = -1;
+	free_image(vm);
+
+	if ( !map_image(vm, fd, "the image") ) {
+		close(fd);
+		return false;
+	}
+
+	vm->image_fd = fd;
+	return true;
+}
+
+void free_image(VM* vm) {
+	if ( vm->image == NULL ) return;
+
+	for ( int i=0; i < vm->image_object_count; i++ ) {
+		if ( vm->image_objects[i]->type == OBJ_LIST ) {
+			ObjList* list = (ObjList*)vm->image_objects[i];
+			FREE_ARRAY(vm, Value, list->items, list->capacity);
+		}
+		if ( vm->image_objects[i]->type == OBJ_MEMO ) {
+			free_memo_table(vm, &((ObjMemo*)vm->image_objects[i])->cache);
+		}
+#ifdef PIKEY_JIT
+		if ( vm->image_objects[i]->type == OBJ_FUNCTION ) {
+			jit_free((ObjFunction*)vm->image_objects[i]);
+		}
+#endif
+	}
+
+	munmap(vm->image, vm->image_size);
+	if ( vm->image_fd >= 0 ) close(vm->image_fd);
+	vm->image_fd = -1;
+	vm->image = NULL;
+	vm->image_size = 0;
+	vm->image_objects = NULL;
+	vm->image_object_count = 0;
+}
@@ -0,0 +1,22 @@
+#ifndef pikey_image_h
+#define pikey_image_h
+
+#include "common.h"
+#include "vm.h"
+
+// Writes the VM's heap, its globals and its interned strings to `path`. The
+// VM has to be idle, and only builtins can be saved, not host natives.
+bool save_image(VM* vm, const char* path);
+
+// Maps an image written by save_image() into a VM that has no heap yet. The
+// objects in it are used where they lie. They are never swept and are
+// treated as roots by the collector.
+bool load_image(VM* vm, const char* path);
+
+// Maps the image the VM was started from again, in place of the one a run
+// may have changed. The VM's tables must be empty and its heap freed.
+bool reload_image(VM* vm);
+
+void free_image(VM* vm);
+
+#endif // !pikey_image_h
@@ -0,0 +1,760 @@
+#ifdef PIKEY_JIT
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "chunk.h"
+#include "jit.h"
+#include "natives.h"
+
+#if !defined(__x86_64__) || !defined(__linux__)
+#error "The JIT only targets x86-64 Linux."
+#endif
+
+#ifndef NAN_BOXING
+#error "The JIT works on NaN-boxed values."
+#endif
+
+// Compiled code is a straight translation of the bytecode, one template per
+// instruction, working on the same value stack as the interpreter with none
+// of it cached in registers. While it runs
+//
+//   rbx holds the VM,
+//   r12 the frame's slots,
+//   r13 the stack top,
+//   r15 the CallFrame.
+//
+// Numbers are handled inline, everything else calls back into the runtime.
+// Functions that create closures or close upvalues, iterate, assign to a
+// subscript, wait or use compound assignment on globals, upvalues and the
+// calling frame's locals are left to the interpreter.
+
+enum {
+	RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+	R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+enum {
+	CC_O  = 0x0,
+	CC_E  = 0x4,
+	CC_NE = 0x5,
+	CC_A  = 0x7,
+	CC_L  = 0xc,
+	CC_G  = 0xf,
+};
+
+#define OP_AND 0x21
+#define OP_CMP 0x39
+#define OP_OR  0x09
+#define OP_XOR 0x31
+
+#define SSE_ADD 0x58
+#define SSE_MUL 0x59
+#define SSE_SUB 0x5c
+#define SSE_DIV 0x5e
+
+// Jump targets that aren't bytecode offsets.
+#define LABEL_ERROR -1
+#define LABEL_EXIT  -2
+
+typedef struct {
+	int position;
+	int target;
+} Fixup;
+
+typedef struct {
+	Chunk* chunk;
+
+	uint8_t* code;
+	int count;
+	int capacity;
+
+	// Where the code for each bytecode offset starts, -1 inside operands.
+	int* native_at;
+
+	Fixup* fixups;
+	int fixup_count;
+	int fixup_capacity;
+} Assembler;
+
+static void emit_byte(Assembler* as, uint8_t byte) {
+	if ( as->count == as->capacity ) {
+		as->capacity = as->capacity < 256 ? 256 : as->capacity * 2;
+		as->code = (uint8_t*)realloc(as->code, as->capacity);
+		if ( as->code == NULL ) exit(1);
+	}
+
+	as->code[as->count++] = byte;
+}
+
+static void emit_u32(Assembler* as, uint32_t value) {
+	for ( int i=0; i < 4; i++ ) {
+		emit_byte(as, (uint8_t)(value >> (8 * i)));
+	}
+}
+
+static void emit_u64(Assembler* as, uint64_t value) {
+	for ( int i=0; i < 8; i++ ) {
+		emit_byte(as, (uint8_t)(value >> (8 * i)));
+	}
+}
+
+static void emit_rex(Assembler* as, int reg, int rm) {
+	emit_byte(as, 0x48 | ((reg >> 3) << 2) | (rm >> 3));
+}
+
+// A [base + disp32] operand. Bases that share rsp's encoding need a SIB byte.
+static void emit_memory(Assembler* as, int reg, int base, int32_t disp) {
+	emit_byte(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+	if ( (base & 7) == RSP ) emit_byte(as, 0x24);
+	emit_u32(as, (uint32_t)disp);
+}
+
+static void emit_load(Assembler* as, int dst, int base, int32_t disp) {
+	emit_rex(as, dst, base);
+	emit_byte(as, 0x8b);
+	emit_memory(as, dst, base, disp);
+}
+
+static void emit_store(Assembler* as, int base, int32_t disp, int src) {
+	emit_rex(as, src, base);
+	emit_byte(as, 0x89);
+	emit_memory(as, src, base, disp);
+}
+
+static void emit_mov_imm(Assembler* as, int reg, uint64_t value) {
+	emit_byte(as, 0x48 | (reg >> 3));
+	emit_byte(as, 0xb8 | (reg & 7));
+	emit_u64(as, value);
+}
+
+// mov, and, cmp and xor between two registers.
+static void emit_alu(Assembler* as, uint8_t opcode, int dst, int src) {
+	emit_rex(as, src, dst);
+	emit_byte(as, opcode);
+	emit_byte(as, 0xc0 | ((src & 7) << 3) | (dst & 7));
+}
+
+static void emit_mov(Assembler* as, int dst, int src) {
+	emit_alu(as, 0x89, dst, src);
+}
+
+static void emit_add_imm(Assembler* as, int reg, int32_t value) {
+	emit_byte(as, 0x48 | (reg >> 3));
+	emit_byte(as, 0x81);
+	emit_byte(as, 0xc0 | (reg & 7));
+	emit_u32(as, (uint32_t)value);
+}
+
+static void emit_movq_to_xmm(Assembler* as, int xmm, int reg) {
+	emit_byte(as, 0x66);
+	emit_rex(as, xmm, reg);
+	emit_byte(as, 0x0f);
+	emit_byte(as, 0x6e);
+	emit_byte(as, 0xc0 | ((xmm & 7) << 3) | (reg & 7));
+}
+
+static void emit_movq_from_xmm(Assembler* as, int reg, int xmm) {
+	emit_byte(as, 0x66);
+	emit_rex(as, xmm, reg);
+	emit_byte(as, 0x0f);
+	emit_byte(as, 0x7e);
+	emit_byte(as, 0xc0 | ((xmm & 7) << 3) | (reg & 7));
+}
+
+// addsd, subsd, mulsd or divsd xmm0, xmm1.
+static void emit_sse(Assembler* as, uint8_t opcode) {
+	emit_byte(as, 0xf2);
+	emit_byte(as, 0x0f);
+	emit_byte(as, opcode);
+	emit_byte(as, 0xc1);
+}
+
+static void emit_ucomisd(Assembler* as, int left, int right) {
+	emit_byte(as, 0x66);
+	emit_byte(as, 0x0f);
+	emit_byte(as, 0x2e);
+	emit_byte(as, 0xc0 | (left << 3) | right);
+}
+
+static void emit_cmov(Assembler* as, int condition, int dst, int src) {
+	emit_rex(as, dst, src);
+	emit_byte(as, 0x0f);
+	emit_byte(as, 0x40 | condition);
+	emit_byte(as, 0xc0 | ((dst & 7) << 3) | (src & 7));
+}
+
+// add, sub or cmp between the low halves of two of the first eight
+// registers. Writing the low half clears the high one.
+static void emit_alu32(Assembler* as, uint8_t opcode, int dst, int src) {
+	emit_byte(as, opcode);
+	emit_byte(as, 0xc0 | (src << 3) | dst);
+}
+
+// Emits a jump with its displacement left blank and returns where the
+// displacement is. A negative condition makes it unconditional.
+static int emit_jump(Assembler* as, int condition) {
+	if ( condition < 0 ) {
+		emit_byte(as, 0xe9);
+	} else {
+		emit_byte(as, 0x0f);
+		emit_byte(as, 0x80 | condition);
+	}
+
+	emit_u32(as, 0);
+	return as->count - 4;
+}
+
+static void patch_jump(Assembler* as, int position, int target) {
+	int32_t displacement = target - (position + 4);
+	memcpy(as->code + position, &displacement, 4);
+}
+
+static void patch_here(Assembler* as, int position) {
+	patch_jump(as, position, as->count);
+}
+
+static void jump_to(Assembler* as, int condition, int target) {
+	int position = emit_jump(as, condition);
+
+	if ( as->fixup_count == as->fixup_capacity ) {
+		as->fixup_capacity = as->fixup_capacity < 16 ? 16 : as->fixup_capacity * 2;
+		as->fixups = (Fixup*)realloc(as->fixups, sizeof(Fixup) * as->fixup_capacity);
+		if ( as->fixups == NULL ) exit(1);
+	}
+
+	as->fixups[as->fixup_count].position = position;
+	as->fixups[as->fixup_count].target = target;
+	as->fixup_count++;
+}
+
+static void emit_push(Assembler* as, int reg) {
+	emit_store(as, R13, 0, reg);
+	emit_add_imm(as, R13, sizeof(Value));
+}
+
+static void emit_push_value(Assembler* as, Value value) {
+	emit_mov_imm(as, RAX, value);
+	emit_push(as, RAX);
+}
+
+// Jumps to `position` unless `reg` holds a number. Expects QNAN in rcx.
+static int emit_unless_number(Assembler* as, int reg) {
+	emit_mov(as, RSI, reg);
+	emit_alu(as, OP_AND, RSI, RCX);
+	emit_alu(as, OP_CMP, RSI, RCX);
+	return emit_jump(as, CC_E);
+}
+
+// Jumps to `position` unless `reg` holds an int.
+static int emit_unless_int(Assembler* as, int reg) {
+	emit_mov(as, RSI, reg);
+	emit_byte(as, 0x48); emit_byte(as, 0xc1); emit_byte(as, 0xee); emit_byte(as, 0x20); // shr rsi, 32
+	emit_byte(as, 0x81); emit_byte(as, 0xfe); emit_u32(as, (uint32_t)(INT_TAG >> 32)); // cmp esi, imm32
+	return emit_jump(as, CC_NE);
+}
+
+// Calls a runtime path with the VM and up to two operands, after spilling
+// the stack top and recording where the frame is for error traces. The
+// paths that work on the frame's slots take the frame after the VM.
+static void emit_path_call(Assembler* as, void* function, int next, bool with_frame, uint64_t first, uint64_t second) {
+	emit_store(as, RBX, offsetof(VM, stack_top), R13);
+	emit_mov_imm(as, RAX, (uint64_t)(uintptr_t)&as->chunk->code[next]);
+	emit_store(as, R15, offsetof(CallFrame, ip), RAX);
+
+	emit_mov(as, RDI, RBX);
+	if ( with_frame ) {
+		emit_mov(as, RSI, R15);
+		emit_mov_imm(as, RDX, first);
+		emit_mov_imm(as, RCX, second);
+	} else {
+		emit_mov_imm(as, RSI, first);
+		emit_mov_imm(as, RDX, second);
+	}
+	emit_mov_imm(as, RAX, (uint64_t)(uintptr_t)function);
+	emit_byte(as, 0xff);
+	emit_byte(as, 0xd0);
+}
+
+static void emit_runtime_call(Assembler* as, void* function, int next, uint64_t first, uint64_t second) {
+	emit_path_call(as, function, next, false, first, second);
+}
+
+static void emit_frame_runtime_call(Assembler* as, void* function, int next, uint64_t first, uint64_t second) {
+	emit_path_call(as, function, next, true, first, second);
+}
+
+// Leaves through the error exit if the runtime path returned false, then
+// picks the stack back up, since a host native may have grown it.
+static void emit_check(Assembler* as) {
+	emit_byte(as, 0x84);
+	emit_byte(as, 0xc0);
+	jump_to(as, CC_E, LABEL_ERROR);
+	emit_load(as, R12, R15, offsetof(CallFrame, slots));
+	emit_load(as, R13, RBX, offsetof(VM, stack_top));
+}
+
+static void emit_runtime(Assembler* as, void* function, int next, uint64_t first, uint64_t second) {
+	emit_runtime_call(as, function, next, first, second);
+	emit_check(as);
+}
+
+static void emit_frame_runtime(Assembler* as, void* function, int next, uint64_t first, uint64_t second) {
+	emit_frame_runtime_call(as, function, next, first, second);
+	emit_check(as);
+}
+
+// Like emit_check() for the runtime paths that can call a function and
+// return the caller's frame, since the frames may have moved and the stack
+// with them.
+static void emit_check_frame(Assembler* as) {
+	emit_byte(as, 0x48); emit_byte(as, 0x85); emit_byte(as, 0xc0); // test rax, rax
+	jump_to(as, CC_E, LABEL_ERROR);
+	emit_mov(as, R15, RAX);
+	emit_load(as, R12, R15, offsetof(CallFrame, slots));
+	emit_load(as, R13, RBX, offsetof(VM, stack_top));
+}
+
+// Jumps to `target` if rax holds null or false.
+static void emit_if_falsey(Assembler* as, int target) {
+	emit_mov_imm(as, RCX, NULL_VAL);
+	emit_alu(as, OP_CMP, RAX, RCX);
+	jump_to(as, CC_E, target);
+	emit_mov_imm(as, RCX, FALSE_VAL);
+	emit_alu(as, OP_CMP, RAX, RCX);
+	jump_to(as, CC_E, target);
+}
+
+// Loads the number in `reg` into `xmm` as a double. Returns the jump taken
+// when it isn't a number. Expects QNAN in rcx.
+static int emit_to_xmm(Assembler* as, int xmm, int reg) {
+	int not_int = emit_unless_int(as, reg);
+	emit_byte(as, 0xf2); emit_byte(as, 0x0f); emit_byte(as, 0x2a); // cvtsi2sd xmm, r32
+	emit_byte(as, 0xc0 | (xmm << 3) | reg);
+	int converted = emit_jump(as, -1);
+
+	patch_here(as, not_int);
+	int not_number = emit_unless_number(as, reg);
+	emit_movq_to_xmm(as, xmm, reg);
+	patch_here(as, converted);
+	return not_number;
+}
+
+// rax op rdx, leaving the result in rax. Two ints make an int, as long as
+// it fits and isn't a zero product that might have to be -0, and an int and
+// a double make a double. Returns the jump taken for anything else, which
+// leaves the operands to the runtime, as are quotients of two ints.
+static int emit_number_operation(Assembler* as, uint8_t sse) {
+	int bails[5];
+	int bail_count = 0;
+
+	int not_int_a = emit_unless_int(as, RAX);
+	int not_int_b = emit_unless_int(as, RDX);
+	if ( sse == SSE_DIV ) {
+		bails[bail_count++] = emit_jump(as, -1);
+	} else {
+		if ( sse == SSE_MUL ) {
+			emit_byte(as, 0x0f); emit_byte(as, 0xaf); emit_byte(as, 0xc2); // imul eax, edx
+			bails[bail_count++] = emit_jump(as, CC_O);
+			emit_byte(as, 0x85); emit_byte(as, 0xc0);                     // test eax, eax
+			bails[bail_count++] = emit_jump(as, CC_E);
+		} else {
+			emit_alu32(as, sse == SSE_ADD ? 0x01 : 0x29, RAX, RDX);
+			bails[bail_count++] = emit_jump(as, CC_O);
+		}
+		emit_mov_imm(as, RCX, INT_TAG);
+		emit_alu(as, OP_OR, RAX, RCX);
+	}
+	int int_done = emit_jump(as, -1);
+
+	patch_here(as, not_int_a);
+	patch_here(as, not_int_b);
+	emit_mov_imm(as, RCX, QNAN);
+	bails[bail_count++] = emit_to_xmm(as, 0, RAX);
+	bails[bail_count++] = emit_to_xmm(as, 1, RDX);
+	emit_sse(as, sse);
+	emit_movq_from_xmm(as, RAX, 0);
+	patch_here(as, int_done);
+	int done = emit_jump(as, -1);
+
+	for ( int i=0; i < bail_count; i++ ) {
+		patch_here(as, bails[i]);
+	}
+	int bail = emit_jump(as, -1);
+
+	patch_here(as, done);
+	return bail;
+}
+
+// a op b for the two values on top of the stack when both are numbers,
+// otherwise the runtime reports the error or handles the other types.
+static void emit_arithmetic(Assembler* as, uint8_t sse, int op, int next) {
+	emit_load(as, RAX, R13, -16);
+	emit_load(as, RDX, R13, -8);
+	int bail = emit_number_operation(as, sse);
+
+	emit_store(as, R13, -16, RAX);
+	emit_add_imm(as, R13, -(int)sizeof(Value));
+	int done = emit_jump(as, -1);
+
+	patch_here(as, bail);
+	emit_runtime(as, rt_binary, next, op, 0);
+	patch_here(as, done);
+}
+
+static void emit_comparison(Assembler* as, int op, int next) {
+	emit_load(as, RAX, R13, -16);
+	emit_load(as, RDX, R13, -8);
+
+	int not_int_a = emit_unless_int(as, RAX);
+	int not_int_b = emit_unless_int(as, RDX);
+	emit_alu32(as, OP_CMP, RAX, RDX);
+	emit_mov_imm(as, RAX, FALSE_VAL);
+	emit_mov_imm(as, RCX, TRUE_VAL);
+	emit_cmov(as, op == OP_GREATER ? CC_G : CC_L, RAX, RCX);
+	int int_done = emit_jump(as, -1);
+
+	patch_here(as, not_int_a);
+	patch_here(as, not_int_b);
+	emit_mov_imm(as, RCX, QNAN);
+	int not_a = emit_to_xmm(as, 0, RAX);
+	int not_b = emit_to_xmm(as, 1, RDX);
+
+	// a > b, or b > a for a < b. Both are false when either is NaN.
+	if ( op == OP_GREATER ) {
+		emit_ucomisd(as, 0, 1);
+	} else {
+		emit_ucomisd(as, 1, 0);
+	}
+	emit_mov_imm(as, RAX, FALSE_VAL);
+	emit_mov_imm(as, RCX, TRUE_VAL);
+	emit_cmov(as, CC_A, RAX, RCX);
+
+	patch_here(as, int_done);
+	emit_store(as, R13, -16, RAX);
+	emit_add_imm(as, R13, -(int)sizeof(Value));
+	int done = emit_jump(as, -1);
+
+	patch_here(as, not_a);
+	patch_here(as, not_b);
+	emit_runtime(as, rt_binary, next, op, 0);
+	patch_here(as, done);
+}
+
+// x op= value on a local slot, leaving the result on the stack as well.
+static void emit_compound_local(Assembler* as, uint8_t sse, int kind, int slot, int next) {
+	emit_load(as, RAX, R12, slot * sizeof(Value));
+	emit_load(as, RDX, R13, -8);
+	int bail = emit_number_operation(as, sse);
+
+	emit_store(as, R12, slot * sizeof(Value), RAX);
+	emit_store(as, R13, -8, RAX);
+	int done = emit_jump(as, -1);
+
+	patch_here(as, bail);
+	emit_frame_runtime(as, rt_compound_local, next, kind, slot);
+	patch_here(as, done);
+}
+
+static void emit_inc_local(Assembler* as, int kind, int slot, int next) {
+	emit_load(as, RAX, R12, slot * sizeof(Value));
+	emit_mov_imm(as, RDX, INT_VAL(1));
+	int bail = emit_number_operation(as, kind == OP_INC_LOCAL - OP_SET_LOCAL ? SSE_ADD : SSE_SUB);
+
+	emit_store(as, R12, slot * sizeof(Value), RAX);
+	int done = emit_jump(as, -1);
+
+	patch_here(as, bail);
+	emit_frame_runtime(as, rt_inc_local, next, kind, slot);
+	patch_here(as, done);
+}
+
+static void emit_upvalue_location(Assembler* as, int reg, int slot) {
+	emit_load(as, reg, R15, offsetof(CallFrame, closure));
+	emit_load(as, reg, reg, offsetof(ObjClosure, upvalues) + slot * sizeof(ObjUpvalue*));
+	emit_load(as, reg, reg, offsetof(ObjUpvalue, location));
+}
+
+// The slots of the calling frame, which sits right below this one.
+static void emit_enclosing_slots(Assembler* as, int reg) {
+	emit_load(as, reg, R15, (int32_t)offsetof(CallFrame, slots) - (int32_t)sizeof(CallFrame));
+}
+
+static void emit_prologue(Assembler* as) {
+	emit_byte(as, 0x53);                      // push rbx
+	emit_byte(as, 0x41); emit_byte(as, 0x54); // push r12
+	emit_byte(as, 0x41); emit_byte(as, 0x55); // push r13
+	emit_byte(as, 0x41); emit_byte(as, 0x56); // push r14
+	emit_byte(as, 0x41); emit_byte(as, 0x57); // push r15
+
+	emit_mov(as, RBX, RDI);
+	emit_mov(as, R15, RSI);
+	emit_load(as, R12, R15, offsetof(CallFrame, slots));
+	emit_load(as, R13, RBX, offsetof(VM, stack_top));
+
+	emit_byte(as, 0xff); emit_byte(as, 0xe2); // jmp rdx
+}
+
+static void emit_epilogue(Assembler* as, int* error_label, int* exit_label) {
+	*error_label = as->count;
+	emit_byte(as, 0x31); emit_byte(as, 0xc0); // xor eax, eax
+
+	*exit_label = as->count;
+	emit_byte(as, 0x41); emit_byte(as, 0x5f); // pop r15
+	emit_byte(as, 0x41); emit_byte(as, 0x5e); // pop r14
+	emit_byte(as, 0x41); emit_byte(as, 0x5d); // pop r13
+	emit_byte(as, 0x41); emit_byte(as, 0x5c); // pop r12
+	emit_byte(as, 0x5b);                      // pop rbx
+	emit_byte(as, 0xc3);                      // ret
+}
+
+// Emits the template for the instruction at `offset` and returns the offset
+// of the next one, or -1 if there is no template for it.
+static int emit_instruction(Assembler* as, int offset) {
+	Chunk* chunk = as->chunk;
+	uint8_t* code = chunk->code;
+	uint8_t instruction = code[offset];
+
+	switch ( instruction ) {
+		case OP_CONSTANT:
+			emit_push_value(as, chunk->constants.values[code[offset + 1]]);
+			return offset + 2;
+		case OP_NULL:  emit_push_value(as, NULL_VAL); return offset + 1;
+		case OP_TRUE:  emit_push_value(as, TRUE_VAL); return offset + 1;
+		case OP_FALSE: emit_push_value(as, FALSE_VAL); return offset + 1;
+		case OP_POP:
+			emit_add_imm(as, R13, -(int)sizeof(Value));
+			return offset + 1;
+		case OP_GET_LOCAL:
+			emit_load(as, RAX, R12, code[offset + 1] * sizeof(Value));
+			emit_push(as, RAX);
+			return offset + 2;
+		case OP_SET_LOCAL:
+			emit_load(as, RAX, R13, -8);
+			emit_store(as, R12, code[offset + 1] * sizeof(Value), RAX);
+			return offset + 2;
+		case OP_GET_UPVALUE:
+			emit_upvalue_location(as, RCX, code[offset + 1]);
+			emit_load(as, RAX, RCX, 0);
+			emit_push(as, RAX);
+			return offset + 2;
+		case OP_SET_UPVALUE:
+			emit_upvalue_location(as, RCX, code[offset + 1]);
+			emit_load(as, RAX, R13, -8);
+			emit_store(as, RCX, 0, RAX);
+			return offset + 2;
+		case OP_GET_ENCLOSING:
+			emit_enclosing_slots(as, RCX);
+			emit_load(as, RAX, RCX, code[offset + 1] * sizeof(Value));
+			emit_push(as, RAX);
+			return offset + 2;
+		case OP_SET_ENCLOSING:
+			emit_enclosing_slots(as, RCX);
+			emit_load(as, RAX, R13, -8);
+			emit_store(as, RCX, code[offset + 1] * sizeof(Value), RAX);
+			return offset + 2;
+		case OP_GET_GLOBAL:
+		case OP_SET_GLOBAL:
+		case OP_DEFINE_GLOBAL: {
+			void* path = instruction == OP_GET_GLOBAL ? (void*)rt_get_global :
+				instruction == OP_SET_GLOBAL ? (void*)rt_set_global : (void*)rt_define_global;
+			Value name = chunk->constants.values[code[offset + 1]];
+			emit_runtime(as, path, offset + 2, (uint64_t)(uintptr_t)AS_STRING(name), 0);
+			return offset + 2;
+		}
+		case OP_ADD_SET_LOCAL:
+			emit_compound_local(as, SSE_ADD, instruction - OP_SET_LOCAL, code[offset + 1], offset + 2);
+			return offset + 2;
+		case OP_SUB_SET_LOCAL:
+			emit_compound_local(as, SSE_SUB, instruction - OP_SET_LOCAL, code[offset + 1], offset + 2);
+			return offset + 2;
+		case OP_MUL_SET_LOCAL:
+			emit_compound_local(as, SSE_MUL, instruction - OP_SET_LOCAL, code[offset + 1], offset + 2);
+			return offset + 2;
+		case OP_DIV_SET_LOCAL:
+			emit_compound_local(as, SSE_DIV, instruction - OP_SET_LOCAL, code[offset + 1], offset + 2);
+			return offset + 2;
+		case OP_MOD_SET_LOCAL:
+		case OP_SHIFTL_SET_LOCAL:
+		case OP_SHIFTR_SET_LOCAL:
+		case OP_ANDB_SET_LOCAL:
+		case OP_ORB_SET_LOCAL:
+		case OP_XORB_SET_LOCAL:
+			emit_frame_runtime(as, rt_compound_local, offset + 2, instruction - OP_SET_LOCAL, code[offset + 1]);
+			return offset + 2;
+		case OP_INC_LOCAL:
+		case OP_DEC_LOCAL:
+			emit_inc_local(as, instruction - OP_SET_LOCAL, code[offset + 1], offset + 2);
+			return offset + 2;
+		case OP_EQUAL:
+			emit_runtime(as, rt_equal, offset + 1, 0, 0);
+			return offset + 1;
+		case OP_GREATER:
+		case OP_LESSER:
+			emit_comparison(as, instruction, offset + 1);
+			return offset + 1;
+		case OP_ADD:
+		case OP_ADD_NUM_Q:
+		case OP_ADD_STR_Q:
+			emit_arithmetic(as, SSE_ADD, OP_ADD, offset + 1);
+			return offset + 1;
+		case OP_SUBTRACT:
+			emit_arithmetic(as, SSE_SUB, instruction, offset + 1);
+			return offset + 1;
+		case OP_MULTIPLY:
+			emit_arithmetic(as, SSE_MUL, instruction, offset + 1);
+			return offset + 1;
+		case OP_DIVIDE:
+			emit_arithmetic(as, SSE_DIV, instruction, offset + 1);
+			return offset + 1;
+		case OP_MODULO:
+		case OP_POW:
+		case OP_ANDB:
+		case OP_ORB:
+		case OP_XORB:
+		case OP_SHIFTR:
+		case OP_SHIFTL:
+			emit_runtime(as, rt_binary, offset + 1, instruction, 0);
+			return offset + 1;
+		case OP_NOT: {
+			emit_load(as, RAX, R13, -8);
+			emit_mov_imm(as, RDX, TRUE_VAL);
+			emit_mov_imm(as, RCX, NULL_VAL);
+			emit_alu(as, OP_CMP, RAX, RCX);
+			int is_null = emit_jump(as, CC_E);
+			emit_mov_imm(as, RCX, FALSE_VAL);
+			emit_alu(as, OP_CMP, RAX, RCX);
+			int is_false = emit_jump(as, CC_E);
+			emit_mov_imm(as, RDX, FALSE_VAL);
+			patch_here(as, is_null);
+			patch_here(as, is_false);
+			emit_store(as, R13, -8, RDX);
+			return offset + 1;
+		}
+		case OP_NEGATE:
+			emit_runtime(as, rt_negate, offset + 1, 0, 0);
+			return offset + 1;
+		case OP_TYPE:
+			emit_runtime(as, rt_type, offset + 1, 0, 0);
+			return offset + 1;
+		case OP_JUMP: {
+			uint16_t jump = (uint16_t)(code[offset + 1] << 8 | code[offset + 2]);
+			jump_to(as, -1, offset + 3 + jump);
+			return offset + 3;
+		}
+		case OP_JUMP_IF_FALSE: {
+			uint16_t jump = (uint16_t)(code[offset + 1] << 8 | code[offset + 2]);
+			emit_load(as, RAX, R13, -8);
+			emit_if_falsey(as, offset + 3 + jump);
+			return offset + 3;
+		}
+		case OP_LOOP: {
+			uint16_t jump = (uint16_t)(code[offset + 1] << 8 | code[offset + 2]);
+			jump_to(as, -1, offset + 3 - jump);
+			return offset + 3;
+		}
+		case OP_CALL:
+			emit_runtime_call(as, rt_call, offset + 4, code[offset + 1], 0);
+			emit_check_frame(as);
+			return offset + 4;
+		case OP_CALL_NATIVE:
+			emit_runtime_call(as, rt_call_native, offset + 3, code[offset + 1], code[offset + 2]);
+			emit_check_frame(as);
+			return offset + 3;
+		case OP_CREATE_LIST:
+			emit_runtime(as, rt_create_list, offset + 2, code[offset + 1], 0);
+			return offset + 2;
+		case OP_SUBSCRIPT:
+		case OP_SUBSCRIPT_LIST_Q:
+			emit_runtime(as, rt_subscript, offset + 1, 0, 0);
+			return offset + 1;
+		case OP_RETURN:
+			emit_frame_runtime_call(as, rt_return, offset + 1, 0, 0);
+			emit_byte(as, 0xb8); emit_u32(as, 1); // mov eax, 1
+			jump_to(as, -1, LABEL_EXIT);
+			return offset + 1;
+		default:
+			return -1;
+	}
+}
+
+static void free_assembler(Assembler* as) {
+	free(as->code);
+	free(as->native_at);
+	free(as->fixups);
+}
+
+void jit_compile(ObjFunction* function) {
+	function->jit_failed = true;
+
+	Assembler as;
+	memset(&as, 0, sizeof(as));
+	as.chunk = &function->chunk;
+	as.native_at = (int*)malloc(sizeof(int) * (function->chunk.count + 1));
+	if ( as.native_at == NULL ) exit(1);
+
+	for ( int i=0; i <= function->chunk.count; i++ ) {
+		as.native_at[i] = -1;
+	}
+
+	emit_prologue(&as);
+
+	for ( int offset=0; offset < function->chunk.count; ) {
+		as.native_at[offset] = as.count;
+		offset = emit_instruction(&as, offset);
+
+		if ( offset < 0 ) {
+			free_assembler(&as);
+			return;
+		}
+	}
+
+	int error_label;
+	int exit_label;
+	emit_epilogue(&as, &error_label, &exit_label);
+
+	for ( int i=0; i < as.fixup_count; i++ ) {
+		Fixup* fixup = &as.fixups[i];
+		int target = fixup->target == LABEL_ERROR ? error_label :
+			fixup->target == LABEL_EXIT ? exit_label : as.native_at[fixup->target];
+
+		if ( target < 0 ) {
+			free_assembler(&as);
+			return;
+		}
+		patch_jump(&as, fixup->position, target);
+	}
+
+	size_t size = as.count;
+	void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if ( memory == MAP_FAILED ) {
+		free_assembler(&as);
+		return;
+	}
+
+	memcpy(memory, as.code, size);
+	if ( mprotect(memory, size, PROT_READ | PROT_EXEC) != 0 ) {
+		munmap(memory, size);
+		free_assembler(&as);
+		return;
+	}
+
+	function->jit_code = memory;
+	function->jit_size = size;
+	function->jit_entries = as.native_at;
+	as.native_at = NULL;
+	free_assembler(&as);
+}
+
+void jit_free(ObjFunction* function) {
+	if ( function->jit_code != NULL ) {
+		munmap(function->jit_code, function->jit_size);
+		free(function->jit_entries);
+		function->jit_code = NULL;
+		function->jit_entries = NULL;
+	}
+}
+
+#endif // PIKEY_JIT
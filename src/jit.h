@@ -0,0 +1,25 @@
+#ifndef pikey_jit_h
+#define pikey_jit_h
+
+#ifdef PIKEY_JIT
+
+#include "object.h"
+#include "runtime.h"
+#include "vm.h"
+
+// Calls and loop iterations a function goes through before it is compiled.
+// A hot loop switches to the compiled code at its header.
+#define JIT_THRESHOLD 1000
+
+// Runs the frame until it returns, starting from `entry`, the code for one of
+// its instructions. Returns false after a runtime error has been reported.
+typedef bool (*JitFn)(VM* vm, CallFrame* frame, void* entry);
+
+// Translates the function to machine code, unless it uses an instruction the
+// compiler has no template for. Either way the function is not tried again.
+void jit_compile(ObjFunction* function);
+void jit_free(ObjFunction* function);
+
+#endif // PIKEY_JIT
+
+#endif // !pikey_jit_h
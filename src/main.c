@@ -2,6 +2,11 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "batch.h"
+#include "emit.h"
+#include "image.h"
+#include "server.h"
+#include "trace.h"
 #include "vm.h"
 
 static char* read_file(const char* path) {
@@ -29,9 +34,9 @@ static char* read_file(const char* path) {
 	return buffer;
 }
 
-static void run_file(const char* path) {
+static void run_file(VM* vm, const char* path) {
 	char* source = read_file(path);
-	InterpretResult result = interpret(source);
+	InterpretResult result = interpret(vm, source);
 	free(source);
 
 	switch ( result ) {
@@ -42,15 +47,95 @@ static void run_file(const char* path) {
 }
 
 int main(int argc, char* argv[]) {
-	init_vm();
+	if ( argc == 3 && strcmp(argv[1], "--batch") == 0 ) {
+		return run_batch(argv[2]);
+	}
+	if ( (argc == 3 || argc == 4) && strcmp(argv[1], "--serve") == 0 ) {
+		return run_server(argv[2], argc == 4 ? argv[3] : NULL);
+	}
+	if ( argc == 4 && strcmp(argv[1], "--client") == 0 ) {
+		char* source = read_file(argv[3]);
+		int status = run_client(argv[2], source);
+		free(source);
+		return status;
+	}
+
+	if ( (argc == 3 || argc == 4) && strcmp(argv[1], "--save-image") == 0 ) {
+		VM vm;
+		init_vm(&vm);
+		if ( argc == 4 ) run_file(&vm, argv[3]);
+
+		int status = save_image(&vm, argv[2]) ? 0 : 74;
+		free_vm(&vm);
+		return status;
+	}
+
+	if ( (argc == 3 || argc == 4) && strcmp(argv[1], "--emit-c") == 0 ) {
+		char* source = read_file(argv[2]);
+		FILE* out = argc == 4 ? fopen(argv[3], "w") : stdout;
+		if ( out == NULL ) {
+			fprintf(stderr, "Could not open file \"%s\".\n", argv[3]);
+			exit(74);
+		}
+
+		VM vm;
+		init_vm(&vm);
+		int status = emit_c(&vm, source, out) ? 0 : 65;
+		if ( out != stdout ) fclose(out);
+		free_vm(&vm);
+		free(source);
+		return status;
+	}
+
+	// Runs the script with its typing and waiting recorded instead of done,
+	// for --play to repeat later without running it again.
+	if ( argc == 4 && strcmp(argv[1], "--prerender") == 0 ) {
+		char* source = read_file(argv[2]);
+
+		VM vm;
+		Trace trace;
+		init_vm(&vm);
+		init_trace(&trace);
+		vm.trace = &trace;
+
+		int status = 0;
+		switch ( interpret(&vm, source) ) {
+			case INTERPRET_COMPILE_ERROR: status = 65; break;
+			case INTERPRET_RUNTIME_ERROR: status = 70; break;
+			default: if ( !save_trace(&trace, argv[3]) ) status = 74;
+		}
+
+		free_trace(&trace);
+		free_vm(&vm);
+		free(source);
+		return status;
+	}
+	if ( argc == 3 && strcmp(argv[1], "--play") == 0 ) {
+		return play_trace(argv[2], stdout) ? 0 : 74;
+	}
+
+	VM vm;
 
-	if ( argc == 2 ) {
-		run_file(argv[1]);
+	if ( argc == 4 && strcmp(argv[1], "--image") == 0 ) {
+		if ( !init_vm_from_image(&vm, argv[2]) ) exit(74);
+		run_file(&vm, argv[3]);
+	} else if ( argc == 2 ) {
+		init_vm(&vm);
+		run_file(&vm, argv[1]);
 	} else {
-		fprintf(stderr, "Usage: pikey [path]\n");
+		fprintf(stderr,
+			"Usage: pikey [path]\n"
+			"       pikey --image [image] [path]\n"
+			"       pikey --save-image [image] [prelude]\n"
+			"       pikey --emit-c [path] [out.c]\n"
+			"       pikey --prerender [path] [trace]\n"
+			"       pikey --play [trace]\n"
+			"       pikey --batch [dir|list]\n"
+			"       pikey --serve [socket] [image]\n"
+			"       pikey --client [socket] [path]\n");
 		exit(64);
 	}
 
-	free_vm();
+	free_vm(&vm);
 	return 0;
 }
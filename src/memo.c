@@ -0,0 +1,225 @@
+#include <string.h>
+
+#include "memo.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+
+#define MEMO_MAX_LOAD 0.75
+
+void init_memo_table(MemoTable* table, int limit) {
+	table->count = 0;
+	table->string_bytes = 0;
+	table->used = 0;
+	table->capacity = 0;
+	table->limit = limit;
+	table->hand = 0;
+	table->entries = NULL;
+}
+
+void free_memo_table(VM* vm, MemoTable* table) {
+	FREE_ARRAY(vm, MemoEntry, table->entries, table->capacity);
+	init_memo_table(table, table->limit);
+}
+
+static uint32_t hash_bits(uint64_t bits) {
+	bits ^= bits >> 33;
+	bits *= 0xff51afd7ed558ccdull;
+	bits ^= bits >> 33;
+	return (uint32_t)bits;
+}
+
+// Equal values hash the same: numbers by value, so that 0 and -0 agree,
+// strings by their characters, since those made at run time aren't interned,
+// and other objects by identity.
+static uint32_t hash_value(Value value) {
+	if ( IS_NUMBER(value) ) {
+		double number = AS_NUMBER(value);
+		if ( number == 0 ) number = 0;
+
+		uint64_t bits;
+		memcpy(&bits, &number, sizeof(bits));
+		return hash_bits(bits);
+	}
+
+	if ( IS_STRING(value) ) return string_hash(AS_STRING(value));
+	if ( IS_OBJ(value) ) return hash_bits((uint64_t)(uintptr_t)AS_OBJ(value));
+	if ( IS_BOOL(value) ) return AS_BOOL(value) ? 3 : 2;
+	return 1;
+}
+
+static uint32_t hash_args(int arg_count, Value* args) {
+	uint32_t hash = 2166136261u ^ (uint32_t)arg_count;
+
+	for ( int i=0; i < arg_count; i++ ) {
+		hash = (hash ^ hash_value(args[i])) * 16777619;
+	}
+
+	return hash;
+}
+
+static size_t string_bytes(int arg_count, Value* args) {
+	size_t bytes = 0;
+
+	for ( int i=0; i < arg_count; i++ ) {
+		if ( IS_STRING(args[i]) ) bytes += AS_STRING(args[i])->length;
+	}
+
+	return bytes;
+}
+
+static void remove_entry(MemoTable* table, MemoEntry* entry) {
+	entry->state = MEMO_TOMBSTONE;
+	table->count--;
+	table->string_bytes -= string_bytes(entry->arg_count, entry->args);
+}
+
+static bool args_equal(MemoEntry* entry, int arg_count, Value* args, uint32_t hash) {
+	if ( entry->hash != hash || entry->arg_count != arg_count ) return false;
+
+	for ( int i=0; i < arg_count; i++ ) {
+		if ( !values_equal(entry->args[i], args[i]) ) return false;
+	}
+
+	return true;
+}
+
+static MemoEntry* find_entry(MemoEntry* entries, int capacity, int arg_count, Value* args, uint32_t hash) {
+	uint32_t index = hash & (capacity - 1);
+	MemoEntry* tombstone = NULL;
+
+	for (;;) {
+		MemoEntry* entry = &entries[index];
+
+		if ( entry->state == MEMO_EMPTY ) {
+			return tombstone != NULL ? tombstone : entry;
+		} else if ( entry->state == MEMO_TOMBSTONE ) {
+			if ( tombstone == NULL ) tombstone = entry;
+		} else if ( args_equal(entry, arg_count, args, hash) ) {
+			return entry;
+		}
+
+		index = (index + 1) & (capacity - 1);
+	}
+}
+
+bool memo_get(MemoTable* table, int arg_count, Value* args, Value* result) {
+	if ( table->count == 0 ) return false;
+
+	MemoEntry* entry = find_entry(table->entries, table->capacity, arg_count, args, hash_args(arg_count, args));
+	if ( entry->state != MEMO_LIVE ) return false;
+
+	entry->referenced = true;
+	*result = entry->result;
+	return true;
+}
+
+static void adjust_capacity(VM* vm, MemoTable* table, int capacity) {
+	MemoEntry* entries = ALLOCATE(vm, MemoEntry, capacity);
+
+	for ( int i=0; i < capacity; i++ ) {
+		entries[i].state = MEMO_EMPTY;
+	}
+
+	for ( int i=0; i < table->capacity; i++ ) {
+		MemoEntry* entry = &table->entries[i];
+		if ( entry->state != MEMO_LIVE ) continue;
+
+		*find_entry(entries, capacity, entry->arg_count, entry->args, entry->hash) = *entry;
+	}
+
+	FREE_ARRAY(vm, MemoEntry, table->entries, table->capacity);
+	table->entries = entries;
+	table->capacity = capacity;
+	table->used = table->count;
+	table->hand = 0;
+}
+
+// Turns the first live entry the hand finds unused since its last pass into a
+// tombstone. Every entry it passes over is given one more pass to be used.
+static void evict(MemoTable* table) {
+	for (;;) {
+		MemoEntry* entry = &table->entries[table->hand];
+		table->hand = (table->hand + 1) & (table->capacity - 1);
+
+		if ( entry->state != MEMO_LIVE ) continue;
+
+		if ( entry->referenced ) {
+			entry->referenced = false;
+			continue;
+		}
+
+		remove_entry(table, entry);
+		return;
+	}
+}
+
+// A string in the key is replaced by a copy only the memo sees, so that
+// editing the caller's string can't change a key already in the table. The
+// key has to be where the collector can see it, such as on the stack.
+void memo_set(VM* vm, MemoTable* table, int arg_count, Value* args, Value result) {
+	size_t bytes = string_bytes(arg_count, args);
+	if ( bytes > MEMO_STRING_BYTES_MAX ) return;
+
+	for ( int i=0; i < arg_count; i++ ) {
+		if ( IS_STRING(args[i]) ) {
+			ObjString* string = AS_STRING(args[i]);
+			args[i] = OBJ_VAL(new_string(vm, string->chars, string->length));
+		}
+	}
+
+	if ( table->count >= table->limit ) evict(table);
+	while ( table->string_bytes + bytes > MEMO_STRING_BYTES_MAX ) evict(table);
+
+	// Rebuilding drops the tombstones eviction leaves behind. The table only
+	// grows when the live entries alone fill half of it, which keeps it
+	// bounded by the limit and leaves room for tombstones between rebuilds.
+	if ( table->used + 1 > table->capacity * MEMO_MAX_LOAD ) {
+		int capacity = table->capacity;
+		if ( table->count + 1 > capacity * MEMO_MAX_LOAD / 2 ) capacity = GROW_CAPACITY(capacity);
+		adjust_capacity(vm, table, capacity);
+	}
+
+	uint32_t hash = hash_args(arg_count, args);
+	MemoEntry* entry = find_entry(table->entries, table->capacity, arg_count, args, hash);
+
+	if ( entry->state == MEMO_EMPTY ) table->used++;
+	if ( entry->state != MEMO_LIVE ) table->count++;
+	if ( entry->state == MEMO_LIVE ) table->string_bytes -= string_bytes(entry->arg_count, entry->args);
+
+	for ( int i=0; i < arg_count; i++ ) {
+		entry->args[i] = args[i];
+	}
+	entry->result = result;
+	entry->hash = hash;
+	entry->arg_count = (uint8_t)arg_count;
+	entry->state = MEMO_LIVE;
+	entry->referenced = false;
+	table->string_bytes += bytes;
+}
+
+void memo_remove_white(MemoTable* table) {
+	for ( int i=0; i < table->capacity; i++ ) {
+		MemoEntry* entry = &table->entries[i];
+		if ( entry->state != MEMO_LIVE ) continue;
+
+		for ( int j=0; j < entry->arg_count; j++ ) {
+			if ( IS_OBJ(entry->args[j]) && !IS_STRING(entry->args[j]) && !AS_OBJ(entry->args[j])->is_marked ) {
+				remove_entry(table, entry);
+				break;
+			}
+		}
+	}
+}
+
+void mark_memo_table(VM* vm, MemoTable* table) {
+	for ( int i=0; i < table->capacity; i++ ) {
+		MemoEntry* entry = &table->entries[i];
+		if ( entry->state != MEMO_LIVE ) continue;
+
+		mark_value(vm, entry->result);
+		for ( int j=0; j < entry->arg_count; j++ ) {
+			if ( !IS_OBJ(entry->args[j]) || IS_STRING(entry->args[j]) ) mark_value(vm, entry->args[j]);
+		}
+	}
+}
@@ -0,0 +1,71 @@
+#ifndef pikey_memo_h
+#define pikey_memo_h
+
+#include "common.h"
+#include "value.h"
+
+// The most parameters a memoized function can take, the size of a key.
+#define MEMO_ARGS_MAX 4
+
+// The most results a memo keeps unless memoize() is given another limit, and
+// the largest limit it can be given.
+#define MEMO_LIMIT_DEFAULT 1024
+#define MEMO_LIMIT_MAX (1 << 24)
+
+// The most characters of string arguments a memo keeps copies of, see
+// MemoTable.
+#define MEMO_STRING_BYTES_MAX (1 << 20)
+
+typedef enum {
+	MEMO_EMPTY,
+	MEMO_TOMBSTONE,
+	MEMO_LIVE,
+} MemoState;
+
+typedef struct {
+	Value args[MEMO_ARGS_MAX];
+	Value result;
+	uint32_t hash;
+	uint8_t arg_count;
+	uint8_t state;
+	// Set on every hit, cleared as the eviction hand passes over the entry.
+	bool referenced;
+} MemoEntry;
+
+// Results keyed on argument values compared like ==. Once `limit` results
+// are kept, each new one evicts an older one, skipping those used since the
+// eviction hand last passed them.
+//
+// The results are kept alive by the table but the arguments are not: an
+// entry whose arguments include an object that is otherwise unreachable can
+// never be asked for again, and is dropped by the collector. Strings are the
+// exception. They are compared by their characters, so an equal string can
+// always ask again, and the table keeps copies of its own that nothing can
+// edit, alive along with the results. So do the numbers a compact build
+// boxes, which are values rather than objects to the script.
+//
+// The copies are limited to MEMO_STRING_BYTES_MAX characters. Older entries
+// are evicted to make room for a new one, and a key longer than that on its
+// own is not kept at all.
+typedef struct {
+	int count;
+	// The characters in the string arguments of the live entries.
+	size_t string_bytes;
+	// Live entries plus tombstones.
+	int used;
+	int capacity;
+	int limit;
+	int hand;
+	MemoEntry* entries;
+} MemoTable;
+
+void init_memo_table(MemoTable* table, int limit);
+void free_memo_table(VM* vm, MemoTable* table);
+
+bool memo_get(MemoTable* table, int arg_count, Value* args, Value* result);
+void memo_set(VM* vm, MemoTable* table, int arg_count, Value* args, Value result);
+
+void memo_remove_white(MemoTable* table);
+void mark_memo_table(VM* vm, MemoTable* table);
+
+#endif // !pikey_memo_h
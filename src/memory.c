@@ -2,6 +2,7 @@
 
 #include "memory.h"
 #include "compiler.h"
+#include "jit.h"
 #include "object.h"
 #include "vm.h"
 
@@ -11,16 +12,16 @@
 
 #define GC_HEAP_GROW_FACTOR 2
 
-void* reallocate(void* pointer, size_t old_size, size_t new_size) {
-	vm.bytes_allocated += new_size - old_size;
+void* reallocate(VM* vm, void* pointer, size_t old_size, size_t new_size) {
+	vm->bytes_allocated += new_size - old_size;
 
 	if ( new_size > old_size ) {
 #ifdef DEBUG_STRESS_GC
-		collect_garbage();
+		collect_garbage(vm);
 #endif
 
-		if ( vm.bytes_allocated > vm.next_gc ) {
-			collect_garbage();
+		if ( vm->bytes_allocated > vm->next_gc ) {
+			collect_garbage(vm);
 		}
 	}
 
@@ -35,78 +36,98 @@ void* reallocate(void* pointer, size_t old_size, size_t new_size) {
 	return result;
 }
 
-void mark_object(Obj* object) {
+void mark_object(VM* vm, Obj* object) {
 	if ( object == NULL ) return;
 	if ( object->is_marked ) return;
 
 #ifdef DEBUG_LOG_GC
 	printf("%p mark ", (void*)object);
-	print_value(OBJ_VAL(object));
+	print_value(stdout, OBJ_VAL(object));
 	printf("\n");
 #endif
 
 	object->is_marked = true;
 
-	if ( vm.gray_capacity < vm.gray_count + 1 ) {
-		vm.gray_capacity = GROW_CAPACITY(vm.gray_capacity);
-		vm.gray_stack = (Obj**)realloc(vm.gray_stack, sizeof(Obj*) * vm.gray_capacity);
+	if ( vm->gray_capacity < vm->gray_count + 1 ) {
+		vm->gray_capacity = GROW_CAPACITY(vm->gray_capacity);
+		vm->gray_stack = (Obj**)realloc(vm->gray_stack, sizeof(Obj*) * vm->gray_capacity);
 	}
 
-	vm.gray_stack[vm.gray_count++] = object;
+	vm->gray_stack[vm->gray_count++] = object;
 
-	if ( vm.gray_stack == NULL ) exit(1);
+	if ( vm->gray_stack == NULL ) exit(1);
 }
 
-void mark_value(Value value) {
-	if ( IS_OBJ(value) ) mark_object(AS_OBJ(value));
+void mark_value(VM* vm, Value value) {
+	if ( IS_OBJ(value) ) mark_object(vm, AS_OBJ(value));
+#ifdef COMPACT_VALUES
+	if ( IS_BOXED(value) ) mark_object(vm, AS_BOXED(value));
+#endif
 }
 
-static void mark_array(ValueArray* array) {
+static void mark_array(VM* vm, ValueArray* array) {
 	for ( int i=0; i < array->count; i++ ) {
-		mark_value(array->values[i]);
+		mark_value(vm, array->values[i]);
 	}
 }
 
-static void blacken_object(Obj* object) {
+static void blacken_object(VM* vm, Obj* object) {
 #ifdef DEBUG_LOG_GC
 	printf("%p blacken ", (void*)object);
-	print_value(OBJ_VAL(object));
+	print_value(stdout, OBJ_VAL(object));
 	printf("\n");
 #endif
 
 	switch (object->type) {
 		case OBJ_CLOSURE: {
 			ObjClosure* closure = (ObjClosure*)object;
-			mark_object((Obj*)closure->function);
+			mark_object(vm, (Obj*)closure->function);
 
 			for ( int i=0; i < closure->upvalue_count; i++ ) {
-				mark_object((Obj*)closure->upvalues[i]);
+				mark_object(vm, (Obj*)closure->upvalues[i]);
 			}
 			break;
 		}
 		case OBJ_FUNCTION: {
 			ObjFunction* function = (ObjFunction*)object;
-			mark_object((Obj*)function->name);
-			mark_array(&function->chunk.constants);
+			mark_object(vm, (Obj*)function->name);
+			mark_array(vm, &function->chunk.constants);
+
+			// A call cache doesn't keep its callee alive, see clear_white_caches().
+			if ( function->chunk.cache_count > 0 ) {
+				function->next_marked = vm->marked_functions;
+				vm->marked_functions = function;
+			}
 			break;
 		}
 		case OBJ_UPVALUE:
-			mark_value(((ObjUpvalue*)object)->closed);
+			mark_value(vm, ((ObjUpvalue*)object)->closed);
+			break;
 		case OBJ_LIST: {
 			ObjList* list = (ObjList*)object;
 
 			for ( int i=0; i < list->count; i++ ) {
-				mark_value(list->items[i]);
+				mark_value(vm, list->items[i]);
 			}
 			break;
 		}
+		case OBJ_MEMO: {
+			ObjMemo* memo = (ObjMemo*)object;
+			mark_value(vm, memo->function);
+			mark_memo_table(vm, &memo->cache);
+
+			memo->next_marked = vm->marked_memos;
+			vm->marked_memos = memo;
+			break;
+		}
 		case OBJ_NATIVE:
 		case OBJ_STRING:
+		case OBJ_NUMBER:
 			break;
 	}
 }
 
-static void free_object(Obj* object) {
+static void free_object(VM* vm, Obj* object) {
 #ifdef DEBUG_LOG_GC
 	printf("%p free type %d", (void*)object, object->type);
 #endif
@@ -114,63 +135,107 @@ static void free_object(Obj* object) {
 	switch ( object->type ) {
 		case OBJ_CLOSURE: {
 			ObjClosure* closure = (ObjClosure*)object;
-			FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalue_count);
-			FREE(ObjClosure, object);
+			reallocate(vm, object, sizeof(ObjClosure) + sizeof(ObjUpvalue*) * closure->upvalue_count, 0);
 			break;
 		}
 		case OBJ_FUNCTION: {
 			ObjFunction* function = (ObjFunction*)object;
-			free_chunk(&function->chunk);
-			FREE(ObjFunction, object);
+#ifdef PIKEY_JIT
+			jit_free(function);
+#endif
+			free_chunk(vm, &function->chunk);
+			FREE(vm, ObjFunction, object);
 			break;
 		}
 		case OBJ_NATIVE:
-			FREE(ObjNative, object);
+			FREE(vm, ObjNative, object);
 			break;
 		case OBJ_STRING: {
+			// Most strings hold their characters inline and are one block.
+			// Strings from a buffer share its characters, and those that were
+			// edited since got a copy of their own, see set_in_string().
 			ObjString* string = (ObjString*)object;
-			FREE_ARRAY(char, string->chars, string->length + 1);
-			FREE(ObjString, object);
+			if ( string->buffer != NULL ) {
+				release_string_buffer(vm, string->buffer);
+				FREE(vm, ObjString, object);
+			} else if ( string->chars != string->storage ) {
+				FREE_ARRAY(vm, char, string->chars, string->length + 1);
+				FREE(vm, ObjString, object);
+			} else {
+				reallocate(vm, object, sizeof(ObjString) + string->length + 1, 0);
+			}
 			break;
 		}
 		case OBJ_UPVALUE:
-			FREE(ObjUpvalue, object);
+			FREE(vm, ObjUpvalue, object);
 			break;
 		case OBJ_LIST: {
 			ObjList* list = (ObjList*)object;
-			FREE_ARRAY(Value*, list->items, list->count);
-			FREE(ObjList, object);
+			FREE_ARRAY(vm, Value*, list->items, list->count);
+			FREE(vm, ObjList, object);
 			break;
 		}
+		case OBJ_MEMO:
+			free_memo_table(vm, &((ObjMemo*)object)->cache);
+			FREE(vm, ObjMemo, object);
+			break;
+		case OBJ_NUMBER:
+			FREE(vm, ObjNumber, object);
+			break;
 	}
 }
 
-static void mark_roots() {
-	for ( Value* slot = vm.stack; slot < vm.stack_top; slot++ ) {
-		mark_value(*slot);
+static void mark_roots(VM* vm) {
+	for ( Value* slot = vm->stack; slot < vm->stack_top; slot++ ) {
+		mark_value(vm, *slot);
 	}
 
-	for ( ObjUpvalue* upvalue = vm.open_upvalues;
+	for ( ObjUpvalue* upvalue = vm->open_upvalues;
 		upvalue != NULL;
 		upvalue = upvalue->next ) {
 		
-		mark_object((Obj*)upvalue);
+		mark_object(vm, (Obj*)upvalue);
+	}
+
+	mark_table(vm, &vm->globals);
+	mark_table(vm, &vm->base_globals);
+	mark_compiler_roots(vm);
+
+	// Image objects are never swept, so they stay marked and mark_object()
+	// skips them. What they have come to refer to since is traced here.
+	for ( int i=0; i < vm->image_object_count; i++ ) {
+		blacken_object(vm, vm->image_objects[i]);
 	}
+}
 
-	mark_table(&vm.globals);
-	mark_compiler_roots();
+static void trace_references(VM* vm) {
+	while ( vm->gray_count > 0 ) {
+		Obj* object = vm->gray_stack[--vm->gray_count];
+		blacken_object(vm, object);
+	}
 }
 
-static void trace_references() {
-	while ( vm.gray_count > 0 ) {
-		Obj* object = vm.gray_stack[--vm.gray_count];
-		blacken_object(object);
+// A callee that only a call cache still refers to can never be called from
+// it again, as a call only hits the cache with the callee in hand. Its entry
+// is emptied before the callee is freed, so that a new object at the same
+// address can't be mistaken for it.
+static void clear_white_caches(VM* vm) {
+	for ( ObjFunction* function = vm->marked_functions; function != NULL; function = function->next_marked ) {
+		for ( int i=0; i < function->chunk.cache_count; i++ ) {
+			CallCache* cache = &function->chunk.caches[i];
+			if ( cache->callee != NULL && !cache->callee->is_marked ) {
+				cache->callee = NULL;
+				cache->is_native = false;
+			}
+		}
 	}
+
+	vm->marked_functions = NULL;
 }
 
-static void sweep() {
+static void sweep(VM* vm) {
 	Obj* previous = NULL;
-	Obj* object = vm.objects;
+	Obj* object = vm->objects;
 
 	while ( object != NULL ) {
 		if ( object->is_marked ) {
@@ -184,40 +249,60 @@ static void sweep() {
 			if ( previous != NULL ) {
 				previous->next = object;
 			} else {
-				vm.objects = object;
+				vm->objects = object;
 			}
 
-			free_object(unreached);
+			free_object(vm, unreached);
 		}
 	}
 }
 
-void collect_garbage() {
+void collect_garbage(VM* vm) {
 #ifdef DEBUG_LOG_GC
 	printf("-- gc begin\n");
-	size_t before = vm.bytes_allocated;
+	size_t before = vm->bytes_allocated;
 #endif
 
-	mark_roots();
-	trace_references();
-	table_remove_white(&vm.strings);
-	sweep();
+	mark_roots(vm);
+	trace_references(vm);
+	table_remove_white(&vm->strings);
+
+	for ( ObjMemo* memo = vm->marked_memos; memo != NULL; memo = memo->next_marked ) {
+		memo_remove_white(&memo->cache);
+	}
+	vm->marked_memos = NULL;
+	clear_white_caches(vm);
+	sweep(vm);
 
-	vm.next_gc = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+	vm->next_gc = vm->bytes_allocated * GC_HEAP_GROW_FACTOR;
 
 #ifdef DEBUG_LOG_GC
 	printf("-- gc end\n");
-	printf("   collected %zu bytes (from %zu to %zu) next at %zu\n", before - vm.bytes_allocated, before, vm.bytes_allocated, vm.next_gc);
+	printf("   collected %zu bytes (from %zu to %zu) next at %zu\n", before - vm->bytes_allocated, before, vm->bytes_allocated, vm->next_gc);
 #endif
 }
 
-void free_objects() {
-	Obj* object = vm.objects;
+void free_objects(VM* vm) {
+	Obj* object = vm->objects;
 	while ( object != NULL ) {
 		Obj* next = object->next;
-		free_object(object);
+		free_object(vm, object);
+		object = next;
+	}
+
+	free(vm->gray_stack);
+}
+
+// Frees every object allocated after `base`. The sweep keeps the list in
+// allocation order, so as long as `base` is still alive the objects in
+// front of it are exactly the newer ones.
+void free_objects_after(VM* vm, Obj* base) {
+	Obj* object = vm->objects;
+	while ( object != base ) {
+		Obj* next = object->next;
+		free_object(vm, object);
 		object = next;
 	}
 
-	free(vm.gray_stack);
+	vm->objects = base;
 }
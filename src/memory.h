@@ -4,27 +4,28 @@
 #include "common.h"
 #include "object.h"
 
-#define ALLOCATE(type, count) \
-	(type*)reallocate(NULL, 0, sizeof(type) * (count))
+#define ALLOCATE(vm, type, count) \
+	(type*)reallocate(vm, NULL, 0, sizeof(type) * (count))
 
-#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
+#define FREE(vm, type, pointer) reallocate(vm, pointer, sizeof(type), 0)
 
 #define GROW_CAPACITY(capacity) \
 	((capacity) < 8 ? 8 : (capacity) * 2)
 
-#define GROW_ARRAY(type, pointer, old_count, new_count)	\
-	(type*)reallocate(pointer, sizeof(type) * (old_count), \
+#define GROW_ARRAY(vm, type, pointer, old_count, new_count)	\
+	(type*)reallocate(vm, pointer, sizeof(type) * (old_count), \
 		sizeof(type) * (new_count))
 
-#define FREE_ARRAY(type, pointer, old_count) \
-	reallocate(pointer, sizeof(type) * old_count, 0)
+#define FREE_ARRAY(vm, type, pointer, old_count) \
+	reallocate(vm, pointer, sizeof(type) * old_count, 0)
 
-void* reallocate(void* pointer, size_t old_size, size_t new_size);
+void* reallocate(VM* vm, void* pointer, size_t old_size, size_t new_size);
 
-void mark_object(Obj* object);
-void mark_value(Value value);
-void collect_garbage();
+void mark_object(VM* vm, Obj* object);
+void mark_value(VM* vm, Value value);
+void collect_garbage(VM* vm);
 
-void free_objects();
+void free_objects(VM* vm);
+void free_objects_after(VM* vm, Obj* base);
 
 #endif // !pikey_memory_h
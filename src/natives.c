@@ -0,0 +1,232 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "memory.h"
+#include "natives.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+static bool clock_native(VM* vm, int arg_count, Value* args, Value* result) {
+	*result = NUMBER_VAL(vm, (double)clock() / CLOCKS_PER_SEC);
+	return true;
+}
+
+static bool convert_case(VM* vm, Value string_val, int (*convert)(int), Value* result) {
+	ObjString* string = AS_STRING(string_val);
+	ObjString* converted = reserve_string(vm, string->length);
+
+	for ( int i=0; i < string->length; i++ ) {
+		converted->chars[i] = convert(string->chars[i]);
+	}
+
+	*result = OBJ_VAL(commit_string(vm, converted));
+	return true;
+}
+
+static bool lower_native(VM* vm, int arg_count, Value* args, Value* result) {
+	return convert_case(vm, args[0], tolower, result);
+}
+
+static bool upper_native(VM* vm, int arg_count, Value* args, Value* result) {
+	return convert_case(vm, args[0], toupper, result);
+}
+
+static double rand_num_gen(double min, double max) {
+	return min + (rand() / (double)(RAND_MAX) * (max - min));
+}
+
+static bool rand_native(VM* vm, int arg_count, Value* args, Value* result) {
+	double min, max;
+	if ( arg_count != 2 ) {
+		min = 0;
+		max = 1;
+	} else {
+		min = AS_NUMBER(args[0]);
+		max = AS_NUMBER(args[1]);
+	}
+
+	double rand_num = rand_num_gen(min, max);
+	*result = NUMBER_VAL(vm, rand_num);
+	return true;
+}
+
+static bool rand_int_native(VM* vm, int arg_count, Value* args, Value* result) {
+	int min, max;
+	if ( arg_count != 2 ) {
+		min = 0;
+		max = 1;
+	} else {
+		min = (int)AS_NUMBER(args[0]);
+		max = (int)AS_NUMBER(args[1]);
+	}
+
+	int rand_num = (int)rand_num_gen(min, max + 1);
+	*result = INT32_VAL(vm, rand_num);
+	return true;
+}
+
+static bool rand_digit_native(VM* vm, int arg_count, Value* args, Value* result) {
+	int rand_num = (int)(rand_num_gen(0, 9) + 1);
+	char digit = '0' + rand_num;
+	*result = OBJ_VAL(new_string(vm, &digit, 1));
+	return true;
+}
+
+static bool rand_let_native(VM* vm, int arg_count, Value* args, Value* result) {
+	int rand_num = (int)(rand_num_gen(0, 25) + 1);
+	char* alpha = "abcdefghijklmnopqrstuvwxyz";
+	*result = OBJ_VAL(new_string(vm, &alpha[rand_num], 1));
+	return true;
+}
+
+static bool rand_spcc_native(VM* vm, int arg_count, Value* args, Value* result) {
+	int rand_num = (int)(rand_num_gen(0, 9) + 1);
+	char* spcc = "!@#$%^&*()";
+	*result = OBJ_VAL(new_string(vm, &spcc[rand_num], 1));
+	return true;
+}
+
+static bool rand_char_native(VM* vm, int arg_count, Value* args, Value* result) {
+	int rand_num = (int)(rand_num_gen(0, 45) + 1);
+	char* chars = "abcdefghijklmnopqrstuvwxyz0123456789!@#$%^&*()";
+	*result = OBJ_VAL(new_string(vm, &chars[rand_num], 1));
+	return true;
+}
+
+static bool slice_native(VM* vm, int arg_count, Value* args, Value* result) {
+	int length = arg_count == 3 ? (int)AS_NUMBER(args[2]) : 1;
+	ObjString* slice = slice_string(vm, AS_STRING(args[0]), (int)AS_NUMBER(args[1]), length);
+
+	if ( slice == NULL ) {
+		runtime_error(vm, "Slice out of range of string.");
+		return false;
+	}
+
+	*result = OBJ_VAL(slice);
+	return true;
+}
+
+static bool length_native(VM* vm, int arg_count, Value* args, Value* result) {
+	if ( IS_LIST(args[0]) ) {
+		*result = INT_VAL(AS_LIST(args[0])->count);
+	} else {
+		*result = INT_VAL(AS_STRING(args[0])->length);
+	}
+
+	return true;
+}
+
+static bool append_native(VM* vm, int arg_count, Value* args, Value* result) {
+	ObjList* list = AS_LIST(args[0]);
+	Value value = args[1];
+
+	append_to_list(vm, list, value);
+
+	*result = NULL_VAL;
+	return true;
+}
+
+static bool delete_native(VM* vm, int arg_count, Value* args, Value* result) {
+	ObjList* list = AS_LIST(args[0]);
+	int index = AS_NUMBER(args[1]);
+
+	if ( index < 0 && abs(index) <= list->count ) {
+	} else if ( 0 > index || index > list->count - 1 ) {
+		runtime_error(vm, "Index out of range of list.");
+		return false;
+	}
+
+	delete_from_list(list, index);
+
+	*result = NULL_VAL;
+	return true;
+}
+
+static bool memoize_native(VM* vm, int arg_count, Value* args, Value* result) {
+	if ( IS_CLOSURE(args[0]) && AS_CLOSURE(args[0])->function->arity > MEMO_ARGS_MAX ) {
+		runtime_error(vm, "Can only memoize functions of up to %d parameters.", MEMO_ARGS_MAX);
+		return false;
+	}
+
+	double limit = arg_count == 2 ? AS_NUMBER(args[1]) : MEMO_LIMIT_DEFAULT;
+	if ( !(limit >= 1 && limit <= MEMO_LIMIT_MAX) ) {
+		runtime_error(vm, "The size of a memo must be between 1 and %d.", MEMO_LIMIT_MAX);
+		return false;
+	}
+
+	*result = OBJ_VAL(new_memo(vm, args[0], (int)limit));
+	return true;
+}
+
+const NativeDef natives[] = {
+	{"clock",      clock_native,      0, 0, {0},                                  NATIVE_NONDETERMINISTIC, ""},
+	{"lower",      lower_native,      1, 1, {ARG_STRING},                         NATIVE_PURE,             "str(string)"},
+	{"upper",      upper_native,      1, 1, {ARG_STRING},                         NATIVE_PURE,             "str(string)"},
+	{"rand",       rand_native,       0, 2, {ARG_NUMBER, ARG_NUMBER},             NATIVE_NONDETERMINISTIC, "min(number - optional), max(number - optional)"},
+	{"rand_int",   rand_int_native,   0, 2, {ARG_NUMBER, ARG_NUMBER},             NATIVE_NONDETERMINISTIC, "min(int - optional), max(int - optional)"},
+	{"rand_digit", rand_digit_native, 0, 0, {0},                                  NATIVE_NONDETERMINISTIC, ""},
+	{"rand_let",   rand_let_native,   0, 0, {0},                                  NATIVE_NONDETERMINISTIC, ""},
+	{"rand_spcc",  rand_spcc_native,  0, 0, {0},                                  NATIVE_NONDETERMINISTIC, ""},
+	{"rand_char",  rand_char_native,  0, 0, {0},                                  NATIVE_NONDETERMINISTIC, ""},
+	{"slice",      slice_native,      2, 3, {ARG_STRING, ARG_NUMBER, ARG_NUMBER}, NATIVE_PURE,             "str(string), start(int), length(int - optional)"},
+	{"length",     length_native,     1, 1, {ARG_STRING | ARG_LIST},              NATIVE_PURE,             "str(string or list)"},
+	{"append",     append_native,     2, 2, {ARG_LIST, ARG_ANY},                  0,                       "list(list), value(any)"},
+	{"delete",     delete_native,     2, 2, {ARG_LIST, ARG_NUMBER},               0,                       "list(list), index(int)"},
+	{"memoize",    memoize_native,    1, 2, {ARG_FUNCTION, ARG_NUMBER},           0,                       "function(function), size(int - optional)"},
+};
+
+const int native_count = sizeof(natives) / sizeof(natives[0]);
+
+int find_native(const char* name, int length) {
+	for ( int i=0; i < native_count; i++ ) {
+		if ( (int)strlen(natives[i].name) == length && memcmp(natives[i].name, name, length) == 0 ) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+static int type_mask(Value value) {
+	if ( IS_NULL(value) ) return ARG_NULL;
+	if ( IS_BOOL(value) ) return ARG_BOOL;
+	if ( IS_NUMBER(value) ) return ARG_NUMBER;
+
+	switch ( OBJ_TYPE(value) ) {
+		case OBJ_STRING:  return ARG_STRING;
+		case OBJ_LIST:    return ARG_LIST;
+		case OBJ_CLOSURE:
+		case OBJ_NATIVE:
+		case OBJ_MEMO:    return ARG_FUNCTION;
+		default:          return 0;
+	}
+}
+
+bool check_native_args(VM* vm, const NativeDef* native, int arg_count, Value* args) {
+	if ( arg_count < native->min_arity || arg_count > native->max_arity ) {
+		if ( native->min_arity == native->max_arity ) {
+			runtime_error(vm, "Expected %d arguments but got %d.", native->min_arity, arg_count);
+		} else {
+			runtime_error(vm, "Expected %d to %d arguments but got %d.", native->min_arity, native->max_arity, arg_count);
+		}
+		return false;
+	}
+
+	for ( int i=0; i < arg_count && i < NATIVE_PARAMS_MAX; i++ ) {
+		if ( !(type_mask(args[i]) & native->params[i]) ) {
+			runtime_error(vm, "The %s function takes the following arguments: %s.", native->name, native->usage);
+			return false;
+		}
+	}
+
+	// Every call to a native comes through here, so this is where a trace
+	// being recorded finds out that it depends on more than the script.
+	if ( vm->trace != NULL && (native->flags & NATIVE_NONDETERMINISTIC) ) {
+		trace_input(vm, native);
+	}
+
+	return true;
+}
@@ -0,0 +1,46 @@
+#ifndef pikey_natives_h
+#define pikey_natives_h
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+#define NATIVE_PARAMS_MAX 3
+
+// Masks of the value types a native parameter accepts.
+#define ARG_NULL     (1 << 0)
+#define ARG_BOOL     (1 << 1)
+#define ARG_NUMBER   (1 << 2)
+#define ARG_STRING   (1 << 3)
+#define ARG_LIST     (1 << 4)
+#define ARG_FUNCTION (1 << 5)
+#define ARG_ANY      0xff
+
+typedef enum {
+	// The result depends on nothing but the arguments.
+	NATIVE_PURE             = 1 << 0,
+	// The result depends on the clock or the random number generator.
+	NATIVE_NONDETERMINISTIC = 1 << 1,
+} NativeFlags;
+
+// Describes a builtin function. The arity range and parameter types are
+// checked before the function runs, so it only has to handle the values it
+// was declared to take. A function reports an error with runtime_error() and
+// returns false, otherwise it stores its result and returns true.
+struct NativeDef {
+	const char* name;
+	NativeFn function;
+	int min_arity;
+	int max_arity;
+	uint8_t params[NATIVE_PARAMS_MAX];
+	int flags;
+	const char* usage;
+};
+
+extern const NativeDef natives[];
+extern const int native_count;
+
+int find_native(const char* name, int length);
+bool check_native_args(VM* vm, const NativeDef* native, int arg_count, Value* args);
+
+#endif // !pikey_natives_h
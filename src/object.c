@@ -8,16 +8,19 @@
 #include "value.h"
 #include "vm.h"
 
-#define ALLOCATE_OBJ(type, object_type) \
-	(type*)allocate_object(sizeof(type), object_type)
+#define ALLOCATE_OBJ(vm, type, object_type) \
+	(type*)allocate_object(vm, sizeof(type), object_type)
 
-static Obj* allocate_object(size_t size, ObjType type) {
-	Obj* object = (Obj*)reallocate(NULL, 0, size);
-	object->type = type;
+static void track_object(VM* vm, Obj* object) {
 	object->is_marked = false;
+	object->next = vm->objects;
+	vm->objects = object;
+}
 
-	object->next = vm.objects;
-	vm.objects = object;
+static Obj* allocate_object(VM* vm, size_t size, ObjType type) {
+	Obj* object = (Obj*)reallocate(vm, NULL, 0, size);
+	object->type = type;
+	track_object(vm, object);
 
 #ifdef DEBUG_LOG_GC
 	printf("%p allocate %zu for %d", (void*)object, size, type);
@@ -26,49 +29,82 @@ static Obj* allocate_object(size_t size, ObjType type) {
 	return object;
 }
 
-ObjClosure* new_closure(ObjFunction* function) {
-	ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalue_count);
-	for ( int i=0; i < function->upvalue_count; i++ ) {
-		upvalues[i] = NULL;
-	}
-
-	ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+ObjClosure* new_closure(VM* vm, ObjFunction* function) {
+	ObjClosure* closure = (ObjClosure*)allocate_object(vm,
+		sizeof(ObjClosure) + sizeof(ObjUpvalue*) * function->upvalue_count, OBJ_CLOSURE);
 	closure->function = function;
-	closure->upvalues = upvalues;
 	closure->upvalue_count = function->upvalue_count;
 
+	for ( int i=0; i < function->upvalue_count; i++ ) {
+		closure->upvalues[i] = NULL;
+	}
+
 	return closure;
 }
 
-ObjFunction* new_function() {
-	ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+ObjMemo* new_memo(VM* vm, Value function, int limit) {
+	ObjMemo* memo = ALLOCATE_OBJ(vm, ObjMemo, OBJ_MEMO);
+	memo->function = function;
+	init_memo_table(&memo->cache, limit);
+	memo->next_marked = NULL;
+	return memo;
+}
+
+#ifdef COMPACT_VALUES
+
+// The arithmetic that boxes runs with its operands held outside the stack,
+// so this never collects. The box still counts towards the next collection.
+Value box_number(VM* vm, double number) {
+	ObjNumber* box = (ObjNumber*)malloc(sizeof(ObjNumber));
+	if ( box == NULL ) exit(1);
+
+	vm->bytes_allocated += sizeof(ObjNumber);
+	box->obj.type = OBJ_NUMBER;
+	box->value = number;
+	track_object(vm, (Obj*)box);
+	return BOXED_VAL(box);
+}
+
+#endif
+
+ObjFunction* new_function(VM* vm) {
+	ObjFunction* function = ALLOCATE_OBJ(vm, ObjFunction, OBJ_FUNCTION);
 	function->arity = 0;
 	function->upvalue_count = 0;
 	function->name = NULL;
+	function->next_marked = NULL;
+	function->compiled = NULL;
+#ifdef PIKEY_JIT
+	function->jit_code = NULL;
+	function->jit_size = 0;
+	function->jit_entries = NULL;
+	function->hotness = 0;
+	function->jit_failed = false;
+#endif
 
 	init_chunk(&function->chunk);
 	return function;
 }
 
-ObjNative* new_native(NativeFn function) {
-	ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
-	native->function = function;
+ObjNative* new_native(VM* vm, const NativeDef* def) {
+	ObjNative* native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
+	native->def = def;
 	return native;
 }
 
-ObjList* new_list() {
-	ObjList* list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
+ObjList* new_list(VM* vm) {
+	ObjList* list = ALLOCATE_OBJ(vm, ObjList, OBJ_LIST);
 	list->items = NULL;
 	list->count = 0;
 	list->capacity = 0;
 	return list;
 }
 
-void append_to_list(ObjList* list, Value value) {
+void append_to_list(VM* vm, ObjList* list, Value value) {
 	if ( list->capacity < list->count + 1 ) {
 		int old_capacity = list->capacity;
 		list->capacity = GROW_CAPACITY(old_capacity);
-		list->items = GROW_ARRAY(Value, list->items, old_capacity, list->capacity);
+		list->items = GROW_ARRAY(vm, Value, list->items, old_capacity, list->capacity);
 	}
 	
 	list->items[list->count] = value;
@@ -78,23 +114,23 @@ void append_to_list(ObjList* list, Value value) {
 }
 
 void set_in_list(ObjList* list, int index, Value value) {
-	if ( index < 0 && abs(index) <= list->count - 1 ) {
-		list->items[list->count - 1 - index] = value;
+	if ( index < 0 && abs(index) <= list->count ) {
+		list->items[list->count + index] = value;
 	} else {
 		list->items[index] = value;
 	}
 }
 
 Value value_from_list(ObjList* list, int index) {
-	if ( index < 0 && abs(index) <= list->count - 1 ) {
-		return list->items[list->count - 1 - index];
+	if ( index < 0 && abs(index) <= list->count ) {
+		return list->items[list->count + index];
 	}
 	return list->items[index];
 }
 
 void delete_from_list(ObjList* list, int index) {
-	if ( index < 0 && abs(index) <= list->count - 1 ) {
-		index = list->count - 1 - index;
+	if ( index < 0 && abs(index) <= list->count ) {
+		index = list->count + index;
 	}
 
 	for ( int i=index; i < list->count - 1; i++ ) {
@@ -105,26 +141,54 @@ void delete_from_list(ObjList* list, int index) {
 	list->count --;
 }
 
-void set_in_string(ObjString* string, int index, char character) {
-	if ( index >= 0 ) {
-		string->chars[index] = character;
-	} else {
-		int true_index = index + strlen(string->chars);
-		string->chars[true_index] = character;
+// The characters of a string from a buffer may be shared with longer strings
+// built from it, so it is given its own before one is changed. An interned
+// string leaves the table first, as the table finds it by its characters.
+void set_in_string(VM* vm, ObjString* string, int index, char character) {
+	if ( index < 0 ) index += string->length;
+
+	if ( string->buffer != NULL ) {
+		char* chars = ALLOCATE(vm, char, string->length + 1);
+		memcpy(chars, string->chars, string->length);
+		chars[string->length] = '\0';
+
+		release_string_buffer(vm, string->buffer);
+		string->buffer = NULL;
+		string->chars = chars;
+	}
+
+	if ( string->interned ) {
+		table_delete(&vm->strings, string);
+		string->interned = false;
+		string->builtin = false;
 	}
+
+	string->chars[index] = character;
+	string->hash = 0;
 }
 
-static ObjString* allocate_string(char* chars, int length, uint32_t hash) {
-	ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-	string->length = length;
-	string->chars = chars;
-	string->hash = hash;
+// A negative start counts from the end of the string, the slice then ends on
+// that character. Returns NULL when the slice does not fit in the string.
+ObjString* slice_string(VM* vm, ObjString* string, int start, int length) {
+	if ( length < 0 ) return NULL;
 
-	push(OBJ_VAL(string));
-	table_set(&vm.strings, string, NULL_VAL);
-	pop();
+	if ( start < 0 ) {
+		if ( -start > string->length ) return NULL;
+		start = string->length + start - length + 1;
+	}
 
-	return string;
+	if ( start < 0 || start + length > string->length ) return NULL;
+
+	return new_string(vm, string->chars + start, length);
+}
+
+static void add_interned(VM* vm, ObjString* string, uint32_t hash) {
+	string->hash = hash;
+	string->interned = true;
+
+	push(vm, OBJ_VAL(string));
+	table_set(vm, &vm->strings, string, NULL_VAL);
+	pop(vm);
 }
 
 static uint32_t hash_string(const char* key, int length) {
@@ -137,74 +201,155 @@ static uint32_t hash_string(const char* key, int length) {
 	return hash;
 }
 
-ObjString* take_string(char* chars, int length) {
-	uint32_t hash = hash_string(chars, length);
+ObjString* reserve_string(VM* vm, int length) {
+	ObjString* string = (ObjString*)reallocate(vm, NULL, 0, sizeof(ObjString) + length + 1);
+	string->obj.type = OBJ_STRING;
+	string->length = length;
+	string->chars = string->storage;
+	string->chars[length] = '\0';
+	string->hash = 0;
+	string->interned = false;
+	string->builtin = false;
+	string->buffer = NULL;
+	return string;
+}
 
-	ObjString* interned = table_find_string(&vm.strings, chars, length, hash);
-	if ( interned != NULL ) {
-		FREE_ARRAY(char, chars, length + 1);
-		return interned;
-	}
+ObjString* commit_string(VM* vm, ObjString* string) {
+	track_object(vm, (Obj*)string);
+	return string;
+}
 
-	return allocate_string(chars, length, hash);
+ObjString* new_string(VM* vm, const char* chars, int length) {
+	ObjString* string = reserve_string(vm, length);
+	memcpy(string->chars, chars, length);
+	return commit_string(vm, string);
 }
 
-ObjString* copy_string(const char* chars, int length) {
+ObjString* copy_string(VM* vm, const char* chars, int length) {
 	uint32_t hash = hash_string(chars, length);
 
-	ObjString* interned = table_find_string(&vm.strings, chars, length, hash);
+	ObjString* interned = table_find_string(&vm->strings, chars, length, hash);
 	if ( interned != NULL ) return interned;
 
-	char* heap_chars = ALLOCATE(char, length + 1);
-	memcpy(heap_chars, chars, length);
-	heap_chars[length] = '\0';
-	return allocate_string(heap_chars, length, hash);
+	ObjString* string = (ObjString*)allocate_object(vm, sizeof(ObjString) + length + 1, OBJ_STRING);
+	string->length = length;
+	string->chars = string->storage;
+	memcpy(string->chars, chars, length);
+	string->chars[length] = '\0';
+	string->builtin = false;
+	string->buffer = NULL;
+	add_interned(vm, string, hash);
+	return string;
+}
+
+void release_string_buffer(VM* vm, StringBuffer* buffer) {
+	if ( --buffer->ref_count == 0 ) {
+		reallocate(vm, buffer, sizeof(StringBuffer) + buffer->capacity + 1, 0);
+	}
+}
+
+static StringBuffer* new_string_buffer(VM* vm, ObjString* prefix, int capacity) {
+	StringBuffer* buffer = (StringBuffer*)reallocate(vm, NULL, 0, sizeof(StringBuffer) + capacity + 1);
+	buffer->capacity = capacity;
+	buffer->length = prefix->length;
+	buffer->ref_count = 0;
+	memcpy(buffer->chars, prefix->chars, prefix->length);
+	return buffer;
 }
 
-ObjUpvalue* new_upvalue(Value* slot) {
-	ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
+// Appends to the buffer `a` ends, in amortized constant time, unless a
+// longer string has been built from `a` already. Then, or when `a` isn't
+// from a buffer, its characters are copied to a new one.
+ObjString* append_string(VM* vm, ObjString* a, ObjString* b) {
+	int length = a->length + b->length;
+	StringBuffer* buffer = a->buffer;
+
+	if ( buffer == NULL || buffer->length != a->length || buffer->capacity < length ) {
+		int capacity = GROW_CAPACITY(buffer == NULL ? a->length : buffer->capacity);
+		while ( capacity < length ) capacity = GROW_CAPACITY(capacity);
+		buffer = new_string_buffer(vm, a, capacity);
+	}
+
+	memcpy(buffer->chars + a->length, b->chars, b->length);
+	buffer->chars[length] = '\0';
+	buffer->length = length;
+	buffer->ref_count++;
+
+	ObjString* string = ALLOCATE_OBJ(vm, ObjString, OBJ_STRING);
+	string->length = length;
+	string->chars = buffer->chars;
+	string->hash = 0;
+	string->interned = false;
+	string->builtin = false;
+	string->buffer = buffer;
+	return string;
+}
+
+uint32_t string_hash(ObjString* string) {
+	if ( !string->interned && string->hash == 0 ) {
+		string->hash = hash_string(string->chars, string->length);
+	}
+
+	return string->hash;
+}
+
+bool strings_equal(ObjString* a, ObjString* b) {
+	if ( a == b ) return true;
+	if ( (a->interned && b->interned) || a->length != b->length ) return false;
+	if ( a->hash != 0 && b->hash != 0 && a->hash != b->hash ) return false;
+	return memcmp(a->chars, b->chars, a->length) == 0;
+}
+
+ObjUpvalue* new_upvalue(VM* vm, Value* slot) {
+	ObjUpvalue* upvalue = ALLOCATE_OBJ(vm, ObjUpvalue, OBJ_UPVALUE);
 	upvalue->closed = NULL_VAL;
 	upvalue->location = slot;
 	upvalue->next = NULL;
 	return upvalue;
 }
 
-static void print_function(ObjFunction* function) {
+static void print_function(FILE* out, ObjFunction* function) {
 	if ( function->name == NULL ) {
-		printf("<script>");
+		fprintf(out, "<script>");
 		return;
 	}
-	printf("<fn %s>", function->name->chars);
+	fprintf(out, "<fn %s>", function->name->chars);
 }
 
-static void print_list(ObjList* list) {
-	printf("[%d", (int)AS_NUMBER(list->items[0]));
+static void print_list(FILE* out, ObjList* list) {
+	fprintf(out, "[%d", (int)AS_NUMBER(list->items[0]));
 	for ( int i=1; i < list->count; i++) {
-		printf(", ");
-		printf("%d", (int)AS_NUMBER(list->items[i]));
+		fprintf(out, ", ");
+		fprintf(out, "%d", (int)AS_NUMBER(list->items[i]));
 	}
-	printf("]");
+	fprintf(out, "]");
 }
 
-void print_object(Value value) {
+void print_object(FILE* out, Value value) {
 	switch ( OBJ_TYPE(value) ) {
 		case OBJ_CLOSURE:
-			print_function(AS_CLOSURE(value)->function);
+			print_function(out, AS_CLOSURE(value)->function);
 			break;
 		case OBJ_FUNCTION:
-			print_function(AS_FUNCTION(value));
+			print_function(out, AS_FUNCTION(value));
 			break;
 		case OBJ_NATIVE:
-			printf("<native fn>");
+			fprintf(out, "<native fn>");
 			break;
 		case OBJ_STRING:
-			printf("%s", AS_CSTRING(value));
+			fprintf(out, "%.*s", AS_STRING(value)->length, AS_STRING(value)->chars);
 			break;
 		case OBJ_UPVALUE:
-			printf("upvalue");
+			fprintf(out, "upvalue");
 			break;
 		case OBJ_LIST:
-			print_list(AS_LIST(value));
+			print_list(out, AS_LIST(value));
+			break;
+		case OBJ_MEMO:
+			print_value(out, AS_MEMO(value)->function);
+			break;
+		case OBJ_NUMBER:
+			fprintf(out, "%g", ((ObjNumber*)AS_OBJ(value))->value);
 			break;
 	}
 }
@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "chunk.h"
+#include "memo.h"
 #include "value.h"
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
@@ -10,15 +11,16 @@
 #define IS_CLOSURE(value)  is_obj_type(value, OBJ_CLOSURE)
 #define IS_FUNCTION(value) is_obj_type(value, OBJ_FUNCTION)
 #define IS_NATIVE(value)   is_obj_type(value, OBJ_NATIVE)
+#define IS_MEMO(value)     is_obj_type(value, OBJ_MEMO)
 #define IS_STRING(value)   is_obj_type(value, OBJ_STRING)
 #define IS_LIST(value)     is_obj_type(value, OBJ_LIST)
 
 #define AS_CLOSURE(value)  ((ObjClosure*)AS_OBJ(value))
 #define AS_FUNCTION(value) ((ObjFunction*)AS_OBJ(value))
-#define AS_NATIVE(value)   (((ObjNative*)AS_OBJ(value))->function)
+#define AS_NATIVE(value)   (((ObjNative*)AS_OBJ(value))->def)
 #define AS_STRING(value)   ((ObjString*)AS_OBJ(value))
-#define AS_CSTRING(value)  (((ObjString*)AS_OBJ(value))->chars)
 #define AS_LIST(value)     ((ObjList*)AS_OBJ(value))
+#define AS_MEMO(value)     ((ObjMemo*)AS_OBJ(value))
 
 typedef enum {
 	OBJ_CLOSURE,
@@ -26,7 +28,9 @@ typedef enum {
 	OBJ_NATIVE,
 	OBJ_STRING,
 	OBJ_UPVALUE,
-	OBJ_LIST
+	OBJ_LIST,
+	OBJ_MEMO,
+	OBJ_NUMBER
 } ObjType;
 
 struct Obj {
@@ -35,26 +39,70 @@ struct Obj {
 	struct Obj* next;
 };
 
-typedef struct {
+typedef struct ObjFunction {
 	Obj obj;
 	int arity;
 	int upvalue_count;
 	Chunk chunk;
 	ObjString* name;
+	// The functions with call caches the collector has marked so far, whose
+	// caches it clears of unmarked callees once marking is done.
+	struct ObjFunction* next_marked;
+	// The CompiledFn --emit-c wrote for the function, in the programs it builds.
+	void* compiled;
+#ifdef PIKEY_JIT
+	// Machine code for the function once it has run often enough, see jit.h.
+	void* jit_code;
+	size_t jit_size;
+	// Where the code for each instruction starts, -1 inside operands.
+	int* jit_entries;
+	int hotness;
+	bool jit_failed;
+#endif
 } ObjFunction;
 
-typedef Value (*NativeFn)(int arg_count, Value* args);
+typedef bool (*NativeFn)(VM* vm, int arg_count, Value* args, Value* result);
+
+typedef struct NativeDef NativeDef;
 
 typedef struct {
 	Obj obj;
-	NativeFn function;
+	const NativeDef* def;
 } ObjNative;
 
+// The characters `+=` appends to, shared by every string it built from them.
+// A string can only be appended to in place while it is the one that ends
+// at `length`, so the strings sharing a buffer never see each other's
+// characters change.
+typedef struct {
+	int capacity;
+	int length;
+	int ref_count;
+	char chars[];
+} StringBuffer;
+
 struct ObjString {
 	Obj obj;
 	int length;
 	char* chars;
+	// Computed when the string is made if it is interned, and otherwise the
+	// first time string_hash() is asked for it.
 	uint32_t hash;
+	// Strings made at run time aren't interned, so two of them with the same
+	// characters can be different objects. Those built by `+=` also keep
+	// their characters in a buffer rather than their own allocation, and
+	// aren't terminated unless they end the buffer, so `chars` is always read
+	// up to `length` rather than as a C string.
+	bool interned;
+	// Set on the names of the builtins, so that a global write can tell when
+	// one of them is given another value.
+	bool builtin;
+	StringBuffer* buffer;
+	// Where `chars` points for every string not from a buffer, so that the
+	// characters come in the same allocation as the header. A string from a
+	// buffer that has one of its characters changed gets an allocation of
+	// its own instead.
+	char storage[];
 };
 
 typedef struct {
@@ -71,32 +119,69 @@ typedef struct ObjUpvalue {
 	struct ObjUpvalue* next;
 } ObjUpvalue;
 
+// The upvalues are allocated along with the closure, one load away from it.
 typedef struct {
 	Obj obj;
 	ObjFunction* function;
-	ObjUpvalue** upvalues;
 	int upvalue_count;
+	ObjUpvalue* upvalues[];
 } ObjClosure;
 
-ObjClosure* new_closure(ObjFunction* function);
+ObjClosure* new_closure(VM* vm, ObjFunction* function);
+
+// What memoize() returns, a function answering from a cache of the results
+// of another, see memo.h.
+typedef struct ObjMemo {
+	Obj obj;
+	Value function;
+	MemoTable cache;
+	// The memos the collector has marked so far, whose caches it prunes once
+	// marking is done.
+	struct ObjMemo* next_marked;
+} ObjMemo;
+
+ObjMemo* new_memo(VM* vm, Value function, int limit);
 
-ObjFunction* new_function();
+// A number boxed by a compact build, see value.h. It is only ever reached
+// through a Value with the boxed tag, never as an object.
+typedef struct {
+	Obj obj;
+	double value;
+} ObjNumber;
 
-ObjNative* new_native(NativeFn);
+ObjFunction* new_function(VM* vm);
 
-ObjList* new_list();
-void append_to_list(ObjList* list, Value value);
+ObjNative* new_native(VM* vm, const NativeDef* def);
+
+ObjList* new_list(VM* vm);
+void append_to_list(VM* vm, ObjList* list, Value value);
 void set_in_list(ObjList* list, int index, Value value);
 Value value_from_list(ObjList* list, int index);
 void delete_from_list(ObjList* list, int index);
 
-void set_in_string(ObjString* string, int index, char character);
-ObjString* take_string(char* chars, int length);
-ObjString* copy_string(const char* chars, int length);
-
-ObjUpvalue* new_upvalue(Value* slot);
-
-void print_object(Value value);
+// May allocate, so `string` has to be reachable, on the stack for one.
+void set_in_string(VM* vm, ObjString* string, int index, char character);
+ObjString* slice_string(VM* vm, ObjString* string, int start, int length);
+// A string with room for `length` characters, which the caller fills in
+// before handing it to commit_string(). Until then it isn't on the heap, so
+// nothing else may be allocated in between.
+ObjString* reserve_string(VM* vm, int length);
+// Puts `string` on the heap without hashing or interning it. Most strings
+// made at run time are typed once and dropped, so they are left like this
+// unless they're names the globals table needs interned.
+ObjString* commit_string(VM* vm, ObjString* string);
+// A string made at run time from `chars`, committed as above.
+ObjString* new_string(VM* vm, const char* chars, int length);
+ObjString* copy_string(VM* vm, const char* chars, int length);
+ObjString* append_string(VM* vm, ObjString* a, ObjString* b);
+void release_string_buffer(VM* vm, StringBuffer* buffer);
+
+uint32_t string_hash(ObjString* string);
+bool strings_equal(ObjString* a, ObjString* b);
+
+ObjUpvalue* new_upvalue(VM* vm, Value* slot);
+
+void print_object(FILE* out, Value value);
 
 static inline bool is_obj_type(Value value, ObjType type) {
 	return IS_OBJ(value) && AS_OBJ(value)->type == type;
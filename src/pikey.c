@@ -0,0 +1,208 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "image.h"
+#include "memory.h"
+#include "natives.h"
+#include "object.h"
+#include "pikey.h"
+#include "table.h"
+#include "vm.h"
+
+#if !defined(NAN_BOXING) && !defined(COMPACT_VALUES)
+#error "The embedding API passes values as their bits."
+#endif
+
+// With NaN boxing a Value is a uint64_t, and compact values are a uintptr_t
+// as PikeyValue is then too, so PikeyValue and Value, and PikeyNativeFn and
+// NativeFn, are the same types and pass straight through.
+_Static_assert(sizeof(PikeyValue) == sizeof(Value), "PikeyValue must hold a Value.");
+
+PikeyVM* pikey_new_vm(void) {
+	VM* vm = (VM*)malloc(sizeof(VM));
+	if ( vm == NULL ) return NULL;
+
+	init_vm(vm);
+	return vm;
+}
+
+void pikey_free_vm(PikeyVM* vm) {
+	free_vm(vm);
+	free(vm);
+}
+
+PikeyVM* pikey_new_vm_from_image(const char* path) {
+	VM* vm = (VM*)malloc(sizeof(VM));
+	if ( vm == NULL ) return NULL;
+
+	if ( !init_vm_from_image(vm, path) ) {
+		free(vm);
+		return NULL;
+	}
+	return vm;
+}
+
+bool pikey_save_image(PikeyVM* vm, const char* path) {
+	return save_image(vm, path);
+}
+
+void pikey_set_output(PikeyVM* vm, FILE* out, FILE* err) {
+	vm->out = out;
+	vm->err = err;
+}
+
+static PikeyResult to_result(InterpretResult result) {
+	switch ( result ) {
+		case INTERPRET_OK:            return PIKEY_OK;
+		case INTERPRET_COMPILE_ERROR: return PIKEY_COMPILE_ERROR;
+		case INTERPRET_RUNTIME_ERROR: return PIKEY_RUNTIME_ERROR;
+	}
+
+	return PIKEY_RUNTIME_ERROR;
+}
+
+PikeyResult pikey_run(PikeyVM* vm, const char* source) {
+	return to_result(interpret(vm, source));
+}
+
+PikeyResult pikey_call(PikeyVM* vm, PikeyValue callee, int arg_count,
+		const PikeyValue* args, PikeyValue* result) {
+	return to_result(call_from_host(vm, callee, arg_count, args, result));
+}
+
+bool pikey_define_native(PikeyVM* vm, const char* name, PikeyNativeFn function,
+		int min_arity, int max_arity) {
+	if ( find_native(name, (int)strlen(name)) != -1 ) return false;
+
+	NativeDef* native = (NativeDef*)malloc(sizeof(NativeDef));
+	char* native_name = (char*)malloc(strlen(name) + 1);
+	if ( native == NULL || native_name == NULL ) exit(1);
+	strcpy(native_name, name);
+
+	native->name = native_name;
+	native->function = function;
+	native->min_arity = min_arity;
+	native->max_arity = max_arity;
+	for ( int i=0; i < NATIVE_PARAMS_MAX; i++ ) {
+		native->params[i] = ARG_ANY;
+	}
+	native->flags = 0;
+	native->usage = "";
+
+	if ( vm->host_native_count == vm->host_native_capacity ) {
+		vm->host_native_capacity = GROW_CAPACITY(vm->host_native_capacity);
+		vm->host_natives = (NativeDef**)realloc(vm->host_natives,
+			sizeof(NativeDef*) * vm->host_native_capacity);
+		if ( vm->host_natives == NULL ) exit(1);
+	}
+	vm->host_natives[vm->host_native_count++] = native;
+
+	ensure_stack(vm, 2);
+	define_native(vm, native);
+	return true;
+}
+
+void pikey_error(PikeyVM* vm, const char* message) {
+	runtime_error(vm, "%s", message);
+}
+
+bool pikey_get_global(PikeyVM* vm, const char* name, PikeyValue* value) {
+	ObjString* key = copy_string(vm, name, (int)strlen(name));
+	return table_get(&vm->globals, key, value);
+}
+
+void pikey_set_global(PikeyVM* vm, const char* name, PikeyValue value) {
+	ensure_stack(vm, 2);
+	push(vm, value);
+	push(vm, OBJ_VAL(copy_string(vm, name, (int)strlen(name))));
+	table_set(vm, &vm->globals, AS_STRING(vm->stack_top[-1]), value);
+	note_global_write(vm, AS_STRING(vm->stack_top[-1]));
+	pop(vm);
+	pop(vm);
+}
+
+void pikey_push_root(PikeyVM* vm, PikeyValue value) {
+	ensure_stack(vm, 1);
+	push(vm, value);
+}
+
+void pikey_pop_root(PikeyVM* vm) {
+	pop(vm);
+}
+
+PikeyValue pikey_null(void) {
+	return NULL_VAL;
+}
+
+PikeyValue pikey_bool(bool boolean) {
+	return BOOL_VAL(boolean);
+}
+
+PikeyValue pikey_number(PikeyVM* vm, double number) {
+	return NUMBER_VAL(vm, number);
+}
+
+PikeyValue pikey_string(PikeyVM* vm, const char* chars, size_t length) {
+	return OBJ_VAL(copy_string(vm, chars, (int)length));
+}
+
+PikeyValue pikey_new_list(PikeyVM* vm) {
+	return OBJ_VAL(new_list(vm));
+}
+
+bool pikey_is_null(PikeyValue value) {
+	return IS_NULL(value);
+}
+
+bool pikey_is_bool(PikeyValue value) {
+	return IS_BOOL(value);
+}
+
+bool pikey_is_number(PikeyValue value) {
+	return IS_NUMBER(value);
+}
+
+bool pikey_is_string(PikeyValue value) {
+	return IS_STRING(value);
+}
+
+bool pikey_is_list(PikeyValue value) {
+	return IS_LIST(value);
+}
+
+bool pikey_is_function(PikeyValue value) {
+	return IS_CLOSURE(value) || IS_NATIVE(value) || IS_MEMO(value);
+}
+
+bool pikey_as_bool(PikeyValue value) {
+	return AS_BOOL(value);
+}
+
+double pikey_as_number(PikeyValue value) {
+	return AS_NUMBER(value);
+}
+
+const char* pikey_as_string(PikeyValue value, size_t* length) {
+	ObjString* string = AS_STRING(value);
+	if ( length != NULL ) *length = string->length;
+	return string->chars;
+}
+
+int pikey_list_count(PikeyValue list) {
+	return AS_LIST(list)->count;
+}
+
+PikeyValue pikey_list_get(PikeyValue list, int index) {
+	ObjList* items = AS_LIST(list);
+	if ( index < 0 || index >= items->count ) return NULL_VAL;
+	return items->items[index];
+}
+
+void pikey_list_append(PikeyVM* vm, PikeyValue list, PikeyValue value) {
+	ensure_stack(vm, 2);
+	push(vm, list);
+	push(vm, value);
+	append_to_list(vm, AS_LIST(list), value);
+	pop(vm);
+	pop(vm);
+}
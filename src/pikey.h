@@ -0,0 +1,104 @@
+#ifndef pikey_h
+#define pikey_h
+
+// The embedding API of libpikey. A host creates a VM, runs source on it and
+// then reads its globals or calls the functions it defined, passing values
+// back and forth directly instead of as text.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#if defined(__GNUC__)
+#define PIKEY_API __attribute__((visibility("default")))
+#else
+#define PIKEY_API
+#endif
+
+typedef struct VM PikeyVM;
+
+// A script value. Numbers, booleans and null are held by value. Strings,
+// lists and functions belong to the VM's heap and are only kept alive while
+// the VM can reach them, from a global or from pikey_push_root().
+//
+// A host of a library built with PIKEY_COMPACT=1 defines COMPACT_VALUES
+// before including this header. A value is then one machine word, and a
+// number that doesn't fit in one is boxed on the heap like a string.
+#ifdef COMPACT_VALUES
+typedef uintptr_t PikeyValue;
+#else
+typedef uint64_t PikeyValue;
+#endif
+
+typedef enum {
+	PIKEY_OK,
+	PIKEY_COMPILE_ERROR,
+	PIKEY_RUNTIME_ERROR,
+} PikeyResult;
+
+// A host function callable from scripts. It reports an error with
+// pikey_error() and returns false, otherwise it stores its result and
+// returns true. It must not call back into the VM with pikey_call().
+typedef bool (*PikeyNativeFn)(PikeyVM* vm, int arg_count, PikeyValue* args, PikeyValue* result);
+
+PIKEY_API PikeyVM* pikey_new_vm(void);
+PIKEY_API void pikey_free_vm(PikeyVM* vm);
+
+// Starts a VM from a heap image, or returns NULL if it can't be loaded.
+// pikey_save_image() writes one from an idle VM, including everything the
+// scripts run on it have defined.
+PIKEY_API PikeyVM* pikey_new_vm_from_image(const char* path);
+PIKEY_API bool pikey_save_image(PikeyVM* vm, const char* path);
+
+// Where print and type write, and where errors are reported. Both default to
+// stdout and stderr.
+PIKEY_API void pikey_set_output(PikeyVM* vm, FILE* out, FILE* err);
+
+// Compiles and runs a NUL-terminated script. Its globals stay defined for
+// later runs and calls on the same VM.
+PIKEY_API PikeyResult pikey_run(PikeyVM* vm, const char* source);
+
+PIKEY_API PikeyResult pikey_call(PikeyVM* vm, PikeyValue callee, int arg_count,
+	const PikeyValue* args, PikeyValue* result);
+
+// Defines a global function backed by `function`. Fails if `name` is one of
+// the builtins.
+PIKEY_API bool pikey_define_native(PikeyVM* vm, const char* name, PikeyNativeFn function,
+	int min_arity, int max_arity);
+PIKEY_API void pikey_error(PikeyVM* vm, const char* message);
+
+PIKEY_API bool pikey_get_global(PikeyVM* vm, const char* name, PikeyValue* value);
+PIKEY_API void pikey_set_global(PikeyVM* vm, const char* name, PikeyValue value);
+
+// Keeps a value alive across allocations until the matching pop. A runtime
+// error drops every root.
+PIKEY_API void pikey_push_root(PikeyVM* vm, PikeyValue value);
+PIKEY_API void pikey_pop_root(PikeyVM* vm);
+
+PIKEY_API PikeyValue pikey_null(void);
+PIKEY_API PikeyValue pikey_bool(bool boolean);
+PIKEY_API PikeyValue pikey_number(PikeyVM* vm, double number);
+PIKEY_API PikeyValue pikey_string(PikeyVM* vm, const char* chars, size_t length);
+PIKEY_API PikeyValue pikey_new_list(PikeyVM* vm);
+
+PIKEY_API bool pikey_is_null(PikeyValue value);
+PIKEY_API bool pikey_is_bool(PikeyValue value);
+PIKEY_API bool pikey_is_number(PikeyValue value);
+PIKEY_API bool pikey_is_string(PikeyValue value);
+PIKEY_API bool pikey_is_list(PikeyValue value);
+PIKEY_API bool pikey_is_function(PikeyValue value);
+
+PIKEY_API bool pikey_as_bool(PikeyValue value);
+PIKEY_API double pikey_as_number(PikeyValue value);
+// The characters stay valid as long as the string is alive. They aren't
+// always followed by a '\0', as a string built by += can share them with a
+// longer one, so read `length` of them rather than treating them as a C
+// string.
+PIKEY_API const char* pikey_as_string(PikeyValue value, size_t* length);
+
+PIKEY_API int pikey_list_count(PikeyValue list);
+PIKEY_API PikeyValue pikey_list_get(PikeyValue list, int index);
+PIKEY_API void pikey_list_append(PikeyVM* vm, PikeyValue list, PikeyValue value);
+
+#endif // !pikey_h
@@ -0,0 +1,51 @@
+#ifndef pikey_runtime_h
+#define pikey_runtime_h
+
+#include "object.h"
+#include "vm.h"
+
+// The runtime paths code compiled from bytecode calls, whether by the JIT or
+// as C by --emit-c. They work on vm->stack_top, which the code spills before
+// each call along with the frame's ip, and report errors like the
+// interpreter, returning false.
+//
+// `kind` is the distance of a compound assignment opcode from its OP_SET_*
+// opcode.
+
+// The C function --emit-c writes for an ObjFunction. It runs the frame until
+// it returns, like the interpreter would.
+typedef bool (*CompiledFn)(VM* vm, CallFrame* frame);
+
+bool rt_get_global(VM* vm, ObjString* name);
+bool rt_set_global(VM* vm, ObjString* name);
+bool rt_define_global(VM* vm, ObjString* name);
+bool rt_compound_local(VM* vm, CallFrame* frame, int kind, int slot);
+bool rt_inc_local(VM* vm, CallFrame* frame, int kind, int slot);
+bool rt_compound_global(VM* vm, ObjString* name, int kind);
+bool rt_compound_upvalue(VM* vm, CallFrame* frame, int slot, int kind);
+bool rt_compound_enclosing(VM* vm, CallFrame* frame, int slot, int kind);
+bool rt_binary(VM* vm, int op);
+bool rt_negate(VM* vm);
+bool rt_equal(VM* vm);
+bool rt_type(VM* vm);
+bool rt_wait(VM* vm);
+bool rt_create_list(VM* vm, int count);
+bool rt_subscript(VM* vm);
+bool rt_set_subscript(VM* vm);
+bool rt_iter_init(VM* vm);
+bool rt_close_upvalue(VM* vm);
+bool rt_return(VM* vm, CallFrame* frame);
+
+// Pushes the next element of the sequence in `slot`, whose index is in the
+// slot after it, or returns false once there are none left.
+bool rt_iter_next(VM* vm, CallFrame* frame, int slot);
+
+// Creates the closure for the OP_CLOSURE instruction at `offset` in the
+// frame's chunk, which holds the function and what it captures.
+bool rt_closure(VM* vm, CallFrame* frame, int offset);
+
+// Return the caller's frame, which may have moved, or NULL on an error.
+CallFrame* rt_call(VM* vm, int arg_count);
+CallFrame* rt_call_native(VM* vm, int index, int arg_count);
+
+#endif // !pikey_runtime_h
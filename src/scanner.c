@@ -9,7 +9,7 @@ typedef struct {
 	int line;
 } Scanner;
 
-Scanner scanner;
+_Thread_local Scanner scanner;
 
 void init_scanner(const char *source) {
 	scanner.start = source;
@@ -202,18 +202,22 @@ Token scan_token() {
 		case ';':  return make_token(TOKEN_SEMICOLON);
 		case ',':  return make_token(TOKEN_COMMA);
 		case '.':  return make_token(TOKEN_DOT);
-		case '-':  return make_token(match('=') ? TOKEN_MINUS_EQUAL : TOKEN_MINUS);
-		case '+':  return make_token(match('=') ? TOKEN_PLUS_EQUAL : TOKEN_PLUS);
-		case '/':  return make_token(TOKEN_SLASH);
-		case '*':  return make_token(match('*') ? TOKEN_STAR_STAR : TOKEN_STAR);
+		case '-':  return make_token(match('=') ? TOKEN_MINUS_EQUAL : match('-') ? TOKEN_MINUS_MINUS : TOKEN_MINUS);
+		case '+':  return make_token(match('=') ? TOKEN_PLUS_EQUAL : match('+') ? TOKEN_PLUS_PLUS : TOKEN_PLUS);
+		case '/':  return make_token(match('=') ? TOKEN_SLASH_EQUAL : TOKEN_SLASH);
+		case '*':  return make_token(match('*') ? TOKEN_STAR_STAR : match('=') ? TOKEN_STAR_EQUAL : TOKEN_STAR);
 		case '!':  return make_token(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
 		case '=':  return make_token(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
-		case '<':  return make_token(match('=') ? TOKEN_LESSER_EQUAL : match('<') ? TOKEN_LESSER_LESSER : TOKEN_LESSER);
-		case '>':  return make_token(match('=') ? TOKEN_GREATER_EQUAL : match('>') ? TOKEN_GREATER_GREATER : TOKEN_GREATER);
-		case '^':  return make_token(TOKEN_CARET);
-		case '|':  return make_token(TOKEN_PIPE);
-		case '&':  return make_token(TOKEN_AMPERSAND);
-		case '%':  return make_token(TOKEN_PERCENT);
+		case '<':
+			if ( match('<') ) return make_token(match('=') ? TOKEN_LESSER_LESSER_EQUAL : TOKEN_LESSER_LESSER);
+			return make_token(match('=') ? TOKEN_LESSER_EQUAL : TOKEN_LESSER);
+		case '>':
+			if ( match('>') ) return make_token(match('=') ? TOKEN_GREATER_GREATER_EQUAL : TOKEN_GREATER_GREATER);
+			return make_token(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+		case '^':  return make_token(match('=') ? TOKEN_CARET_EQUAL : TOKEN_CARET);
+		case '|':  return make_token(match('=') ? TOKEN_PIPE_EQUAL : TOKEN_PIPE);
+		case '&':  return make_token(match('=') ? TOKEN_AMPERSAND_EQUAL : TOKEN_AMPERSAND);
+		case '%':  return make_token(match('=') ? TOKEN_PERCENT_EQUAL : TOKEN_PERCENT);
 		case '[':  return make_token(TOKEN_LEFT_BRACKET);
 		case ']':  return make_token(TOKEN_RIGHT_BRACKET);
 		case '"':  return string('"');
@@ -222,3 +226,11 @@ Token scan_token() {
 
 	return error_token("Unexpected character.");
 }
+
+Token peek_token() {
+	Scanner saved = scanner;
+	Token token = scan_token();
+	scanner = saved;
+
+	return token;
+}
@@ -13,6 +13,11 @@ typedef enum {
 	TOKEN_CARET, TOKEN_GREATER_GREATER,
 	TOKEN_LESSER_LESSER,
 
+	TOKEN_STAR_EQUAL, TOKEN_SLASH_EQUAL, TOKEN_PERCENT_EQUAL,
+	TOKEN_LESSER_LESSER_EQUAL, TOKEN_GREATER_GREATER_EQUAL,
+	TOKEN_AMPERSAND_EQUAL, TOKEN_PIPE_EQUAL, TOKEN_CARET_EQUAL,
+	TOKEN_PLUS_PLUS, TOKEN_MINUS_MINUS,
+
 	TOKEN_BANG, TOKEN_BANG_EQUAL,
 	TOKEN_EQUAL, TOKEN_EQUAL_EQUAL,
 	TOKEN_GREATER, TOKEN_GREATER_EQUAL,
@@ -40,4 +45,6 @@ void init_scanner(const char* source);
 
 Token scan_token();
 
+Token peek_token();
+
 #endif // !pikey_scanner_h
@@ -0,0 +1,326 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "server.h"
+#include "vm.h"
+
+// A request is the script source, ended by the client shutting down its
+// side of the connection. The reply is a series of frames, each a tag byte
+// and a 32-bit big-endian length followed by that many bytes. Output frames
+// are sent as the script runs and the exit frame, holding the exit status as
+// a single byte, ends the reply.
+#define FRAME_OUT  'o'
+#define FRAME_ERR  'e'
+#define FRAME_EXIT 'x'
+
+#define FRAME_HEADER 5
+
+// A request bigger than this is refused, and a client that sends or reads
+// nothing for this many seconds is given up on, so that neither can hold on
+// to a worker.
+#define MAX_REQUEST     (16 * 1024 * 1024)
+#define REQUEST_TIMEOUT 10
+
+typedef struct {
+	int fd;
+	char tag;
+} FrameStream;
+
+static bool send_all(int fd, const void* data, size_t length) {
+	const char* bytes = (const char*)data;
+
+	while ( length > 0 ) {
+		ssize_t sent = send(fd, bytes, length, MSG_NOSIGNAL);
+		if ( sent <= 0 ) return false;
+		bytes += sent;
+		length -= sent;
+	}
+
+	return true;
+}
+
+static bool recv_all(int fd, void* data, size_t length) {
+	char* bytes = (char*)data;
+
+	while ( length > 0 ) {
+		ssize_t received = recv(fd, bytes, length, 0);
+		if ( received <= 0 ) return false;
+		bytes += received;
+		length -= received;
+	}
+
+	return true;
+}
+
+static bool send_frame(int fd, char tag, const char* data, size_t length) {
+	uint8_t header[FRAME_HEADER] = {
+		(uint8_t)tag,
+		(uint8_t)(length >> 24), (uint8_t)(length >> 16), (uint8_t)(length >> 8), (uint8_t)length,
+	};
+
+	return send_all(fd, header, FRAME_HEADER) && send_all(fd, data, length);
+}
+
+// A client that hangs up early only loses its output, the script still runs
+// to the end so the VM is left in a state reset_vm() can handle.
+static ssize_t write_frame(void* cookie, const char* data, size_t length) {
+	FrameStream* stream = (FrameStream*)cookie;
+	send_frame(stream->fd, stream->tag, data, length);
+	return length;
+}
+
+static FILE* open_frame_stream(FrameStream* stream) {
+	cookie_io_functions_t functions = { NULL, write_frame, NULL, NULL };
+	FILE* file = fopencookie(stream, "w", functions);
+	if ( file == NULL ) exit(1);
+
+	setvbuf(file, NULL, _IOLBF, BUFSIZ);
+	return file;
+}
+
+// Returns NULL if the client hangs up, times out or sends too much.
+static char* read_request(int fd) {
+	size_t capacity = 4096;
+	size_t length = 0;
+	char* source = (char*)malloc(capacity);
+	if ( source == NULL ) exit(1);
+
+	for ( ;; ) {
+		if ( length > MAX_REQUEST ) {
+			const char* message = "The script is too large.\n";
+			uint8_t status = 74;
+			send_frame(fd, FRAME_ERR, message, strlen(message));
+			send_frame(fd, FRAME_EXIT, (const char*)&status, 1);
+			free(source);
+			return NULL;
+		}
+
+		if ( length + 1 == capacity ) {
+			capacity *= 2;
+			source = (char*)realloc(source, capacity);
+			if ( source == NULL ) exit(1);
+		}
+
+		ssize_t received = recv(fd, source + length, capacity - length - 1, 0);
+		if ( received < 0 ) {
+			free(source);
+			return NULL;
+		}
+		if ( received == 0 ) break;
+		length += received;
+	}
+
+	source[length] = '\0';
+	return source;
+}
+
+static void serve_request(VM* vm, int fd) {
+	struct timeval timeout = { REQUEST_TIMEOUT, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	char* source = read_request(fd);
+	if ( source == NULL ) return;
+
+	FrameStream out_stream = { fd, FRAME_OUT };
+	FrameStream err_stream = { fd, FRAME_ERR };
+	vm->out = open_frame_stream(&out_stream);
+	vm->err = open_frame_stream(&err_stream);
+
+	uint8_t status = 0;
+	switch ( interpret(vm, source) ) {
+		case INTERPRET_OK:            status = 0; break;
+		case INTERPRET_COMPILE_ERROR: status = 65; break;
+		case INTERPRET_RUNTIME_ERROR: status = 70; break;
+	}
+
+	fclose(vm->out);
+	fclose(vm->err);
+	vm->out = stdout;
+	vm->err = stderr;
+	reset_vm(vm);
+	free(source);
+
+	send_frame(fd, FRAME_EXIT, (const char*)&status, 1);
+}
+
+static bool socket_address(const char* socket_path, struct sockaddr_un* address) {
+	if ( strlen(socket_path) >= sizeof(address->sun_path) ) {
+		fprintf(stderr, "Socket path \"%s\" is too long.\n", socket_path);
+		return false;
+	}
+
+	memset(address, 0, sizeof(*address));
+	address->sun_family = AF_UNIX;
+	strcpy(address->sun_path, socket_path);
+	return true;
+}
+
+// Each worker has a warm VM of its own and takes connections straight from
+// the listening socket, so a slow script only holds up its own worker.
+typedef struct {
+	pthread_t thread;
+	int server;
+	VM vm;
+} ServerWorker;
+
+// Connections that fail before they are accepted are skipped. Running out of
+// file descriptors or memory passes once other requests finish, so the
+// worker waits a little rather than spinning. Anything else means the
+// listening socket itself is broken.
+static void* run_server_worker(void* arg) {
+	ServerWorker* worker = (ServerWorker*)arg;
+
+	for ( ;; ) {
+		int client = accept(worker->server, NULL, NULL);
+
+		if ( client < 0 ) {
+			switch ( errno ) {
+				case EINTR:
+				case ECONNABORTED:
+				case EPROTO:
+					continue;
+				case EMFILE:
+				case ENFILE:
+				case ENOBUFS:
+				case ENOMEM:
+					usleep(100 * 1000);
+					continue;
+				default:
+					perror("accept");
+					exit(71);
+			}
+		}
+
+		serve_request(&worker->vm, client);
+		close(client);
+	}
+
+	return NULL;
+}
+
+static int worker_count() {
+	int count = 0;
+
+	const char* jobs_env = getenv("PIKEY_JOBS");
+	if ( jobs_env != NULL ) count = atoi(jobs_env);
+	if ( count <= 0 ) count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if ( count < 1 ) count = 1;
+
+	return count;
+}
+
+int run_server(const char* socket_path, const char* image_path) {
+	struct sockaddr_un address;
+	if ( !socket_address(socket_path, &address) ) return 64;
+
+	int server = socket(AF_UNIX, SOCK_STREAM, 0);
+	if ( server < 0 ) {
+		fprintf(stderr, "Could not create socket.\n");
+		return 71;
+	}
+
+	// A socket file left behind by an earlier server would make bind() fail.
+	unlink(socket_path);
+	if ( bind(server, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(server, SOMAXCONN) < 0 ) {
+		fprintf(stderr, "Could not listen on \"%s\".\n", socket_path);
+		close(server);
+		return 74;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	int count = worker_count();
+	ServerWorker* workers = (ServerWorker*)malloc(sizeof(ServerWorker) * count);
+	if ( workers == NULL ) exit(1);
+
+	for ( int i=0; i < count; i++ ) {
+		workers[i].server = server;
+
+		if ( image_path == NULL ) {
+			init_vm(&workers[i].vm);
+		} else if ( !init_vm_from_image(&workers[i].vm, image_path) ) {
+			close(server);
+			unlink(socket_path);
+			return 74;
+		}
+
+		if ( pthread_create(&workers[i].thread, NULL, run_server_worker, &workers[i]) != 0 ) {
+			fprintf(stderr, "Could not start worker thread.\n");
+			exit(71);
+		}
+	}
+
+	// The workers never return.
+	for ( int i=0; i < count; i++ ) {
+		pthread_join(workers[i].thread, NULL);
+	}
+
+	free(workers);
+	close(server);
+	return 0;
+}
+
+int run_client(const char* socket_path, const char* source) {
+	struct sockaddr_un address;
+	if ( !socket_address(socket_path, &address) ) return 64;
+
+	int server = socket(AF_UNIX, SOCK_STREAM, 0);
+	if ( server < 0 || connect(server, (struct sockaddr*)&address, sizeof(address)) < 0 ) {
+		fprintf(stderr, "Could not connect to \"%s\".\n", socket_path);
+		return 74;
+	}
+
+	// A server that refuses a script replies without reading all of it, so
+	// the reply is read even when sending fails.
+	if ( send_all(server, source, strlen(source)) ) shutdown(server, SHUT_WR);
+
+	char* data = NULL;
+	size_t capacity = 0;
+
+	for ( ;; ) {
+		uint8_t header[FRAME_HEADER];
+		if ( !recv_all(server, header, FRAME_HEADER) ) break;
+
+		size_t length = (size_t)header[1] << 24 | (size_t)header[2] << 16 | (size_t)header[3] << 8 | header[4];
+		if ( length > capacity ) {
+			capacity = length;
+			data = (char*)realloc(data, capacity);
+			if ( data == NULL ) exit(1);
+		}
+		if ( !recv_all(server, data, length) ) break;
+
+		switch ( header[0] ) {
+			case FRAME_OUT:
+				fwrite(data, 1, length, stdout);
+				fflush(stdout);
+				break;
+			case FRAME_ERR:
+				fwrite(data, 1, length, stderr);
+				break;
+			case FRAME_EXIT: {
+				int status = length == 1 ? (uint8_t)data[0] : 70;
+				free(data);
+				close(server);
+				return status;
+			}
+		}
+	}
+
+	fprintf(stderr, "The server closed the connection.\n");
+	free(data);
+	close(server);
+	return 74;
+}
@@ -0,0 +1,16 @@
+#ifndef pikey_server_h
+#define pikey_server_h
+
+// Serves scripts sent over the Unix domain socket at `socket_path`. Requests
+// run concurrently on PIKEY_JOBS worker threads, one per core by default,
+// each with a warm VM of its own that is reset between requests. With an
+// `image_path`, each worker starts from that heap image, and every request
+// starts from it again. Requests are script source. Only returns if the
+// socket or the image can't be set up.
+int run_server(const char* socket_path, const char* image_path);
+
+// Sends `source` to a server, copies the output it streams back to stdout
+// and stderr, and returns the script's exit status.
+int run_client(const char* socket_path, const char* source);
+
+#endif // !pikey_server_h
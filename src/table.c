@@ -13,8 +13,8 @@ void init_table(Table* table) {
 	table->entries = NULL;
 }
 
-void free_table(Table* table) {
-	FREE_ARRAY(Entry, table->entries, table->capacity);
+void free_table(VM* vm, Table* table) {
+	FREE_ARRAY(vm, Entry, table->entries, table->capacity);
 	init_table(table);
 }
 
@@ -48,8 +48,8 @@ bool table_get(Table* table, ObjString* key, Value* value) {
 	return true;
 }
 
-static void adjust_capacity(Table* table, int capacity) {
-	Entry* entries = ALLOCATE(Entry, capacity);
+static void adjust_capacity(VM* vm, Table* table, int capacity) {
+	Entry* entries = ALLOCATE(vm, Entry, capacity);
 
 	for (int i=0; i < capacity; i++) {
 		entries[i].key = NULL;
@@ -67,15 +67,15 @@ static void adjust_capacity(Table* table, int capacity) {
 		table->count++;
 	}
 	
-	FREE_ARRAY(Entry, table->entries, table->capacity);
+	FREE_ARRAY(vm, Entry, table->entries, table->capacity);
 	table->entries = entries;
 	table->capacity = capacity;
 }
 
-bool table_set(Table* table, ObjString* key, Value value) {
+bool table_set(VM* vm, Table* table, ObjString* key, Value value) {
 	if ( table->count + 1 > table->capacity * TABLE_MAX_LOAD ) {
 		int capacity = GROW_CAPACITY(table->capacity);
-		adjust_capacity(table, capacity);
+		adjust_capacity(vm, table, capacity);
 	}
 
 	Entry* entry = find_entry(table->entries, table->capacity, key);
@@ -98,12 +98,12 @@ bool table_delete(Table* table, ObjString* key) {
 	return true;
 }
 
-void table_add_all(Table* from, Table* to) {
+void table_add_all(VM* vm, Table* from, Table* to) {
 	for ( int i=0; i < from->capacity; i++ ) {
 		Entry* entry = &from->entries[i];
 		
 		if ( entry->key != NULL ) {
-			table_set(to, entry->key, entry->value);
+			table_set(vm, to, entry->key, entry->value);
 		}
 	}
 }
@@ -138,10 +138,10 @@ void table_remove_white(Table* table) {
 	}
 }
 
-void mark_table(Table* table) {
+void mark_table(VM* vm, Table* table) {
 	for ( int i=0; i < table->capacity; i++ ) {
 		Entry* entry = &table->entries[i];
-		mark_object((Obj*)entry->key);
-		mark_value(entry->value);
+		mark_object(vm, (Obj*)entry->key);
+		mark_value(vm, entry->value);
 	}
 }
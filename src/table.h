@@ -16,17 +16,17 @@ typedef struct {
 } Table;
 
 void init_table(Table* table);
-void free_table(Table* table);
+void free_table(VM* vm, Table* table);
 
 bool table_get(Table* table, ObjString* key, Value* value);
-bool table_set(Table* table, ObjString* key, Value value);
+bool table_set(VM* vm, Table* table, ObjString* key, Value value);
 bool table_delete(Table* table, ObjString* key);
 
-void table_add_all(Table* from, Table* to);
+void table_add_all(VM* vm, Table* from, Table* to);
 
 ObjString* table_find_string(Table* table, const char* chars, int length, uint32_t hash);
 
 void table_remove_white(Table* table);
-void mark_table(Table* table);
+void mark_table(VM* vm, Table* table);
 
 #endif // !pikey_table_h
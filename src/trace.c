@@ -0,0 +1,185 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "object.h"
+#include "trace.h"
+#include "vm.h"
+
+#define TRACE_MAGIC "PIKEYTRC"
+#define TRACE_VERSION 1
+
+// The trace was recorded from a run that called a nondeterministic native.
+#define TRACE_NONDETERMINISTIC (1 << 0)
+
+// Each event is its kind byte followed by, for text, a uint32_t length and
+// the characters, and for a wait, its length in milliseconds as a double.
+typedef enum {
+	EVENT_TEXT,
+	EVENT_WAIT,
+} EventKind;
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+	uint32_t event_count;
+} TraceHeader;
+
+void init_trace(Trace* trace) {
+	trace->events = open_memstream(&trace->events_buffer, &trace->events_size);
+	trace->text = open_memstream(&trace->text_buffer, &trace->text_size);
+	if ( trace->events == NULL || trace->text == NULL ) exit(1);
+
+	trace->wait = 0;
+	trace->event_count = 0;
+	trace->input_count = 0;
+	trace->nondeterministic = false;
+}
+
+void free_trace(Trace* trace) {
+	fclose(trace->events);
+	fclose(trace->text);
+	free(trace->events_buffer);
+	free(trace->text_buffer);
+}
+
+static void flush_text(Trace* trace) {
+	fflush(trace->text);
+	if ( trace->text_size == 0 ) return;
+
+	uint8_t kind = EVENT_TEXT;
+	uint32_t length = (uint32_t)trace->text_size;
+	fwrite(&kind, sizeof(kind), 1, trace->events);
+	fwrite(&length, sizeof(length), 1, trace->events);
+	fwrite(trace->text_buffer, 1, length, trace->events);
+	trace->event_count++;
+
+	rewind(trace->text);
+	fflush(trace->text);
+}
+
+static void flush_wait(Trace* trace) {
+	if ( trace->wait <= 0 ) return;
+
+	uint8_t kind = EVENT_WAIT;
+	fwrite(&kind, sizeof(kind), 1, trace->events);
+	fwrite(&trace->wait, sizeof(trace->wait), 1, trace->events);
+	trace->event_count++;
+
+	trace->wait = 0;
+}
+
+void trace_type(Trace* trace, Value value) {
+	flush_wait(trace);
+	print_value(trace->text, value);
+	fputc('\n', trace->text);
+}
+
+// Back to back waits are recorded as one.
+void trace_wait(Trace* trace, double millis) {
+	flush_text(trace);
+	if ( millis > 0 ) trace->wait += millis;
+}
+
+void trace_input(VM* vm, const NativeDef* native) {
+	Trace* trace = vm->trace;
+	trace->nondeterministic = true;
+
+	for ( int i=0; i < trace->input_count; i++ ) {
+		if ( trace->inputs[i] == native ) return;
+	}
+	if ( trace->input_count < TRACE_INPUTS_MAX ) trace->inputs[trace->input_count++] = native;
+
+	CallFrame* frame = &vm->frames[vm->frame_count - 1];
+	ObjFunction* function = frame->closure->function;
+	size_t instruction = frame->ip - function->chunk.code - 1;
+	fprintf(vm->err, "[line %d] Warning: %s() makes the trace differ from run to run.\n",
+		function->chunk.lines[instruction], native->name);
+}
+
+bool save_trace(Trace* trace, const char* path) {
+	flush_text(trace);
+	flush_wait(trace);
+	fflush(trace->events);
+
+	TraceHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.version = TRACE_VERSION;
+	header.flags = trace->nondeterministic ? TRACE_NONDETERMINISTIC : 0;
+	header.event_count = trace->event_count;
+
+	FILE* file = fopen(path, "wb");
+	bool written = file != NULL &&
+		fwrite(&header, sizeof(header), 1, file) == 1 &&
+		fwrite(trace->events_buffer, 1, trace->events_size, file) == trace->events_size;
+	if ( file != NULL && fclose(file) != 0 ) written = false;
+
+	if ( !written ) fprintf(stderr, "Could not write trace \"%s\".\n", path);
+	return written;
+}
+
+static void sleep_millis(double millis) {
+	struct timespec ts;
+	ts.tv_sec = (time_t)(millis / 1000);
+	ts.tv_nsec = (long)((millis - ts.tv_sec * 1000.0) * 1000000);
+	while ( nanosleep(&ts, &ts) != 0 );
+}
+
+bool play_trace(const char* path, FILE* out) {
+	FILE* file = fopen(path, "rb");
+	if ( file == NULL ) {
+		fprintf(stderr, "Could not open trace \"%s\".\n", path);
+		return false;
+	}
+
+	fseek(file, 0L, SEEK_END);
+	long size = ftell(file);
+	rewind(file);
+
+	char* buffer = size < (long)sizeof(TraceHeader) ? NULL : (char*)malloc(size);
+	bool read = buffer != NULL && fread(buffer, 1, size, file) == (size_t)size;
+	fclose(file);
+
+	TraceHeader header;
+	if ( read ) memcpy(&header, buffer, sizeof(header));
+
+	if ( !read || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+			header.version != TRACE_VERSION ) {
+		fprintf(stderr, "\"%s\" is not a trace.\n", path);
+		free(buffer);
+		return false;
+	}
+
+	char* event = buffer + sizeof(header);
+	char* end = buffer + size;
+
+	for ( uint32_t i=0; i < header.event_count; i++ ) {
+		if ( event == end ) break;
+
+		uint8_t kind = (uint8_t)*event++;
+		if ( kind == EVENT_TEXT && end - event >= (long)sizeof(uint32_t) ) {
+			uint32_t length;
+			memcpy(&length, event, sizeof(length));
+			event += sizeof(length);
+			if ( (size_t)(end - event) < length ) break;
+
+			fwrite(event, 1, length, out);
+			event += length;
+		} else if ( kind == EVENT_WAIT && end - event >= (long)sizeof(double) ) {
+			double millis;
+			memcpy(&millis, event, sizeof(millis));
+			event += sizeof(millis);
+
+			fflush(out);
+			sleep_millis(millis);
+		} else {
+			break;
+		}
+	}
+
+	fflush(out);
+	free(buffer);
+	return true;
+}
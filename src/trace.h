@@ -0,0 +1,54 @@
+#ifndef pikey_trace_h
+#define pikey_trace_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "natives.h"
+#include "value.h"
+
+#define TRACE_INPUTS_MAX 16
+
+// What a script types and how long it waits in between, recorded by running
+// it with those effects captured instead of carried out. Typed text is
+// gathered until the next wait, so a trace is just alternating runs of text
+// and pauses, and playing it back needs no VM at all.
+//
+// A script whose output depends on the clock or the random number generator
+// records only the run it happened to make, and its trace is marked as such.
+typedef struct {
+	// The events recorded so far, and the text typed since the last wait.
+	FILE* events;
+	char* events_buffer;
+	size_t events_size;
+	FILE* text;
+	char* text_buffer;
+	size_t text_size;
+
+	double wait;
+	uint32_t event_count;
+
+	// The nondeterministic natives the script called, each reported once.
+	const NativeDef* inputs[TRACE_INPUTS_MAX];
+	int input_count;
+	bool nondeterministic;
+} Trace;
+
+void init_trace(Trace* trace);
+void free_trace(Trace* trace);
+
+void trace_type(Trace* trace, Value value);
+void trace_wait(Trace* trace, double millis);
+
+// Called before a nondeterministic native runs while recording. Warns about
+// it, with the line of the call, the first time each native is seen.
+void trace_input(VM* vm, const NativeDef* native);
+
+// Writes everything recorded to `path`.
+bool save_trace(Trace* trace, const char* path);
+
+// Types the text of the trace at `path` to `out` and sleeps through its
+// waits. Returns false if it can't be read.
+bool play_trace(const char* path, FILE* out);
+
+#endif // !pikey_trace_h
@@ -1,3 +1,4 @@
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -11,57 +12,172 @@ void init_value_array(ValueArray *array) {
 	array->count = 0;
 }
 
-void write_value_array(ValueArray *array, Value value) {
+void write_value_array(VM* vm, ValueArray *array, Value value) {
 	if ( array->capacity < array->count + 1 ) {
 		int old_capacity = array->capacity;
 		array->capacity = GROW_CAPACITY(old_capacity);
-		array->values = GROW_ARRAY(Value, array->values, old_capacity, array->capacity);
+		array->values = GROW_ARRAY(vm, Value, array->values, old_capacity, array->capacity);
 	}
 
 	array->values[array->count] = value;
 	array->count++;
 }
 
-void free_value_array(ValueArray *array) {
-	FREE_ARRAY(Value, array->values, array->capacity);
+void free_value_array(VM* vm, ValueArray *array) {
+	FREE_ARRAY(vm, Value, array->values, array->capacity);
 	init_value_array(array);
 }
 
-void print_value(Value value) {
-#ifdef NAN_BOXING
+#ifdef COMPACT_VALUES
+
+// A finite number as a count of thousandths.
+static int64_t to_fixed(Value value) {
+	return IS_INT(value) ? (int64_t)AS_INT(value) * FIXED_SCALE : AS_FIXED(value);
+}
+
+static Value from_fixed(VM* vm, int64_t fixed) {
+	if ( fixed % FIXED_SCALE == 0 ) return int_to_value(vm, fixed / FIXED_SCALE);
+	if ( fixed >= FIXED_MIN && fixed <= FIXED_MAX ) return FIXED_VAL(fixed);
+	return box_number(vm, (double)fixed / FIXED_SCALE);
+}
+
+double compact_to_double(Value value) {
+	if ( IS_INT(value) ) return AS_INT(value);
+	if ( IS_FIXED(value) ) return (double)AS_FIXED(value) / FIXED_SCALE;
+	return ((ObjNumber*)AS_BOXED(value))->value;
+}
+
+Value compact_from_double(VM* vm, double number) {
+	if ( number >= SMALL_INT_MIN && number <= SMALL_INT_MAX && number == (int32_t)number ) {
+		return INT_VAL((int32_t)number);
+	}
+
+	double fixed = number * FIXED_SCALE;
+	if ( fixed >= FIXED_MIN && fixed <= FIXED_MAX && fixed == (int32_t)fixed ) {
+		return FIXED_VAL((int32_t)fixed);
+	}
+
+	return box_number(vm, number);
+}
+
+// Fixed point stays fixed point while the result is exact, so a product or
+// quotient with more than three decimals is boxed rather than rounded. Boxed
+// operands, and dividing by zero, are rare enough to be done on doubles.
+Value compact_arithmetic(VM* vm, char op, Value a, Value b) {
+	if ( IS_BOXED(a) || IS_BOXED(b) || (op == '/' && to_fixed(b) == 0) ) {
+		double x = compact_to_double(a);
+		double y = compact_to_double(b);
+
+		switch ( op ) {
+			case '+': return compact_from_double(vm, x + y);
+			case '-': return compact_from_double(vm, x - y);
+			case '*': return compact_from_double(vm, x * y);
+			default:  return compact_from_double(vm, x / y);
+		}
+	}
+
+	int64_t x = to_fixed(a);
+	int64_t y = to_fixed(b);
+
+	switch ( op ) {
+		case '+': return from_fixed(vm, x + y);
+		case '-': return from_fixed(vm, x - y);
+		case '*': {
+			int64_t product;
+			if ( !__builtin_mul_overflow(x, y, &product) && product % FIXED_SCALE == 0 ) {
+				return from_fixed(vm, product / FIXED_SCALE);
+			}
+			return compact_from_double(vm, (double)x * y / ((double)FIXED_SCALE * FIXED_SCALE));
+		}
+		default:
+			if ( x * FIXED_SCALE % y == 0 ) return from_fixed(vm, x * FIXED_SCALE / y);
+			return compact_from_double(vm, (double)x / y);
+	}
+}
+
+// Prints the thousandths without trailing zeros, the way %g would.
+static void print_fixed(FILE* out, Value value) {
+	int32_t fixed = AS_FIXED(value);
+	uint32_t magnitude = fixed < 0 ? -(uint32_t)fixed : (uint32_t)fixed;
+
+	char fraction[4];
+	snprintf(fraction, sizeof(fraction), "%03u", (unsigned)(magnitude % FIXED_SCALE));
+	for ( int i=2; i > 0 && fraction[i] == '0'; i-- ) fraction[i] = '\0';
+
+	fprintf(out, "%s%u.%s", fixed < 0 ? "-" : "", (unsigned)(magnitude / FIXED_SCALE), fraction);
+}
+
+#endif
+
+void print_value(FILE* out, Value value) {
+#if defined(COMPACT_VALUES)
+
+	if ( IS_BOOL(value) ) {
+		fprintf(out, AS_BOOL(value) ? "true" : "false");
+	} else if ( IS_NULL(value) ) {
+		fprintf(out, "null");
+	} else if ( IS_INT(value) ) {
+		fprintf(out, "%d", AS_INT(value));
+	} else if ( IS_FIXED(value) ) {
+		print_fixed(out, value);
+	} else if ( IS_NUMBER(value) ) {
+		// Boxed whole numbers that fit in an int32_t print as ints, the way
+		// they do with NaN boxing.
+		int32_t integer;
+		if ( number_to_int(value, &integer) ) {
+			fprintf(out, "%d", integer);
+		} else {
+			fprintf(out, "%g", AS_NUMBER(value));
+		}
+	} else if ( IS_OBJ(value) ) {
+		print_object(out, value);
+	}
+
+#elif defined(NAN_BOXING)
 
 	if ( IS_BOOL(value) ) {
-		printf(AS_BOOL(value) ? "true" : "false");
+		fprintf(out, AS_BOOL(value) ? "true" : "false");
 	} else if ( IS_NULL(value) ) {
-		printf("null");
+		fprintf(out, "null");
+	} else if ( IS_INT(value) ) {
+		fprintf(out, "%d", AS_INT(value));
 	} else if ( IS_NUMBER(value) ) {
-		printf("%g", AS_NUMBER(value));
+		fprintf(out, "%g", AS_NUMBER(value));
 	} else if ( IS_OBJ(value) ) {
-		print_object(value);
+		print_object(out, value);
 	}
 
 #else
 
 	switch ( value.type ) {
 		case VAL_BOOL:
-			printf(AS_BOOL(value) ? "true" : "false");
+			fprintf(out, AS_BOOL(value) ? "true" : "false");
 			break;
-		case VAL_NULL: printf("null"); break;
-		case VAL_NUMBER: printf("%g", AS_NUMBER(value));
-		case VAL_OBJ: return print_object(value); break;
+		case VAL_NULL: fprintf(out, "null"); break;
+		case VAL_NUMBER: fprintf(out, "%g", AS_NUMBER(value));
+		case VAL_OBJ: return print_object(out, value); break;
 	}
 
 #endif
 }
 
 bool values_equal(Value a, Value b) {
-#ifdef NAN_BOXING
+#if defined(COMPACT_VALUES)
+
+	// Each number has just the one encoding, but two boxes can hold the same
+	// double, and a box can hold nan.
+	if ( IS_BOXED(a) && IS_BOXED(b) ) return AS_NUMBER(a) == AS_NUMBER(b);
+	if ( a == b ) return true;
+	return IS_STRING(a) && IS_STRING(b) && strings_equal(AS_STRING(a), AS_STRING(b));
+
+#elif defined(NAN_BOXING)
 
 	if ( IS_NUMBER(a) && IS_NUMBER(b) ) {
 		return AS_NUMBER(a) == AS_NUMBER(b);
 	}
 
-	return a == b;
+	if ( a == b ) return true;
+	return IS_STRING(a) && IS_STRING(b) && strings_equal(AS_STRING(a), AS_STRING(b));
 
 #else
 
@@ -70,7 +186,9 @@ bool values_equal(Value a, Value b) {
 		case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
 		case VAL_NULL:   return true;
 		case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-		case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b);
+		case VAL_OBJ:
+			if ( AS_OBJ(a) == AS_OBJ(b) ) return true;
+			return IS_STRING(a) && IS_STRING(b) && strings_equal(AS_STRING(a), AS_STRING(b));
 		default:         return false;
 	}
 
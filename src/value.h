@@ -1,6 +1,7 @@
 #ifndef pikey_value_h
 #define pikey_value_h
 
+#include <stdio.h>
 #include <string.h>
 
 #include "common.h"
@@ -8,7 +9,88 @@
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
 
-#ifdef NAN_BOXING
+#if defined(COMPACT_VALUES)
+
+// A Value is one machine word, tagged in its low three bits, so on a 32-bit
+// board it takes 4 bytes instead of 8. Objects are at least 8 byte aligned
+// and stored as they are. Ints are 31 bits over a set low bit, and a number
+// that is a whole count of thousandths is fixed point, the count in the upper
+// 29 bits, so arithmetic on them needs no floating point. Any other number,
+// nan and inf among them, is a double boxed on the heap, with its own tag so
+// that telling numbers apart from objects stays a test of the bits. Those,
+// and products or quotients that aren't exact in thousandths, are worked out
+// on doubles.
+//
+//   ...xx1  int
+//   ...000  object
+//   ...010  null, false and true
+//   ...100  fixed point
+//   ...110  boxed double
+//
+// Each number has just the one encoding: an int if it is whole and fits,
+// otherwise fixed point if it fits, and only otherwise boxed. There is only
+// the one zero, so a result doubles would make -0, such as 0 * -5, is 0.
+// On a 64-bit host the word is wider, but ints and fixed point are kept to
+// the same ranges, so a script runs the same there as on the board.
+
+#define TAG_MASK    7
+#define TAG_SPECIAL 2
+#define TAG_FIXED   4
+#define TAG_BOXED   6
+
+#define SMALL_INT_MIN (-(1 << 30))
+#define SMALL_INT_MAX ((1 << 30) - 1)
+#define FIXED_SCALE   1000
+#define FIXED_MIN     (-(1 << 28))
+#define FIXED_MAX     ((1 << 28) - 1)
+
+typedef uintptr_t Value;
+
+#define IS_BOOL(value)   (((value) | 8) == TRUE_VAL)
+#define IS_NULL(value)   ((value) == NULL_VAL)
+#define IS_INT(value)    (((value) & 1) != 0)
+#define IS_FIXED(value)  (((value) & TAG_MASK) == TAG_FIXED)
+#define IS_BOXED(value)  (((value) & TAG_MASK) == TAG_BOXED)
+#define IS_NUMBER(value) (((value) & 5) != 0)
+#define IS_DOUBLE(value) (IS_NUMBER(value) && !IS_INT(value))
+#define IS_OBJ(value)    (((value) & TAG_MASK) == 0)
+
+#define AS_BOOL(value)   ((value) == TRUE_VAL)
+#define AS_INT(value)    ((int32_t)(uint32_t)(value) >> 1)
+#define AS_FIXED(value)  ((int32_t)(uint32_t)(value) >> 3)
+#define AS_BOXED(value)  ((Obj*)((value) - TAG_BOXED))
+#define AS_NUMBER(value) compact_to_double(value)
+#define AS_DOUBLE(value) compact_to_double(value)
+#define AS_OBJ(value)    ((Obj*)(value))
+
+#define BOOL_VAL(b)      ((b) ? TRUE_VAL : FALSE_VAL)
+#define NULL_VAL         ((Value)(1 << 3 | TAG_SPECIAL))
+#define FALSE_VAL        ((Value)(2 << 3 | TAG_SPECIAL))
+#define TRUE_VAL         ((Value)(3 << 3 | TAG_SPECIAL))
+#define INT_VAL(i)       ((Value)(intptr_t)(int32_t)((uint32_t)(i) << 1 | 1))
+#define INT32_VAL(vm, i) int_to_value(vm, i)
+#define FIXED_VAL(f)     ((Value)(intptr_t)(int32_t)((uint32_t)(f) << 3 | TAG_FIXED))
+#define BOXED_VAL(obj)   ((Value)(uintptr_t)(obj) | TAG_BOXED)
+#define NUMBER_VAL(vm, num) compact_from_double(vm, num)
+#define OBJ_VAL(obj)     ((Value)(uintptr_t)(obj))
+
+// Boxes a number with no immediate encoding, see object.c.
+Value box_number(VM* vm, double number);
+
+static inline Value int_to_value(VM* vm, int64_t i) {
+	if ( i >= SMALL_INT_MIN && i <= SMALL_INT_MAX ) return INT_VAL(i);
+	return box_number(vm, (double)i);
+}
+
+// Going through doubles is left to natives, printing and the compiler.
+double compact_to_double(Value value);
+Value compact_from_double(VM* vm, double number);
+
+// The cases the inline helpers below leave out: fixed point, boxed operands,
+// and quotients that aren't whole.
+Value compact_arithmetic(VM* vm, char op, Value a, Value b);
+
+#elif defined(NAN_BOXING)
 
 #define SIGN_BIT ((uint64_t)0x8000000000000000)
 #define QNAN     ((uint64_t)0x7ffc000000000000)
@@ -17,30 +99,47 @@ typedef struct ObjString ObjString;
 #define TAG_FALSE 2
 #define TAG_TRUE  3
 
+// Numbers that fit in an int32_t are boxed apart from doubles, as a quiet NaN
+// with bit 48 set and the int in the low 32 bits. Either kind is a number,
+// and AS_NUMBER() reads both as a double.
+#define INT_TAG  ((uint64_t)0x7ffd000000000000)
+
 typedef uint64_t Value;
 
 #define IS_BOOL(value)   (((value) | 1) == TRUE_VAL)
 #define IS_NULL(value)   ((value) == NULL_VAL)
-#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+#define IS_INT(value)    (((value) >> 32) == (INT_TAG >> 32))
+#define IS_DOUBLE(value) (((value) & QNAN) != QNAN)
+#define IS_NUMBER(value) (IS_DOUBLE(value) || IS_INT(value))
 #define IS_OBJ(value)    (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
 
 #define AS_BOOL(value)   ((value) == TRUE_VAL)
+#define AS_INT(value)    ((int32_t)(uint32_t)(value))
 #define AS_NUMBER(value) value_to_num(value)
+#define AS_DOUBLE(value) value_to_double(value)
 #define AS_OBJ(value)    ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
 
 #define BOOL_VAL(b)      ((b) ? TRUE_VAL : FALSE_VAL)
 #define FALSE_VAL        ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL         ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define NULL_VAL         ((Value)(uint64_t)(QNAN | TAG_NULL))
-#define NUMBER_VAL(num)  num_to_value(num)
+#define INT_VAL(i)       ((Value)(INT_TAG | (uint32_t)(int32_t)(i)))
+#define INT32_VAL(vm, i) INT_VAL(i)
+#define NUMBER_VAL(vm, num) num_to_value(num)
 #define OBJ_VAL(obj)     (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
 
-static inline double value_to_num(Value value) {
+// Reads a value known to be a double, not an int.
+static inline double value_to_double(Value value) {
 	double num;
 	memcpy(&num, &value, sizeof(Value));
 	return num;
 }
 
+static inline double value_to_num(Value value) {
+	if ( IS_INT(value) ) return AS_INT(value);
+	return value_to_double(value);
+}
+
 static inline Value num_to_value(double num) {
 	Value value;
 	memcpy(&value, &num, sizeof(double));
@@ -70,17 +169,156 @@ typedef struct {
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
 #define IS_OBJ(value)    ((value).type == VAL_OBJ)
 
+// Without NaN boxing every number is a double.
+#define IS_INT(value)    false
+#define IS_DOUBLE(value) IS_NUMBER(value)
+
 #define AS_OBJ(value)    ((value).as.obj)
 #define AS_BOOL(value)   ((value).as.boolean)
 #define AS_NUMBER(value) ((value).as.number)
+#define AS_DOUBLE(value) ((value).as.number)
+#define AS_INT(value)    ((int32_t)(value).as.number)
 
 #define BOOL_VAL(value)   ((Value){VAL_BOOL, {.boolean = value}})
 #define NULL_VAL          ((Value){VAL_NULL, {.number = 0}})
-#define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
+#define NUMBER_VAL(vm, value) ((Value){VAL_NUMBER, {.number = value}})
+#define INT_VAL(value)        NUMBER_VAL(NULL, (double)(value))
+#define INT32_VAL(vm, value)  INT_VAL(value)
 #define OBJ_VAL(object)   ((Value){VAL_OBJ, {.obj = (Obj*)object}})
 
 #endif
 
+#ifdef COMPACT_VALUES
+
+// The helpers take the VM for the numbers they have to box. Two ints can't
+// overflow an int64_t, and the result is boxed when it doesn't fit back in
+// an int.
+static inline Value add_numbers(VM* vm, Value a, Value b) {
+	if ( IS_INT(a) && IS_INT(b) ) return int_to_value(vm, (int64_t)AS_INT(a) + AS_INT(b));
+	return compact_arithmetic(vm, '+', a, b);
+}
+
+static inline Value subtract_numbers(VM* vm, Value a, Value b) {
+	if ( IS_INT(a) && IS_INT(b) ) return int_to_value(vm, (int64_t)AS_INT(a) - AS_INT(b));
+	return compact_arithmetic(vm, '-', a, b);
+}
+
+// No -0 check, unlike the helper with NaN boxing, see the top of the file.
+static inline Value multiply_numbers(VM* vm, Value a, Value b) {
+	if ( IS_INT(a) && IS_INT(b) ) return int_to_value(vm, (int64_t)AS_INT(a) * AS_INT(b));
+	return compact_arithmetic(vm, '*', a, b);
+}
+
+static inline Value divide_numbers(VM* vm, Value a, Value b) {
+	if ( IS_INT(a) && IS_INT(b) && AS_INT(b) != 0 && AS_INT(a) % AS_INT(b) == 0 ) {
+		return int_to_value(vm, (int64_t)AS_INT(a) / AS_INT(b));
+	}
+
+	return compact_arithmetic(vm, '/', a, b);
+}
+
+static inline Value negate_number(VM* vm, Value value) {
+	if ( IS_INT(value) ) return int_to_value(vm, -(int64_t)AS_INT(value));
+	return compact_arithmetic(vm, '-', INT_VAL(0), value);
+}
+
+// Whole numbers are ints unless they are too big for one, and then they are
+// boxed. Fixed point always has a fractional part.
+static inline bool number_to_int(Value value, int32_t* result) {
+	if ( IS_INT(value) ) {
+		*result = AS_INT(value);
+		return true;
+	}
+
+	if ( !IS_BOXED(value) ) return false;
+
+	double number = AS_NUMBER(value);
+	if ( !(number >= INT32_MIN && number <= INT32_MAX) || number != (int32_t)number ) return false;
+
+	*result = (int32_t)number;
+	return true;
+}
+
+#else
+
+// Arithmetic keeps two ints an int as long as the result fits in one, and
+// isn't a zero that doubles would have made -0. Two doubles are tested for
+// first, as the most common case, so they never pay for the int checks.
+static inline Value add_numbers(VM* vm, Value a, Value b) {
+	if ( IS_DOUBLE(a) && IS_DOUBLE(b) ) return NUMBER_VAL(vm, AS_DOUBLE(a) + AS_DOUBLE(b));
+
+	int32_t result;
+	if ( IS_INT(a) && IS_INT(b) && !__builtin_add_overflow(AS_INT(a), AS_INT(b), &result) ) {
+		return INT_VAL(result);
+	}
+
+	return NUMBER_VAL(vm, AS_NUMBER(a) + AS_NUMBER(b));
+}
+
+static inline Value subtract_numbers(VM* vm, Value a, Value b) {
+	if ( IS_DOUBLE(a) && IS_DOUBLE(b) ) return NUMBER_VAL(vm, AS_DOUBLE(a) - AS_DOUBLE(b));
+
+	int32_t result;
+	if ( IS_INT(a) && IS_INT(b) && !__builtin_sub_overflow(AS_INT(a), AS_INT(b), &result) ) {
+		return INT_VAL(result);
+	}
+
+	return NUMBER_VAL(vm, AS_NUMBER(a) - AS_NUMBER(b));
+}
+
+static inline Value multiply_numbers(VM* vm, Value a, Value b) {
+	if ( IS_DOUBLE(a) && IS_DOUBLE(b) ) return NUMBER_VAL(vm, AS_DOUBLE(a) * AS_DOUBLE(b));
+
+	int32_t result;
+	if ( IS_INT(a) && IS_INT(b) && !__builtin_mul_overflow(AS_INT(a), AS_INT(b), &result) &&
+			(result != 0 || (AS_INT(a) >= 0 && AS_INT(b) >= 0)) ) {
+		return INT_VAL(result);
+	}
+
+	return NUMBER_VAL(vm, AS_NUMBER(a) * AS_NUMBER(b));
+}
+
+// Only exact quotients stay ints.
+static inline Value divide_numbers(VM* vm, Value a, Value b) {
+	if ( IS_DOUBLE(a) && IS_DOUBLE(b) ) return NUMBER_VAL(vm, AS_DOUBLE(a) / AS_DOUBLE(b));
+
+	if ( IS_INT(a) && IS_INT(b) ) {
+		int32_t x = AS_INT(a);
+		int32_t y = AS_INT(b);
+
+		if ( y > 0 || (y < 0 && x != 0 && x != INT32_MIN) ) {
+			if ( x % y == 0 ) return INT_VAL(x / y);
+		}
+	}
+
+	return NUMBER_VAL(vm, AS_NUMBER(a) / AS_NUMBER(b));
+}
+
+static inline Value negate_number(VM* vm, Value value) {
+	if ( IS_INT(value) && AS_INT(value) != 0 && AS_INT(value) != INT32_MIN ) {
+		return INT_VAL(-AS_INT(value));
+	}
+
+	return NUMBER_VAL(vm, -AS_NUMBER(value));
+}
+
+// Reads a number without a fractional part, as modulo and the bitwise
+// operators need.
+static inline bool number_to_int(Value value, int32_t* result) {
+	if ( IS_INT(value) ) {
+		*result = AS_INT(value);
+		return true;
+	}
+
+	double number = AS_NUMBER(value);
+	if ( !(number >= INT32_MIN && number <= INT32_MAX) || number != (int32_t)number ) return false;
+
+	*result = (int32_t)number;
+	return true;
+}
+
+#endif
+
 typedef struct {
 	int capacity;
 	int count;
@@ -91,10 +329,10 @@ bool values_equal(Value a, Value b);
 
 void init_value_array(ValueArray* array);
 
-void write_value_array(ValueArray* array, Value value);
+void write_value_array(VM* vm, ValueArray* array, Value value);
 
-void free_value_array(ValueArray* array);
+void free_value_array(VM* vm, ValueArray* array);
 
-void print_value(Value value);
+void print_value(FILE* out, Value value);
 
 #endif // !pikey_value_h
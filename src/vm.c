@@ -5,336 +5,337 @@
 #include <string.h>
 #include <time.h>
 #include <math.h>
-#include <ctype.h>
 
 #include "chunk.h"
 #include "compiler.h"
+#include "image.h"
+#include "jit.h"
 #include "object.h"
 #include "memory.h"
+#include "natives.h"
+#include "runtime.h"
 #include "value.h"
 #include "vm.h"
 
-VM vm;
-
-static void runtime_error(const char* format, ...);
+#ifdef DEBUG_TRACE_EXECUTION
+#include "debug.h"
+#endif
 
-static Value clock_native(int arg_count, Value* args) {
-	return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
-}
+#define TRACE_FRAMES_MAX 16
+#define GC_HEAP_INITIAL (1024 * 1024)
 
-static Value lower_native(int arg_count, Value* args) {
-	if ( arg_count != 1 ) {
-		runtime_error("The lower function takes exactly one argument.");
-		return INTERPRET_RUNTIME_ERROR;
+static bool wait_millis(VM* vm, Value time_val) {
+	if ( !IS_NUMBER(time_val) ) {
+		runtime_error(vm, "Wait requires a number representing the wait time in milliseconds.");
+		return false;
 	}
 
-	if ( !IS_STRING(args[0]) ) {
-		runtime_error("The lower function takes a string as an argument.");
-		return INTERPRET_RUNTIME_ERROR;
+	if ( vm->trace != NULL ) {
+		trace_wait(vm->trace, AS_NUMBER(time_val));
+		return true;
 	}
 
-	char* string = AS_CSTRING(args[0]);
-
-	for ( int i=0; string[i]; i++) {
-		string[i] = tolower(string[i]);
-	}
-	return OBJ_VAL(copy_string(string, strlen(string)));
+	double target_time = AS_NUMBER(time_val) / 1000.0;
+	
+	time_t start, end;
+	time(&start);
+	do time(&end); while(difftime(end, start) <= target_time);
+	
+	return true;
 }
 
-static Value upper_native(int arg_count, Value* args) {
-	if ( arg_count != 1 ) {
-		runtime_error("The upper function takes exactly one argument.");
-		return INTERPRET_RUNTIME_ERROR;
-	}
-
-	if ( !IS_STRING(args[0]) ) {
-		runtime_error("The upper function takes a string as an argument.");
-		return INTERPRET_RUNTIME_ERROR;
+static void type_value(VM* vm, Value value) {
+	if ( vm->trace != NULL ) {
+		trace_type(vm->trace, value);
+		return;
 	}
 
-	char* string = AS_CSTRING(args[0]);
-
-	for ( int i=0; string[i]; i++) {
-		string[i] = toupper(string[i]);
-	}
-	return OBJ_VAL(copy_string(string, strlen(string)));
+	print_value(vm->out, value);
+	fputc('\n', vm->out);
 }
 
-static double rand_num_gen(double min, double max) {
-	return min + (rand() / (double)(RAND_MAX) * (max - min));
+static void reset_stack(VM* vm) {
+	vm->stack_top = vm->stack;
+	vm->frame_count = 0;
+	vm->open_upvalues = NULL;
 }
 
-static Value rand_native(int arg_count, Value* args) {
-	double min, max;
-	if ( arg_count != 2 ) {
-		min = 0;
-		max = 1;
-	} else {
-		if ( !IS_NUMBER(args[0]) || !IS_NUMBER(args[1]) ) {
-			runtime_error("The minimum and maximum for rand_num must be numbers.");
-			return INTERPRET_RUNTIME_ERROR;
+void runtime_error(VM* vm, const char* format, ...) {
+	va_list args;
+	va_start(args, format);
+	vfprintf(vm->err, format, args);
+	va_end(args);
+	fputs("\n", vm->err);
+
+	for ( int i=vm->frame_count - 1; i >= 0; i-- ) {
+		// Deep recursion only shows the innermost and outermost frames.
+		if ( i == vm->frame_count - 1 - TRACE_FRAMES_MAX && i >= TRACE_FRAMES_MAX ) {
+			fprintf(vm->err, "[... %d more frames]\n", i - TRACE_FRAMES_MAX + 1);
+			i = TRACE_FRAMES_MAX;
+			continue;
 		}
 
-		min = AS_NUMBER(args[0]);
-		max = AS_NUMBER(args[1]);
-	}
-
-	double rand_num = rand_num_gen(min, max);
-	return NUMBER_VAL(rand_num);
-}
+		CallFrame* frame = &vm->frames[i];
+		ObjFunction* function = frame->closure->function;
+		size_t instruction = frame->ip - function->chunk.code - 1;
+		fprintf(vm->err, "[line %d] in ", function->chunk.lines[instruction]);
 
-static Value rand_int_native(int arg_count, Value* args) {
-	int min, max;
-	if ( arg_count != 2 ) {
-		min = 0;
-		max = 1;
-	} else {
-		if ( !IS_NUMBER(args[0]) || !IS_NUMBER(args[1]) ) {
-			runtime_error("The minimum and maximum for rand_num must be numbers.");
-			return INTERPRET_RUNTIME_ERROR;
+		if ( function->name == NULL ) {
+			fprintf(vm->err, "script\n");
+		} else {
+			fprintf(vm->err, "%s()\n", function->name->chars);
 		}
-
-		min = (int)AS_NUMBER(args[0]);
-		max = (int)AS_NUMBER(args[1]);
 	}
 
-	int rand_num = (int)rand_num_gen(min, max + 1);
-	return NUMBER_VAL(rand_num);
+	reset_stack(vm);
 }
 
-static Value rand_digit_native(int arg_count, Value* args) {
-	int rand_num = (int)(rand_num_gen(0, 9) + 1);
-	char digit = '0' + rand_num;
-	return OBJ_VAL(copy_string(&digit, 1));
-}
+void define_native(VM* vm, const NativeDef* native) {
+	ObjString* name = copy_string(vm, native->name, (int)strlen(native->name));
+	push(vm, OBJ_VAL(name));
+	push(vm, OBJ_VAL(new_native(vm, native)));
 
-static Value rand_let_native(int arg_count, Value* args) {
-	int rand_num = (int)(rand_num_gen(0, 25) + 1);
-	char* alpha = "abcdefghijklmnopqrstuvwxyz";
-	return OBJ_VAL(copy_string(&alpha[rand_num], 1));
-}
+	// A host native can take the name of a builtin, like any other global.
+	int builtin = find_native(name->chars, name->length);
+	if ( builtin != -1 && &natives[builtin] == native ) {
+		name->builtin = true;
+	} else {
+		note_global_write(vm, name);
+	}
 
-static Value rand_spcc_native(int arg_count, Value* args) {
-	int rand_num = (int)(rand_num_gen(0, 9) + 1);
-	char* spcc = "!@#$%^&*()";
-	return OBJ_VAL(copy_string(&spcc[rand_num], 1));
-}
+	table_set(vm, &vm->globals, AS_STRING(vm->stack[0]), vm->stack[1]);
 
-static Value rand_char_native(int arg_count, Value* args) {
-	int rand_num = (int)(rand_num_gen(0, 45) + 1);
-	char* chars = "abcdefghijklmnopqrstuvwxyz0123456789!@#$%^&*()";
-	return OBJ_VAL(copy_string(&chars[rand_num], 1));
+	pop(vm);
+	pop(vm);
 }
 
-static Value slice_native(int arg_count, Value* args) {
-	int length;
-	if ( arg_count == 2 ) {
-		length = 1;
-	} else if ( arg_count == 3 ) {
-		if ( !IS_NUMBER(args[2]) ) {
-			runtime_error("The slice function takes the following arguments: str(string), start(int), length(int - optional).");
-			return INTERPRET_RUNTIME_ERROR;
-		}
-		length = AS_NUMBER(args[2]);
-	} else {
-		runtime_error("The slice function takes the following arguments: str(string), start(int), length(int - optional).");
-		return INTERPRET_RUNTIME_ERROR;
-	}
-
-	if ( !IS_NUMBER(args[1]) ) {
-		runtime_error("The slice function takes the following arguments: str(string), start(int), length(int - optional).");
-		return INTERPRET_RUNTIME_ERROR;
-	}
-	int start = AS_NUMBER(args[1]);
+void shadow_native(VM* vm, ObjString* name) {
+	int native = find_native(name->chars, name->length);
+	if ( native != -1 ) vm->shadowed_natives[native] = true;
+}
 
-	if ( !IS_STRING(args[0]) ) {
-		runtime_error("The slice function takes the following arguments: str(string), start(int), length(int - optional).");
-		return INTERPRET_RUNTIME_ERROR;
-	}
-	char* string = AS_CSTRING(args[0]);
+// Works out which builtins have had their names given another value, for
+// globals that were put back wholesale rather than written one at a time.
+static void find_shadowed_natives(VM* vm) {
+	for ( int i=0; i < native_count; i++ ) {
+		ObjString* name = copy_string(vm, natives[i].name, (int)strlen(natives[i].name));
+		Value value;
 
-	char* string_slice;
-	if ( start > 0 && start + length <= strlen(string) ) {
-		string_slice = malloc(sizeof(char) * (length + 1));
-		strncpy(string_slice, string + start, length);
-	} else if ( start < 0 && abs(start - length) <= strlen(string) ) {
-		int true_start = strlen(string) + start - length + 1;
-		string_slice = malloc(sizeof(char) * (length + 1));
-		strncpy(string_slice, string + true_start, length);
+		vm->shadowed_natives[i] = !table_get(&vm->globals, name, &value) ||
+			!IS_NATIVE(value) || AS_NATIVE(value) != &natives[i];
 	}
-
-	return OBJ_VAL(copy_string(string_slice, length));
 }
 
-static Value length_native(int arg_count, Value* args) {
-	if ( arg_count != 1 || !IS_STRING(args[0]) ) {
-		runtime_error("The length function takes the following argument: str(string).");
-		return INTERPRET_RUNTIME_ERROR;
-	}
+// Sets up everything but the heap contents.
+static void init_empty_vm(VM* vm) {
+	srand(time(NULL));
 
-	return NUMBER_VAL(strlen(AS_CSTRING(args[0])));
+	vm->frame_capacity = FRAMES_INITIAL;
+	vm->frames = (CallFrame*)malloc(sizeof(CallFrame) * vm->frame_capacity);
+	vm->stack_capacity = FRAME_SLOTS_MAX;
+	vm->stack = (Value*)malloc(sizeof(Value) * vm->stack_capacity);
+	if ( vm->frames == NULL || vm->stack == NULL ) exit(1);
+
+	reset_stack(vm);
+	vm->objects = NULL;
+	vm->bytes_allocated = 0;
+	vm->next_gc = GC_HEAP_INITIAL;
+
+	vm->gray_count = 0;
+	vm->gray_capacity = 0;
+	vm->gray_stack = NULL;
+	vm->marked_memos = NULL;
+	vm->marked_functions = NULL;
+
+	vm->out = stdout;
+	vm->err = stderr;
+
+	init_table(&vm->globals);
+	init_table(&vm->strings);
+	memset(vm->shadowed_natives, 0, sizeof(vm->shadowed_natives));
+	init_table(&vm->base_globals);
+	init_table(&vm->base_strings);
+
+	vm->host_natives = NULL;
+	vm->host_native_count = 0;
+	vm->host_native_capacity = 0;
+
+	vm->image = NULL;
+	vm->image_fd = -1;
+	vm->image_size = 0;
+	vm->image_objects = NULL;
+	vm->image_object_count = 0;
+
+	vm->compiled_depth = 0;
+	vm->trace = NULL;
 }
 
-static Value append_native(int arg_count, Value* args) {
-	if ( arg_count != 2 || !IS_LIST(args[0]) ) {
-		runtime_error("The append function takes the following arguments: list(list), value(int).");
-		return INTERPRET_RUNTIME_ERROR;
-	}
+static void save_base(VM* vm) {
+	vm->base_objects = vm->objects;
+	table_add_all(vm, &vm->globals, &vm->base_globals);
+	table_add_all(vm, &vm->strings, &vm->base_strings);
+}
 
-	ObjList* list = AS_LIST(args[0]);
-	Value value = args[1];
+void init_vm(VM* vm) {
+	init_empty_vm(vm);
 
-	append_to_list(list, value);
+	for ( int i=0; i < native_count; i++ ) {
+		define_native(vm, &natives[i]);
+	}
 
-	return NULL_VAL;
+	save_base(vm);
 }
 
-static Value delete_native(int arg_count, Value* args) {
-	if ( arg_count != 2 || !IS_LIST(args[0]) || !IS_NUMBER(args[1]) ) {
-		runtime_error("The delete function takes the following arguments: list(list), index(int).");
-		return INTERPRET_RUNTIME_ERROR;
-	}
-
-	ObjList* list = AS_LIST(args[0]);
-	int index = AS_NUMBER(args[1]);
+// Starts the VM from a heap image instead of defining the builtins again.
+bool init_vm_from_image(VM* vm, const char* path) {
+	init_empty_vm(vm);
 
-	if ( index < 0 && abs(index) <= list->count - 1 ) {
-	} else if ( 0 > index || index > list->count - 1 ) {
-		runtime_error("Index out of range of list.");
-		return INTERPRET_RUNTIME_ERROR;
+	if ( !load_image(vm, path) ) {
+		free_vm(vm);
+		return false;
 	}
 
-	delete_from_list(list, index);
-
-	return NULL_VAL;
+	find_shadowed_natives(vm);
+	save_base(vm);
+	return true;
 }
 
-static Value wait_millis(Value time_val) {
-	if ( !IS_NUMBER(time_val) ) {
-		runtime_error("Wait requires a number representing the wait time in milliseconds.");
-		return INTERPRET_RUNTIME_ERROR;
-	}
-
-	double target_time = AS_NUMBER(time_val) / 1000.0;
-	
-	time_t start, end;
-	time(&start);
-	do time(&end); while(difftime(end, start) <= target_time);
-	
-	return NULL_VAL;
+void push(VM* vm, Value value) {
+	*vm->stack_top = value;
+	vm->stack_top++;
 }
 
-static void reset_stack() {
-	vm.stack_top = vm.stack;
-	vm.frame_count = 0;
-	vm.open_upvalues = NULL;
+Value pop(VM* vm) {
+	vm->stack_top--;
+	return *vm->stack_top;
 }
 
-static void runtime_error(const char* format, ...) {
-	va_list args;
-	va_start(args, format);
-	vfprintf(stderr, format, args);
-	va_end(args);
-	fputs("\n", stderr);
+static Value peek(VM* vm, int distance) {
+	return vm->stack_top[-1 - distance];
+}
 
-	for ( int i=vm.frame_count - 1; i >= 0; i-- ) {
-		CallFrame* frame = &vm.frames[i];
-		ObjFunction* function = frame->closure->function;
-		size_t instruction = frame->ip - function->chunk.code - 1;
-		fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+// Moves the stack into a buffer with room for at least `needed` more values
+// and points everything that refers into it at the new buffer. The old one
+// is only freed once nothing points into it, as the offsets of those
+// pointers can't be taken from a buffer realloc() has already released.
+static void grow_stack(VM* vm, int needed) {
+	int count = (int)(vm->stack_top - vm->stack);
+	int capacity = vm->stack_capacity;
 
-		if ( function->name == NULL ) {
-			fprintf(stderr, "script\n");
-		} else {
-			fprintf(stderr, "%s()\n", function->name->chars);
-		}
+	while ( capacity < count + needed ) {
+		capacity *= 2;
 	}
 
-	reset_stack();
-}
+	Value* stack = (Value*)malloc(sizeof(Value) * capacity);
+	if ( stack == NULL ) exit(1);
+	memcpy(stack, vm->stack, sizeof(Value) * count);
 
-static void define_native(const char* name, NativeFn function) {
-	push(OBJ_VAL(copy_string(name, (int)strlen(name))));
-	push(OBJ_VAL(new_native(function)));
+	for ( int i=0; i < vm->frame_count; i++ ) {
+		ptrdiff_t offset = vm->frames[i].slots - vm->stack;
+		vm->frames[i].slots = stack + offset;
+	}
 
-	table_set(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+	for ( ObjUpvalue* upvalue = vm->open_upvalues; upvalue != NULL; upvalue = upvalue->next ) {
+		ptrdiff_t offset = upvalue->location - vm->stack;
+		upvalue->location = stack + offset;
+	}
 
-	pop();
-	pop();
+	free(vm->stack);
+	vm->stack = stack;
+	vm->stack_capacity = capacity;
+	vm->stack_top = stack + count;
 }
 
-void init_vm() {
-	srand(time(NULL));
+void ensure_stack(VM* vm, int needed) {
+	if ( vm->stack_top + needed > vm->stack + vm->stack_capacity ) {
+		grow_stack(vm, needed);
+	}
+}
 
-	reset_stack();
-	vm.objects = NULL;
-	vm.bytes_allocated = 0;
-	vm.next_gc = 1024 * 1024;
+// Makes room for one more frame and the stack slots it may use.
+static bool reserve_frame(VM* vm) {
+	if ( vm->frame_count == vm->frame_capacity ) {
+		if ( vm->frame_capacity == FRAMES_MAX ) {
+			runtime_error(vm, "Stack overflow.");
+			return false;
+		}
 
-	vm.gray_count = 0;
-	vm.gray_capacity = 0;
-	vm.gray_stack = NULL;
+		vm->frame_capacity *= 2;
+		vm->frames = (CallFrame*)realloc(vm->frames, sizeof(CallFrame) * vm->frame_capacity);
+		if ( vm->frames == NULL ) exit(1);
+	}
 
-	init_table(&vm.globals);
-	init_table(&vm.strings);
+	if ( vm->stack_top + FRAME_SLOTS_MAX > vm->stack + vm->stack_capacity ) {
+		grow_stack(vm, FRAME_SLOTS_MAX);
+	}
 
-	define_native("clock",      clock_native);
-	define_native("lower",      lower_native);
-	define_native("upper",      upper_native);
-	define_native("rand",       rand_native);
-	define_native("rand_int",   rand_int_native);
-	define_native("rand_digit", rand_digit_native);
-	define_native("rand_let",   rand_let_native);
-	define_native("rand_spcc",  rand_spcc_native);
-	define_native("rand_char",  rand_char_native);
-	define_native("slice",      slice_native);
-	define_native("length",     length_native);
-	define_native("append",     append_native);
-	define_native("delete",     delete_native);
+	return true;
 }
 
-void push(Value value) {
-	*vm.stack_top = value;
-	vm.stack_top++;
-}
+#ifdef PIKEY_JIT
+// Counts a call or loop iteration towards compiling the function. Returns
+// whether the function can run compiled from here.
+static inline bool warm_up(VM* vm, ObjFunction* function) {
+	if ( function->jit_code == NULL ) {
+		if ( function->jit_failed || ++function->hotness < JIT_THRESHOLD ) return false;
 
-Value pop() {
-	vm.stack_top--;
-	return *vm.stack_top;
+		jit_compile(function);
+		if ( function->jit_code == NULL ) return false;
+	}
+
+	return vm->compiled_depth < COMPILED_DEPTH_MAX;
 }
 
-static Value peek(int distance) {
-	return vm.stack_top[-1 - distance];
+// Runs the newest frame as compiled code from the instruction at its ip
+// until it returns.
+static bool enter_jit(VM* vm) {
+	CallFrame* frame = &vm->frames[vm->frame_count - 1];
+	ObjFunction* function = frame->closure->function;
+	uint8_t* entry = (uint8_t*)function->jit_code + function->jit_entries[frame->ip - function->chunk.code];
+
+	vm->compiled_depth++;
+	bool ok = ((JitFn)function->jit_code)(vm, frame, entry);
+	vm->compiled_depth--;
+	return ok;
 }
+#endif
 
-static bool call(ObjClosure* closure, int arg_count) {
+static bool call(VM* vm, ObjClosure* closure, int arg_count) {
 	if ( arg_count != closure->function->arity ) {
-		runtime_error("Expected %d arguments but got %d.", closure->function->arity, arg_count);
+		runtime_error(vm, "Expected %d arguments but got %d.", closure->function->arity, arg_count);
 		return false;
 	}
 
-	if ( vm.frame_count == FRAMES_MAX ) {
-		runtime_error("Stack overflow.");
-		return false;
-	}
+	if ( !reserve_frame(vm) ) return false;
 
-	CallFrame* frame = &vm.frames[vm.frame_count++];
+	CallFrame* frame = &vm->frames[vm->frame_count++];
 	frame->closure = closure;
 	frame->ip = closure->function->chunk.code;
-	frame->slots = vm.stack_top - arg_count - 1;
+	frame->slots = vm->stack_top - arg_count - 1;
 	return true;
 }
 
-static bool call_value(Value callee, int arg_count) {
+static bool call_memo(VM* vm, ObjMemo* memo, int arg_count);
+
+static bool call_value(VM* vm, Value callee, int arg_count) {
 	if ( IS_OBJ(callee) ) {
 		switch ( OBJ_TYPE(callee) ) {
 			case OBJ_CLOSURE:
-				return call(AS_CLOSURE(callee), arg_count);
+				return call(vm, AS_CLOSURE(callee), arg_count);
+			case OBJ_MEMO:
+				return call_memo(vm, AS_MEMO(callee), arg_count);
 			case OBJ_NATIVE: {
-				NativeFn native = AS_NATIVE(callee);
-				Value result = native(arg_count, vm.stack_top - arg_count);
-				vm.stack_top -= arg_count + 1;
-				push(result);
+				const NativeDef* native = AS_NATIVE(callee);
+				Value* args = vm->stack_top - arg_count;
+				Value result;
+
+				if ( !check_native_args(vm, native, arg_count, args) ||
+						!native->function(vm, arg_count, args, &result) ) {
+					return false;
+				}
+
+				vm->stack_top -= arg_count + 1;
+				push(vm, result);
 				return true;
 			}
 			default:
@@ -342,13 +343,13 @@ static bool call_value(Value callee, int arg_count) {
 		}
 	}
 
-	runtime_error("Can only call functions and classes.");
+	runtime_error(vm, "Can only call functions and classes.");
 	return false;
 }
 
-static ObjUpvalue* capture_upvalue(Value* local) {
+static ObjUpvalue* capture_upvalue(VM* vm, Value* local) {
 	ObjUpvalue* prev_upvalue = NULL;
-	ObjUpvalue* upvalue = vm.open_upvalues;
+	ObjUpvalue* upvalue = vm->open_upvalues;
 
 	while ( upvalue != NULL && upvalue->location > local ) {
 		prev_upvalue = upvalue;
@@ -359,11 +360,11 @@ static ObjUpvalue* capture_upvalue(Value* local) {
 		return upvalue;
 	}
 
-	ObjUpvalue* created_upvalue = new_upvalue(local);
+	ObjUpvalue* created_upvalue = new_upvalue(vm, local);
 	created_upvalue->next = upvalue;
 
 	if ( prev_upvalue == NULL ) {
-		vm.open_upvalues = created_upvalue;
+		vm->open_upvalues = created_upvalue;
 	} else {
 		prev_upvalue->next = created_upvalue;
 	}
@@ -371,12 +372,12 @@ static ObjUpvalue* capture_upvalue(Value* local) {
 	return created_upvalue;
 }
 
-static void close_upvalues(Value* last) {
-	while ( vm.open_upvalues != NULL && vm.open_upvalues->location >= last ) {
-		ObjUpvalue* upvalue = vm.open_upvalues;
+static void close_upvalues(VM* vm, Value* last) {
+	while ( vm->open_upvalues != NULL && vm->open_upvalues->location >= last ) {
+		ObjUpvalue* upvalue = vm->open_upvalues;
 		upvalue->closed = *upvalue->location;
 		upvalue->location = &upvalue->closed;
-		vm.open_upvalues = upvalue->next;
+		vm->open_upvalues = upvalue->next;
 	}
 }
 
@@ -384,322 +385,684 @@ static bool is_falsey(Value value) {
 	return IS_NULL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate() {
-	ObjString* b = AS_STRING(peek(0));
-	ObjString* a = AS_STRING(peek(1));
+static void concatenate(VM* vm) {
+	ObjString* b = AS_STRING(peek(vm, 0));
+	ObjString* a = AS_STRING(peek(vm, 1));
 
-	int length = a->length + b->length;
-	char* chars = ALLOCATE(char, length + 1);
-	memcpy(chars, a->chars, a->length);
-	memcpy(chars + a->length, b->chars, b->length);
-	chars[length] = '\0';
+	ObjString* result = reserve_string(vm, a->length + b->length);
+	memcpy(result->chars, a->chars, a->length);
+	memcpy(result->chars + a->length, b->chars, b->length);
 
-	ObjString* result = take_string(chars, length);
-	pop();
-	pop();
-	push(OBJ_VAL(result));
+	result = commit_string(vm, result);
+	pop(vm);
+	pop(vm);
+	push(vm, OBJ_VAL(result));
 }
 
-static ObjString* concatenate_with(ObjString* a, ObjString* b) {
-	int length = a->length + b->length;
-	char* chars = ALLOCATE(char, length + 1);
-	memcpy(chars, a->chars, a->length);
-	memcpy(chars + a->length, b->chars, b->length);
-	chars[length] = '\0';
+// Both indexed by the distance of a compound opcode from its OP_SET_* opcode.
+static const char* compound_names[] = {
+	"=", "+=", "-=", "*=", "/=", "%=", "<<=", ">>=", "&=", "|=", "^=", "++", "--"
+};
 
-	ObjString* result = take_string(chars, length);
-	return result;
+static const OpCode compound_ops[] = {
+	OP_POP, OP_ADD, OP_SUBTRACT, OP_MULTIPLY, OP_DIVIDE, OP_MODULO,
+	OP_SHIFTL, OP_SHIFTR, OP_ANDB, OP_ORB, OP_XORB
+};
+
+static bool compound_value(VM* vm, int kind, Value initial, Value operand, Value* result) {
+	OpCode op = compound_ops[kind];
+
+	switch ( op ) {
+		case OP_ADD:
+			if ( IS_STRING(initial) && IS_STRING(operand) ) {
+				*result = OBJ_VAL(append_string(vm, AS_STRING(initial), AS_STRING(operand)));
+				return true;
+			}
+
+			if ( IS_NUMBER(initial) && IS_NUMBER(operand) ) {
+				*result = add_numbers(vm, initial, operand);
+				return true;
+			}
+
+			runtime_error(vm, "Trying to add with '+=' to a variable which is either not a string or number or does not match the variable's type.");
+			return false;
+		case OP_SUBTRACT:
+		case OP_MULTIPLY:
+		case OP_DIVIDE: {
+			if ( !IS_NUMBER(initial) || !IS_NUMBER(operand) ) {
+				runtime_error(vm, "Trying to use '%s' on a variable which is not a number.", compound_names[kind]);
+				return false;
+			}
+
+			if ( op == OP_SUBTRACT ) {
+				*result = subtract_numbers(vm, initial, operand);
+			} else if ( op == OP_MULTIPLY ) {
+				*result = multiply_numbers(vm, initial, operand);
+			} else {
+				*result = divide_numbers(vm, initial, operand);
+			}
+
+			return true;
+		}
+		case OP_MODULO: {
+			if ( !IS_NUMBER(initial) || !IS_NUMBER(operand) ) {
+				runtime_error(vm, "Trying to use '%s' on a variable which is not a number.", compound_names[kind]);
+				return false;
+			}
+
+			int32_t ai;
+			int32_t bi;
+
+			if ( !number_to_int(initial, &ai) || !number_to_int(operand, &bi) ) {
+				runtime_error(vm, "Operands of modulo must be integers.");
+				return false;
+			}
+
+			if ( bi == 0 ) {
+				runtime_error(vm, "Modulo by zero.");
+				return false;
+			}
+
+			*result = INT32_VAL(vm, bi == -1 ? 0 : ai % bi);
+			return true;
+		}
+		default: {
+			if ( IS_BOOL(initial) && IS_BOOL(operand) ) {
+				bool a = AS_BOOL(initial);
+				bool b = AS_BOOL(operand);
+
+				switch ( op ) {
+					case OP_SHIFTL: *result = BOOL_VAL(a << b); break;
+					case OP_SHIFTR: *result = BOOL_VAL(a >> b); break;
+					case OP_ANDB:   *result = BOOL_VAL(a & b); break;
+					case OP_ORB:    *result = BOOL_VAL(a | b); break;
+					default:        *result = BOOL_VAL(a ^ b); break;
+				}
+
+				return true;
+			}
+
+			if ( !IS_NUMBER(initial) || !IS_NUMBER(operand) ) {
+				runtime_error(vm, "Operands of '%s' must be integers or booleans.", compound_names[kind]);
+				return false;
+			}
+
+			int32_t ai;
+			int32_t bi;
+
+			if ( !number_to_int(initial, &ai) || !number_to_int(operand, &bi) ) {
+				runtime_error(vm, "Operands of bitwise operator must be integers not floats.");
+				return false;
+			}
+
+			switch ( op ) {
+				case OP_SHIFTL: *result = INT32_VAL(vm, ai << bi); break;
+				case OP_SHIFTR: *result = INT32_VAL(vm, ai >> bi); break;
+				case OP_ANDB:   *result = INT32_VAL(vm, ai & bi); break;
+				case OP_ORB:    *result = INT32_VAL(vm, ai | bi); break;
+				default:        *result = INT32_VAL(vm, ai ^ bi); break;
+			}
+
+			return true;
+		}
+	}
+}
+
+// list[index] or string[index]. The frame must be stored before the call.
+static bool subscript_value(VM* vm, Value object, Value index, Value* result) {
+	if ( !IS_NUMBER(index) ) {
+		runtime_error(vm, "The index of a list must be an integer.");
+		return false;
+	}
+
+	if ( IS_LIST(object) ) {
+		if ( AS_NUMBER(index) < 0 && abs((int)AS_NUMBER(index)) <= AS_LIST(object)->count ) {
+		} else if ( AS_LIST(object)->count - 1 < AS_NUMBER(index) || AS_NUMBER(index) < 0 ) {
+			runtime_error(vm, "List index out of range.");
+			return false;
+		}
+
+		*result = value_from_list(AS_LIST(object), (int)AS_NUMBER(index));
+		return true;
+	}
+
+	if ( IS_STRING(object) ) {
+		ObjString* character = slice_string(vm, AS_STRING(object), (int)AS_NUMBER(index), 1);
+
+		if ( character == NULL ) {
+			runtime_error(vm, "String index out of range.");
+			return false;
+		}
+
+		*result = OBJ_VAL(character);
+		return true;
+	}
+
+	runtime_error(vm, "Subscripting is only available for lists and strings.");
+	return false;
+}
+
+void free_vm(VM* vm) {
+	free_table(vm, &vm->globals);
+	free_table(vm, &vm->strings);
+	free_table(vm, &vm->base_globals);
+	free_table(vm, &vm->base_strings);
+
+	for ( int i=0; i < vm->host_native_count; i++ ) {
+		free((char*)vm->host_natives[i]->name);
+		free(vm->host_natives[i]);
+	}
+	free(vm->host_natives);
+	free_image(vm);
+	free_objects(vm);
+	free(vm->frames);
+	free(vm->stack);
 }
 
-void free_vm() {
-	free_table(&vm.globals);
-	free_table(&vm.strings);
-	free_objects();
+// Returns the VM to the state init_vm() or init_vm_from_image() left it in,
+// ready for another script. The builtins are kept rather than defined again,
+// so their names are not hashed and interned a second time. A script can
+// change the objects in an image, and leave them pointing at objects that
+// are about to be freed, so an image is mapped again instead.
+void reset_vm(VM* vm) {
+	reset_stack(vm);
+	free_table(vm, &vm->globals);
+	free_table(vm, &vm->strings);
+	free_objects_after(vm, vm->base_objects);
+
+	if ( vm->image != NULL ) {
+		free_table(vm, &vm->base_globals);
+		free_table(vm, &vm->base_strings);
+		if ( !reload_image(vm) ) exit(74);
+		find_shadowed_natives(vm);
+		save_base(vm);
+	} else {
+		table_add_all(vm, &vm->base_globals, &vm->globals);
+		table_add_all(vm, &vm->base_strings, &vm->strings);
+		find_shadowed_natives(vm);
+	}
+
+	vm->next_gc = GC_HEAP_INITIAL;
+}
+
+// An OP_CALL_NATIVE compiled before its builtin's name was given another
+// value calls what the name holds now. That goes under the arguments, where
+// OP_CALL would have its callee.
+static Value load_shadowed_native(VM* vm, const NativeDef* native, int arg_count) {
+	ObjString* name = copy_string(vm, native->name, (int)strlen(native->name));
+	Value callee = NULL_VAL;
+	table_get(&vm->globals, name, &callee);
+
+	ensure_stack(vm, 1);
+	Value* args = vm->stack_top - arg_count;
+	memmove(args + 1, args, sizeof(Value) * arg_count);
+	*args = callee;
+	vm->stack_top++;
+	return callee;
 }
 
-static InterpretResult run() {
-	CallFrame* frame = &vm.frames[vm.frame_count - 1];
+// Runs until the frame above `base_frames` returns, which leaves its result
+// on the stack.
+static InterpretResult run(VM* vm, int base_frames) {
+	CallFrame* frame;
+	uint8_t* ip;
+	Value* slots;
+	Value* constants;
+	Value* sp;
+	Value tos;
+
+// The instruction pointer, slot base and constant base of the running frame
+// live in locals. They are written back to the frame before anything that can
+// push a frame or report a runtime error, and reloaded once control returns.
+#define STORE_FRAME() (frame->ip = ip)
+
+#define LOAD_FRAME() \
+	do { \
+		frame = &vm->frames[vm->frame_count - 1]; \
+		ip = frame->ip; \
+		slots = frame->slots; \
+		constants = frame->closure->function->chunk.constants.values; \
+	} while (false)
+
+// The top of the stack is cached in tos and the values under it end at sp, so
+// tos logically sits at *sp. Anything that reads the stack through the vm or
+// can allocate (and so collect) runs after SPILL_STACK(), and if it changes
+// the stack the cache is refilled with RELOAD_STACK() afterwards.
+#define SPILL_STACK() (*sp = tos, vm->stack_top = sp + 1)
+
+#define RELOAD_STACK() (sp = vm->stack_top - 1, tos = *sp)
+
+#define PUSH(value) \
+	do { \
+		Value pushed = (value); \
+		*sp++ = tos; \
+		tos = pushed; \
+	} while (false)
+
+#define DROP() (tos = *--sp)
+
+// A local or upvalue slot can be the top of the stack, which is not in memory.
+#define READ_SLOT(slot) ((slot) == sp ? tos : *(slot))
+
+#define WRITE_SLOT(slot, value) \
+	do { \
+		Value* written = (slot); \
+		if ( written == sp ) tos = (value); \
+		else *written = (value); \
+	} while (false)
+
+#define RUNTIME_ERROR(...) (STORE_FRAME(), runtime_error(vm, __VA_ARGS__))
 
-#define READ_BYTE() (*frame->ip++)
+#define READ_BYTE() (*ip++)
 
-#define READ_SHORT() (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
 
-#define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
+#define READ_CONSTANT() (constants[READ_BYTE()])
 
 #define READ_STRING() AS_STRING(READ_CONSTANT())
 
-#define BINARY_OP(valueType, op) \
-    do { \
-      if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-        runtime_error("Operands must be numbers."); \
-        return INTERPRET_RUNTIME_ERROR; \
-      } \
-      double b = AS_NUMBER(pop()); \
-      double a = AS_NUMBER(pop()); \
-      push(valueType(a op b)); \
-    } while (false)
+// Compact values have no doubles, only fixed point, which the helpers handle.
+#ifdef COMPACT_VALUES
+#define BOTH_DOUBLES(a, b) false
+#else
+#define BOTH_DOUBLES(a, b) (IS_DOUBLE(a) && IS_DOUBLE(b))
+#endif
+
+#define COMPARISON_OP(op) \
+	do { \
+		Value b = tos; \
+		Value a = sp[-1]; \
+		if ( BOTH_DOUBLES(a, b) ) { \
+			tos = BOOL_VAL(AS_DOUBLE(a) op AS_DOUBLE(b)); \
+		} else if ( IS_INT(a) && IS_INT(b) ) { \
+			tos = BOOL_VAL(AS_INT(a) op AS_INT(b)); \
+		} else if ( IS_NUMBER(a) && IS_NUMBER(b) ) { \
+			tos = BOOL_VAL(AS_NUMBER(a) op AS_NUMBER(b)); \
+		} else { \
+			RUNTIME_ERROR("Operands must be numbers."); \
+			return INTERPRET_RUNTIME_ERROR; \
+		} \
+		sp--; \
+	} while (false)
+
+// Two doubles are the common case and take the shortest path, with the tag
+// for ints only tested once that misses. Two ints come next, so that the
+// helper is inlined without its own checks for them.
+#define ARITHMETIC_OP(op, function) \
+	do { \
+		Value b = tos; \
+		Value a = sp[-1]; \
+		if ( BOTH_DOUBLES(a, b) ) { \
+			tos = NUMBER_VAL(vm, AS_DOUBLE(a) op AS_DOUBLE(b)); \
+		} else if ( IS_INT(a) && IS_INT(b) ) { \
+			tos = function(vm, a, b); \
+		} else if ( IS_NUMBER(a) && IS_NUMBER(b) ) { \
+			tos = function(vm, a, b); \
+		} else { \
+			RUNTIME_ERROR("Operands must be numbers."); \
+			return INTERPRET_RUNTIME_ERROR; \
+		} \
+		sp--; \
+	} while (false)
 
 #define BITWISE_OP(op) \
 	do { \
-		if ( IS_BOOL(peek(0)) && IS_BOOL(peek(1)) ) { \
-			bool b = AS_BOOL(pop()); \
-			bool a = AS_BOOL(pop()); \
-			push(BOOL_VAL(a op b)); \
-		} else if ( IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)) ) { \
-			double b = AS_NUMBER(pop()); \
-			double a = AS_NUMBER(pop()); \
-			int bi = (int)b; \
-			int ai = (int)a; \
-			if ( a != ai || b != bi ) { \
-				runtime_error("Operands of bitwise operator must be integers not floats."); \
+		if ( IS_BOOL(tos) && IS_BOOL(sp[-1]) ) { \
+			bool b = AS_BOOL(tos); \
+			bool a = AS_BOOL(*--sp); \
+			tos = BOOL_VAL(a op b); \
+		} else if ( IS_NUMBER(tos) && IS_NUMBER(sp[-1]) ) { \
+			int32_t bi; \
+			int32_t ai; \
+			if ( !number_to_int(tos, &bi) || !number_to_int(sp[-1], &ai) ) { \
+				RUNTIME_ERROR("Operands of bitwise operator must be integers not floats."); \
 				return INTERPRET_RUNTIME_ERROR; \
 			} \
-			push(NUMBER_VAL(ai op bi)); \
+			sp--; \
+			tos = INT32_VAL(vm, ai op bi); \
 		} else { \
-			runtime_error("Operands of a bitwise operator must be an integer or a boolean."); \
+			RUNTIME_ERROR("Operands of a bitwise operator must be an integer or a boolean."); \
 			return INTERPRET_RUNTIME_ERROR; \
 		} \
 	} while (false)
 
 #define POW_OP() \
 	do { \
-		if ( !IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1)) ) { \
-			runtime_error("Operands must be numbers."); \
+		if ( !IS_NUMBER(tos) || !IS_NUMBER(sp[-1]) ) { \
+			RUNTIME_ERROR("Operands must be numbers."); \
 			return INTERPRET_RUNTIME_ERROR; \
 		} \
-		double b = AS_NUMBER(pop()); \
-		double a = AS_NUMBER(pop()); \
-		push(NUMBER_VAL(pow(a, b))); \
+		double b = AS_NUMBER(tos); \
+		double a = AS_NUMBER(*--sp); \
+		tos = NUMBER_VAL(vm, pow(a, b)); \
 	} while (false)
 
 #define MODULO_OP() \
 	do { \
-		if ( !IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1)) ) { \
-			runtime_error("Operands must be numbers."); \
+		if ( !IS_NUMBER(tos) || !IS_NUMBER(sp[-1]) ) { \
+			RUNTIME_ERROR("Operands must be numbers."); \
+			return INTERPRET_RUNTIME_ERROR; \
+		} \
+		int32_t ai; \
+		int32_t bi; \
+		if ( !number_to_int(sp[-1], &ai) || !number_to_int(tos, &bi) ) { \
+			RUNTIME_ERROR("Operands of modulo must be integers."); \
 			return INTERPRET_RUNTIME_ERROR; \
 		} \
-		double b = AS_NUMBER(pop()); \
-		double a = AS_NUMBER(pop()); \
-		int ai = (int)a; \
-		int bi = (int)b; \
-		if ( a != ai || b != bi ) { \
-			runtime_error("Operands of modulo must be integers."); \
+		if ( bi == 0 ) { \
+			RUNTIME_ERROR("Modulo by zero."); \
 			return INTERPRET_RUNTIME_ERROR; \
 		} \
-		push(NUMBER_VAL((double)(ai % bi))); \
+		sp--; \
+		tos = INT32_VAL(vm, bi == -1 ? 0 : ai % bi); \
 	} while (false)
 
+	LOAD_FRAME();
+	RELOAD_STACK();
+
 	for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
+		SPILL_STACK();
 		printf("          ");
-		for (Value* slot = vm.stack; slot < vm.stack_top; slot++) {
+		for (Value* slot = vm->stack; slot < vm->stack_top; slot++) {
 			printf("[ ");
-			print_value(*slot);
+			print_value(stdout, *slot);
 			printf(" ]");
 		}
 		printf("\n");
-		disassemble_instruction(&frame->closure->function->chunk, (int)(frame->ip - frame->closure->function->chunk.code));
+		disassemble_instruction(&frame->closure->function->chunk, (int)(ip - frame->closure->function->chunk.code));
 #endif
 		uint8_t instruction;
 
 		switch ( instruction = READ_BYTE() ) {
 			case OP_CONSTANT: {
 				Value constant = READ_CONSTANT();
-				push(constant);
+				PUSH(constant);
 				break;
 			}
-			case OP_NULL: push(NULL_VAL); break;
-			case OP_TRUE: push(BOOL_VAL(true)); break;
-			case OP_FALSE: push(BOOL_VAL(false)); break;
-			case OP_POP: pop(); break;
+			case OP_NULL: PUSH(NULL_VAL); break;
+			case OP_TRUE: PUSH(BOOL_VAL(true)); break;
+			case OP_FALSE: PUSH(BOOL_VAL(false)); break;
+			case OP_POP: DROP(); break;
 			case OP_GET_LOCAL: {
 				uint8_t slot = READ_BYTE();
-				push(frame->slots[slot]);
+				PUSH(READ_SLOT(slots + slot));
 				break;
 			}
 			case OP_GET_GLOBAL: {
 				ObjString* name = READ_STRING();
 				Value value;
 
-				if ( !table_get(&vm.globals, name, &value) ) {
-					runtime_error("Undefined variable '%s'.", name->chars);
+				if ( !table_get(&vm->globals, name, &value) ) {
+					RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
 					return INTERPRET_RUNTIME_ERROR;
 				}
 
-				push(value);
+				PUSH(value);
 				break;
 			}
 			case OP_DEFINE_GLOBAL: {
 				ObjString* name = READ_STRING();
-				table_set(&vm.globals, name, peek(0));
-				pop();
+				SPILL_STACK();
+				note_global_write(vm, name);
+				table_set(vm, &vm->globals, name, tos);
+				DROP();
 				break;
 			}
 			case OP_SET_LOCAL: {
 				uint8_t slot = READ_BYTE();
-				frame->slots[slot] = peek(0);
+				slots[slot] = tos;
 				break;
 			}
-			case OP_SUB_SET_LOCAL: {
+			case OP_ADD_SET_LOCAL:
+			case OP_SUB_SET_LOCAL:
+			case OP_MUL_SET_LOCAL:
+			case OP_DIV_SET_LOCAL:
+			case OP_MOD_SET_LOCAL:
+			case OP_SHIFTL_SET_LOCAL:
+			case OP_SHIFTR_SET_LOCAL:
+			case OP_ANDB_SET_LOCAL:
+			case OP_ORB_SET_LOCAL:
+			case OP_XORB_SET_LOCAL: {
 				uint8_t slot = READ_BYTE();
-				Value initial = frame->slots[slot];
-				Value sub = peek(0);
+				Value result;
 
-				if ( !IS_NUMBER(initial) || !IS_NUMBER(sub) ) {
-					runtime_error("Trying to subtract with '-=' to a variable which is not a number.");
+				STORE_FRAME();
+				SPILL_STACK();
+				if ( !compound_value(vm, instruction - OP_SET_LOCAL, slots[slot], tos, &result) ) {
 					return INTERPRET_RUNTIME_ERROR;
 				}
 
-				frame->slots[slot] = num_to_value(value_to_num(initial) - value_to_num(sub));
+				slots[slot] = result;
+				tos = result;
 				break;
 			}
-			case OP_ADD_SET_LOCAL: {
+			case OP_INC_LOCAL:
+			case OP_DEC_LOCAL: {
 				uint8_t slot = READ_BYTE();
-				Value initial = frame->slots[slot];
-				Value add = peek(0);
+				Value initial = READ_SLOT(slots + slot);
 
-				if ( IS_STRING(initial) && IS_STRING(add) ) {
-					frame->slots[slot] = OBJ_VAL(concatenate_with(AS_STRING(initial), AS_STRING(add)));
-				} else if ( IS_NUMBER(initial) && IS_NUMBER(add) ) {
-					frame->slots[slot] = num_to_value(value_to_num(initial) + value_to_num(add));
-				} else {
-					runtime_error("Trying to add with '+=' to a variable which is either not a string or number or does not match the variable's type.");
-					return INTERPRET_RUNTIME_ERROR;
+				if ( IS_INT(initial) ) {
+					WRITE_SLOT(slots + slot, add_numbers(vm, initial, INT_VAL(instruction == OP_INC_LOCAL ? 1 : -1)));
+					break;
 				}
 
-				break;
-			}
-			case OP_SET_GLOBAL: {
-				ObjString* name = READ_STRING();
-
-				if ( table_set(&vm.globals, name, peek(0)) ) {
-					table_delete(&vm.globals, name);
-					runtime_error("Undefined variable '%s'.", name->chars);
+				if ( !IS_NUMBER(initial) ) {
+					RUNTIME_ERROR("Operand of '%s' must be a number.", compound_names[instruction - OP_SET_LOCAL]);
 					return INTERPRET_RUNTIME_ERROR;
 				}
 
+				WRITE_SLOT(slots + slot, add_numbers(vm, initial, INT_VAL(instruction == OP_INC_LOCAL ? 1 : -1)));
 				break;
 			}
-			case OP_SUB_SET_GLOBAL: {
+			case OP_SET_GLOBAL: {
 				ObjString* name = READ_STRING();
-				Value initial;
-				Value sub = peek(0);
-
-				if ( !table_get(&vm.globals, name, &initial) ) {
-					runtime_error("Undefined variable '%s'.", name->chars);
-					return INTERPRET_RUNTIME_ERROR;
-				}
-
-				if ( !IS_NUMBER(initial) || !IS_NUMBER(sub) ) {
-					runtime_error("Trying to subtract with '-=' to a variable which is not a number.");
-					return INTERPRET_RUNTIME_ERROR;
-				}
-
-				Value new_val = num_to_value(value_to_num(initial) - value_to_num(sub));
 
-				if ( table_set(&vm.globals, name, new_val) ) {
-					table_delete(&vm.globals, name);
-					runtime_error("Undefined variable '%s'.", name->chars);
+				SPILL_STACK();
+				note_global_write(vm, name);
+				if ( table_set(vm, &vm->globals, name, tos) ) {
+					table_delete(&vm->globals, name);
+					RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
 					return INTERPRET_RUNTIME_ERROR;
 				}
 
 				break;
 			}
-			case OP_ADD_SET_GLOBAL: {
+			case OP_ADD_SET_GLOBAL:
+			case OP_SUB_SET_GLOBAL:
+			case OP_MUL_SET_GLOBAL:
+			case OP_DIV_SET_GLOBAL:
+			case OP_MOD_SET_GLOBAL:
+			case OP_SHIFTL_SET_GLOBAL:
+			case OP_SHIFTR_SET_GLOBAL:
+			case OP_ANDB_SET_GLOBAL:
+			case OP_ORB_SET_GLOBAL:
+			case OP_XORB_SET_GLOBAL:
+			case OP_INC_GLOBAL:
+			case OP_DEC_GLOBAL: {
 				ObjString* name = READ_STRING();
 				Value initial;
-				Value add = peek(0);
+				Value result;
 
-				if ( !table_get(&vm.globals, name, &initial) ) {
-					runtime_error("Undefined variable '%s'.", name->chars);
+				if ( !table_get(&vm->globals, name, &initial) ) {
+					RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
 					return INTERPRET_RUNTIME_ERROR;
 				}
 
-				Value new_val;
-
-				if ( IS_STRING(initial) && IS_STRING(add) ) {
-					new_val = OBJ_VAL(concatenate_with(AS_STRING(initial), AS_STRING(add)));
-
-				} else if ( IS_NUMBER(initial) && IS_NUMBER(add) ) {
-					Value add = add;
+				SPILL_STACK();
+				if ( instruction == OP_INC_GLOBAL || instruction == OP_DEC_GLOBAL ) {
+					if ( !IS_NUMBER(initial) ) {
+						RUNTIME_ERROR("Operand of '%s' must be a number.", compound_names[instruction - OP_SET_GLOBAL]);
+						return INTERPRET_RUNTIME_ERROR;
+					}
 
-					new_val = num_to_value(value_to_num(initial) + value_to_num(add));
+					result = add_numbers(vm, initial, INT_VAL(instruction == OP_INC_GLOBAL ? 1 : -1));
 				} else {
-					runtime_error("Trying to add with '+=' to a variable which is either not a string or number or does not match the variable's type.");
-					return INTERPRET_RUNTIME_ERROR;
-				}
+					STORE_FRAME();
+					if ( !compound_value(vm, instruction - OP_SET_GLOBAL, initial, tos, &result) ) {
+						return INTERPRET_RUNTIME_ERROR;
+					}
 
-				if ( table_set(&vm.globals, name, new_val) ) {
-					table_delete(&vm.globals, name);
-					runtime_error("Undefined variable '%s'.", name->chars);
-					return INTERPRET_RUNTIME_ERROR;
+					// Keep the result reachable while the table may grow.
+					tos = result;
+					SPILL_STACK();
 				}
 
+				note_global_write(vm, name);
+				table_set(vm, &vm->globals, name, result);
 				break;
 			}
 			case OP_GET_UPVALUE: {
 				uint8_t slot = READ_BYTE();
-				push(*frame->closure->upvalues[slot]->location);
+				PUSH(*frame->closure->upvalues[slot]->location);
+				break;
+			}
+			case OP_GET_ENCLOSING: {
+				uint8_t slot = READ_BYTE();
+				PUSH(frame[-1].slots[slot]);
 				break;
 			}
 			case OP_SET_UPVALUE: {
 				uint8_t slot = READ_BYTE();
-				*frame->closure->upvalues[slot]->location = peek(0);
+				*frame->closure->upvalues[slot]->location = tos;
+				break;
+			}
+			case OP_SET_ENCLOSING: {
+				uint8_t slot = READ_BYTE();
+				frame[-1].slots[slot] = tos;
 				break;
 			}
-			case OP_SUB_SET_UPVALUE: {
+			case OP_ADD_SET_UPVALUE:
+			case OP_SUB_SET_UPVALUE:
+			case OP_MUL_SET_UPVALUE:
+			case OP_DIV_SET_UPVALUE:
+			case OP_MOD_SET_UPVALUE:
+			case OP_SHIFTL_SET_UPVALUE:
+			case OP_SHIFTR_SET_UPVALUE:
+			case OP_ANDB_SET_UPVALUE:
+			case OP_ORB_SET_UPVALUE:
+			case OP_XORB_SET_UPVALUE: {
 				uint8_t slot = READ_BYTE();
-				Value initial = *frame->closure->upvalues[slot]->location;
-				Value sub = peek(0);
+				Value* location = frame->closure->upvalues[slot]->location;
+				Value result;
 
-				if ( !IS_NUMBER(initial) || !IS_NUMBER(sub) ) {
-					runtime_error("Trying to add with '+=' to a variable which is either not a string or number or does not match the variable's type.");
+				STORE_FRAME();
+				SPILL_STACK();
+				if ( !compound_value(vm, instruction - OP_SET_UPVALUE, *location, tos, &result) ) {
 					return INTERPRET_RUNTIME_ERROR;
 				}
 
-				*frame->closure->upvalues[slot]->location = num_to_value(value_to_num(initial) - value_to_num(sub));
+				*frame->closure->upvalues[slot]->location = result;
+				tos = result;
 				break;
 			}
-			case OP_ADD_SET_UPVALUE: {
+			case OP_INC_UPVALUE:
+			case OP_DEC_UPVALUE: {
 				uint8_t slot = READ_BYTE();
-				Value initial = *frame->closure->upvalues[slot]->location;
-				Value add = peek(0);
+				Value* location = frame->closure->upvalues[slot]->location;
 
-				if ( IS_STRING(initial) && IS_STRING(add) ) {
-					*frame->closure->upvalues[slot]->location = OBJ_VAL(concatenate_with(AS_STRING(initial), AS_STRING(add)));
-				} else if ( IS_NUMBER(initial) && IS_NUMBER(add) ) {
-					*frame->closure->upvalues[slot]->location = num_to_value(value_to_num(initial) + value_to_num(add));
-				} else {
-					runtime_error("Trying to add with '+=' to a variable which is either not a string or number or does not match the variable's type.");
+				if ( !IS_NUMBER(*location) ) {
+					RUNTIME_ERROR("Operand of '%s' must be a number.", compound_names[instruction - OP_SET_UPVALUE]);
+					return INTERPRET_RUNTIME_ERROR;
+				}
+
+				*location = add_numbers(vm, *location, INT_VAL(instruction == OP_INC_UPVALUE ? 1 : -1));
+				break;
+			}
+			case OP_ADD_SET_ENCLOSING:
+			case OP_SUB_SET_ENCLOSING:
+			case OP_MUL_SET_ENCLOSING:
+			case OP_DIV_SET_ENCLOSING:
+			case OP_MOD_SET_ENCLOSING:
+			case OP_SHIFTL_SET_ENCLOSING:
+			case OP_SHIFTR_SET_ENCLOSING:
+			case OP_ANDB_SET_ENCLOSING:
+			case OP_ORB_SET_ENCLOSING:
+			case OP_XORB_SET_ENCLOSING: {
+				uint8_t slot = READ_BYTE();
+				Value* location = &frame[-1].slots[slot];
+				Value result;
+
+				STORE_FRAME();
+				SPILL_STACK();
+				if ( !compound_value(vm, instruction - OP_SET_ENCLOSING, *location, tos, &result) ) {
+					return INTERPRET_RUNTIME_ERROR;
+				}
+
+				*location = result;
+				tos = result;
+				break;
+			}
+			case OP_INC_ENCLOSING:
+			case OP_DEC_ENCLOSING: {
+				uint8_t slot = READ_BYTE();
+				Value* location = &frame[-1].slots[slot];
+
+				if ( !IS_NUMBER(*location) ) {
+					RUNTIME_ERROR("Operand of '%s' must be a number.", compound_names[instruction - OP_SET_ENCLOSING]);
 					return INTERPRET_RUNTIME_ERROR;
 				}
 
+				*location = add_numbers(vm, *location, INT_VAL(instruction == OP_INC_ENCLOSING ? 1 : -1));
 				break;
 			}
 			case OP_EQUAL: {
-				Value b = pop();
-				Value a = pop();
-				push(BOOL_VAL(values_equal(a, b)));
+				Value b = tos;
+				Value a = *--sp;
+				tos = BOOL_VAL(values_equal(a, b));
 				break;
 			}
-			case OP_GREATER:  BINARY_OP(BOOL_VAL, >); break;
-			case OP_LESSER:   BINARY_OP(BOOL_VAL, <); break;
+			case OP_GREATER:  COMPARISON_OP(>); break;
+			case OP_LESSER:   COMPARISON_OP(<); break;
 			case OP_ADD: {
-				if ( IS_STRING(peek(0)) && IS_STRING(peek(1)) ) {
-					concatenate();
-				} else if ( IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)) ) {
-					double b = AS_NUMBER(pop());
-					double a = AS_NUMBER(pop());
-					push(NUMBER_VAL(a + b));
+				if ( IS_STRING(tos) && IS_STRING(sp[-1]) ) {
+					ip[-1] = OP_ADD_STR_Q;
+					SPILL_STACK();
+					concatenate(vm);
+					RELOAD_STACK();
+				} else if ( IS_NUMBER(tos) && IS_NUMBER(sp[-1]) ) {
+					ip[-1] = OP_ADD_NUM_Q;
+					Value b = tos;
+					Value a = *--sp;
+					tos = add_numbers(vm, a, b);
 				} else {
-					runtime_error("Operands must be two numbers or two strings.");
+					RUNTIME_ERROR("Operands must be two numbers or two strings.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
 				break;
 			}
-			case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-			case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-			case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /); break;
+			case OP_ADD_NUM_Q: {
+				Value b = tos;
+				Value a = sp[-1];
+
+				if ( BOTH_DOUBLES(a, b) ) {
+					tos = NUMBER_VAL(vm, AS_DOUBLE(a) + AS_DOUBLE(b));
+				} else if ( IS_NUMBER(a) && IS_NUMBER(b) ) {
+					tos = add_numbers(vm, a, b);
+				} else {
+					ip[-1] = OP_ADD;
+					ip--;
+					break;
+				}
+
+				sp--;
+				break;
+			}
+			case OP_ADD_STR_Q: {
+				if ( !IS_STRING(tos) || !IS_STRING(sp[-1]) ) {
+					ip[-1] = OP_ADD;
+					ip--;
+					break;
+				}
+
+				SPILL_STACK();
+				concatenate(vm);
+				RELOAD_STACK();
+				break;
+			}
+			case OP_SUBTRACT: ARITHMETIC_OP(-, subtract_numbers); break;
+			case OP_MULTIPLY: ARITHMETIC_OP(*, multiply_numbers); break;
+			case OP_DIVIDE:   ARITHMETIC_OP(/, divide_numbers); break;
 			case OP_MODULO:   MODULO_OP(); break;
 			case OP_POW:      POW_OP(); break;
 			case OP_ANDB:     BITWISE_OP(&); break;
@@ -708,185 +1071,850 @@ static InterpretResult run() {
 			case OP_SHIFTR:   BITWISE_OP(>>); break;
 			case OP_SHIFTL:   BITWISE_OP(<<); break;
 			case OP_NOT:
-				push(BOOL_VAL(is_falsey(pop())));
+				tos = BOOL_VAL(is_falsey(tos));
 				break;
 			case OP_NEGATE: {
-				if ( !IS_NUMBER(peek(0)) ) {
-					runtime_error("Operand must be a number.");
+				if ( !IS_NUMBER(tos) ) {
+					RUNTIME_ERROR("Operand must be a number.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
-				push(NUMBER_VAL(-AS_NUMBER(pop())));
+				tos = negate_number(vm, tos);
 				break;
 			}
 			case OP_TYPE: {
-				print_value(pop());
-				printf("\n");
+				type_value(vm, tos);
+				DROP();
 				break;
 			}
 			case OP_WAIT: {
-				wait_millis(pop());
+				Value time = tos;
+				DROP();
+				STORE_FRAME();
+				if ( !wait_millis(vm, time) ) {
+					return INTERPRET_RUNTIME_ERROR;
+				}
 				break;
 			}
 			case OP_JUMP: {
 				uint16_t offset = READ_SHORT();
-				frame->ip += offset;
+				ip += offset;
 				break;
 			}
 			case OP_JUMP_IF_FALSE: {
 				uint16_t offset = READ_SHORT();
-				if ( is_falsey(peek(0)) ) frame->ip += offset;
+				if ( is_falsey(tos) ) ip += offset;
 				break;
 			}
 			case OP_LOOP: {
 				uint16_t offset = READ_SHORT();
-				frame->ip -= offset;
+				ip -= offset;
+#ifdef PIKEY_JIT
+				// A hot loop carries on in compiled code from its header and
+				// stays there until the function returns.
+				if ( warm_up(vm, frame->closure->function) &&
+						frame->closure->function->jit_entries[ip - frame->closure->function->chunk.code] >= 0 ) {
+					STORE_FRAME();
+					SPILL_STACK();
+					if ( !enter_jit(vm) ) return INTERPRET_RUNTIME_ERROR;
+					if ( vm->frame_count == base_frames ) return INTERPRET_OK;
+
+					LOAD_FRAME();
+					RELOAD_STACK();
+				}
+#endif
 				break;
 			}
 			case OP_CALL: {
 				int arg_count = READ_BYTE();
-				if ( !call_value(peek(arg_count), arg_count) ) {
-					return INTERPRET_RUNTIME_ERROR;
-				}
-				frame = &vm.frames[vm.frame_count - 1];
-				break;
+				CallCache* cache = &frame->closure->function->chunk.caches[READ_SHORT()];
+				STORE_FRAME();
+				SPILL_STACK();
+				Value callee = sp[-arg_count];
+
+				if ( IS_OBJ(callee) && AS_OBJ(callee) == cache->callee ) {
+					if ( cache->is_native ) {
+						const NativeDef* native = ((ObjNative*)cache->callee)->def;
+						Value* args = sp - arg_count + 1;
+						Value result;
+
+						if ( !check_native_args(vm, native, arg_count, args) ||
+								!native->function(vm, arg_count, args, &result) ) {
+							return INTERPRET_RUNTIME_ERROR;
+						}
+
+						sp -= arg_count;
+						tos = result;
+						break;
+					}
+
+					// When either stack has to grow the generic path below does it.
+					if ( vm->frame_count < vm->frame_capacity &&
+							vm->stack_top + FRAME_SLOTS_MAX <= vm->stack + vm->stack_capacity ) {
+						ObjClosure* closure = (ObjClosure*)cache->callee;
+						frame = &vm->frames[vm->frame_count++];
+						frame->closure = closure;
+						frame->slots = sp - arg_count;
+						ip = closure->function->chunk.code;
+						slots = frame->slots;
+						constants = closure->function->chunk.constants.values;
+
+#ifdef PIKEY_JIT
+						if ( warm_up(vm, closure->function) ) {
+							frame->ip = ip;
+							if ( !enter_jit(vm) ) return INTERPRET_RUNTIME_ERROR;
+
+							LOAD_FRAME();
+							RELOAD_STACK();
+						}
+#endif
+						break;
+					}
+				}
+
+				if ( !call_value(vm, callee, arg_count) ) {
+					return INTERPRET_RUNTIME_ERROR;
+				}
+
+				if ( IS_CLOSURE(callee) || IS_NATIVE(callee) ) {
+					cache->callee = AS_OBJ(callee);
+					cache->is_native = IS_NATIVE(callee);
+				}
+
+#ifdef PIKEY_JIT
+				if ( IS_CLOSURE(callee) && warm_up(vm, AS_CLOSURE(callee)->function) && !enter_jit(vm) ) {
+					return INTERPRET_RUNTIME_ERROR;
+				}
+#endif
+
+				LOAD_FRAME();
+				RELOAD_STACK();
+				break;
+			}
+			case OP_CALL_NATIVE: {
+				int index = READ_BYTE();
+				const NativeDef* native = &natives[index];
+				int arg_count = READ_BYTE();
+				STORE_FRAME();
+				SPILL_STACK();
+
+				if ( vm->shadowed_natives[index] ) {
+					Value callee = load_shadowed_native(vm, native, arg_count);
+					if ( !call_value(vm, callee, arg_count) ) {
+						return INTERPRET_RUNTIME_ERROR;
+					}
+
+#ifdef PIKEY_JIT
+					if ( IS_CLOSURE(callee) && warm_up(vm, AS_CLOSURE(callee)->function) && !enter_jit(vm) ) {
+						return INTERPRET_RUNTIME_ERROR;
+					}
+#endif
+
+					LOAD_FRAME();
+					RELOAD_STACK();
+					break;
+				}
+
+				Value* args = sp - arg_count + 1;
+				Value result;
+
+				if ( !check_native_args(vm, native, arg_count, args) ||
+						!native->function(vm, arg_count, args, &result) ) {
+					return INTERPRET_RUNTIME_ERROR;
+				}
+
+				sp = args;
+				tos = result;
+				break;
 			}
 			case OP_CLOSURE: {
 				ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-				ObjClosure* closure = new_closure(function);
-				push(OBJ_VAL(closure));
+				SPILL_STACK();
+				ObjClosure* closure = new_closure(vm, function);
+				push(vm, OBJ_VAL(closure));
 
 				for ( int i=0; i < closure->upvalue_count; i++ ) {
 					uint8_t is_local = READ_BYTE();
 					uint8_t index = READ_BYTE();
 
-					if ( is_local ) {
-						closure->upvalues[i] = capture_upvalue(frame->slots + index);
-					} else {
+					if ( is_local == CAPTURE_LOCAL ) {
+						closure->upvalues[i] = capture_upvalue(vm, slots + index);
+					} else if ( is_local == CAPTURE_UPVALUE ) {
 						closure->upvalues[i] = frame->closure->upvalues[index];
 					}
 				}
 
+				RELOAD_STACK();
 				break;
 			}
 			case OP_CLOSE_UPVALUE:
-				close_upvalues(vm.stack_top - 1);
-				pop();
+				SPILL_STACK();
+				close_upvalues(vm, sp);
+				DROP();
 				break;
 			case OP_CREATE_LIST: {
-				ObjList* list = new_list();
 				uint8_t list_count = READ_BYTE();
+				SPILL_STACK();
+				ObjList* list = new_list(vm);
 
-				push(OBJ_VAL(list));
+				push(vm, OBJ_VAL(list));
 				for ( int i=list_count; i > 0; i-- ) {
-					append_to_list(list, peek(i));
+					append_to_list(vm, list, peek(vm, i));
 				}
 
-				while ( list_count-- != 0 ) {
-					pop();
+				vm->stack_top -= list_count + 1;
+				push(vm, OBJ_VAL(list));
+				RELOAD_STACK();
+				break;
+			}
+			case OP_ITER_INIT: {
+				if ( !IS_LIST(tos) && !IS_STRING(tos) ) {
+					RUNTIME_ERROR("Can only iterate over lists and strings.");
+					return INTERPRET_RUNTIME_ERROR;
 				}
 
-				push(OBJ_VAL(list));
+				PUSH(INT_VAL(0));
+				break;
+			}
+			case OP_ITER_NEXT: {
+				uint8_t slot = READ_BYTE();
+				uint16_t offset = READ_SHORT();
+				Obj* sequence = AS_OBJ(slots[slot]);
+				int index = AS_INT(READ_SLOT(slots + slot + 1));
+
+				if ( sequence->type == OBJ_LIST ) {
+					ObjList* list = (ObjList*)sequence;
+
+					if ( index >= list->count ) {
+						ip += offset;
+						break;
+					}
+
+					PUSH(list->items[index]);
+				} else {
+					ObjString* string = (ObjString*)sequence;
+
+					if ( index >= string->length ) {
+						ip += offset;
+						break;
+					}
+
+					SPILL_STACK();
+					PUSH(OBJ_VAL(new_string(vm, &string->chars[index], 1)));
+				}
+
+				WRITE_SLOT(slots + slot + 1, INT_VAL(index + 1));
 				break;
 			}
 			case OP_SUBSCRIPT: {
-				Value index = pop();
-				Value object = pop();
+				Value object = sp[-1];
+				Value result;
 
-				if ( !IS_NUMBER(index) ) {
-					runtime_error("The index of a list must be an integer.");
+				STORE_FRAME();
+				SPILL_STACK();
+				if ( !subscript_value(vm, object, tos, &result) ) {
 					return INTERPRET_RUNTIME_ERROR;
 				}
 
-				if ( IS_LIST(OBJ_VAL(object)) ) {
-					if ( AS_NUMBER(index) < 0 && abs((int)AS_NUMBER(index)) <= AS_LIST(object)->count - 1 ) {
-					} else if ( AS_LIST(object)->count - 1 < AS_NUMBER(index) || AS_NUMBER(index) < 0 ) {
-						runtime_error("List index out of range.");
-						return INTERPRET_RUNTIME_ERROR;
-					}
+				if ( IS_LIST(object) ) ip[-1] = OP_SUBSCRIPT_LIST_Q;
+				sp--;
+				tos = result;
+				break;
+			}
+			case OP_SUBSCRIPT_LIST_Q: {
+				int32_t index;
+				if ( !IS_NUMBER(tos) || !IS_LIST(sp[-1]) || !number_to_int(tos, &index) ) {
+					ip[-1] = OP_SUBSCRIPT;
+					ip--;
+					break;
+				}
 
-					push(value_from_list(AS_LIST(object), (int)AS_NUMBER(index)));
-				} else if ( IS_STRING(OBJ_VAL(object)) ) {
-					Value args[2];
-					args[0] = object;
-					args[1] = index;
+				ObjList* list = AS_LIST(sp[-1]);
 
-					push(slice_native(2, args));
-				} else {
-					runtime_error("Subscripting is only available for lists and strings.");
+				if ( index < 0 ) index += list->count;
+
+				if ( index < 0 || index >= list->count ) {
+					RUNTIME_ERROR("List index out of range.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
 
+				sp--;
+				tos = list->items[index];
 				break;
 			}
 			case OP_SET_SUBSCRIPT: {
-				Value value = pop();
-				Value index = pop();
-				Value object = pop();
+				Value value = tos;
+				Value index = sp[-1];
+				Value object = sp[-2];
+				sp -= 2;
 
 				if ( !IS_NUMBER(index) ) {
-					runtime_error("The index of a list must be an integer");
+					RUNTIME_ERROR("The index of a list must be an integer");
 					return INTERPRET_RUNTIME_ERROR;
 				}
 
 				if ( IS_LIST(OBJ_VAL(object)) ) {
-					if ( AS_NUMBER(index) < 0 && abs((int)AS_NUMBER(index)) <= AS_LIST(object)->count - 1 ) {
+					if ( AS_NUMBER(index) < 0 && abs((int)AS_NUMBER(index)) <= AS_LIST(object)->count ) {
 					} else if ( AS_LIST(object)->count - 1 < AS_NUMBER(index) || AS_NUMBER(index) < 0 ) {
-						runtime_error("List index out of range.");
+						RUNTIME_ERROR("List index out of range.");
 						return INTERPRET_RUNTIME_ERROR;
 					}
 
 					set_in_list(AS_LIST(object), (int)AS_NUMBER(index), value);
-					push(value);
 				} else if ( IS_STRING(OBJ_VAL(object)) ) {
 					if ( !IS_STRING(OBJ_VAL(value)) ) {
-						runtime_error("Only characters can be added into a string");
+						RUNTIME_ERROR("Only characters can be added into a string");
 						return INTERPRET_RUNTIME_ERROR;
 					}
 
 					char character = *AS_STRING(value)->chars;
 
-					set_in_string(AS_STRING(object), (int)AS_NUMBER(index), character);
+					// The string stays on the stack while it may be given
+					// characters of its own.
+					vm->stack_top = sp + 1;
+					set_in_string(vm, AS_STRING(object), (int)AS_NUMBER(index), character);
 				} else {
-					runtime_error("Subscripting is only available for lists and strings.");
+					RUNTIME_ERROR("Subscripting is only available for lists and strings.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
 
 				break;
 			}
 			case OP_RETURN: {
-				Value result = pop();
-				close_upvalues(frame->slots);
-				vm.frame_count--;
-
-				if ( vm.frame_count == 0 ) {
-					pop();
+				Value result = tos;
+				SPILL_STACK();
+				close_upvalues(vm, slots);
+				vm->frame_count--;
+
+				// The outermost return leaves its value on the stack for
+				// whoever started the VM.
+				if ( vm->frame_count == base_frames ) {
+					*slots = result;
+					vm->stack_top = slots + 1;
 					return INTERPRET_OK;
 				}
 
-				vm.stack_top = frame->slots;
-				push(result);
-				frame = &vm.frames[vm.frame_count - 1];
+				sp = slots;
+				tos = result;
+				LOAD_FRAME();
 				break;
 			}
 		}
 	}
 
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef SPILL_STACK
+#undef RELOAD_STACK
+#undef PUSH
+#undef DROP
+#undef READ_SLOT
+#undef WRITE_SLOT
+#undef RUNTIME_ERROR
 #undef READ_BYTE
 #undef READ_CONSTANT
 #undef READ_SHORT
 #undef READ_STRING
-#undef BINARY_OP
+#undef BOTH_DOUBLES
+#undef COMPARISON_OP
+#undef ARITHMETIC_OP
 }
 
-InterpretResult interpret(const char* source) {
-	ObjFunction* function = compile(source);
+InterpretResult interpret(VM* vm, const char* source) {
+	ObjFunction* function = compile(vm, source);
 	if ( function == NULL ) return INTERPRET_COMPILE_ERROR;
 
-	push(OBJ_VAL(function));
-	ObjClosure* closure = new_closure(function);
-	pop();
-	push(OBJ_VAL(closure));
-	call(closure, 0);
+	push(vm, OBJ_VAL(function));
+	ObjClosure* closure = new_closure(vm, function);
+	pop(vm);
+	push(vm, OBJ_VAL(closure));
+	call(vm, closure, 0);
+
+	InterpretResult result = run(vm, 0);
+	if ( result == INTERPRET_OK ) pop(vm);
+	return result;
+}
+
+// Runs the frame call() just pushed, compiled if it can be.
+static InterpretResult run_callee(VM* vm, int base_frames) {
+	CallFrame* frame = &vm->frames[vm->frame_count - 1];
+
+	if ( frame->closure->function->compiled != NULL && vm->compiled_depth < COMPILED_DEPTH_MAX ) {
+		vm->compiled_depth++;
+		bool ok = ((CompiledFn)frame->closure->function->compiled)(vm, frame);
+		vm->compiled_depth--;
+		return ok ? INTERPRET_OK : INTERPRET_RUNTIME_ERROR;
+	}
+
+#ifdef PIKEY_JIT
+	if ( warm_up(vm, frame->closure->function) ) {
+		return enter_jit(vm) ? INTERPRET_OK : INTERPRET_RUNTIME_ERROR;
+	}
+#endif
+
+	return run(vm, base_frames);
+}
+
+// Answers from the memo's cache, or else runs the function to completion
+// right away so its result can be stored, leaving the result in place of the
+// callee either way. Past COMPILED_DEPTH_MAX nested runs, and for more
+// arguments than a key holds, the function is just called.
+static bool call_memo(VM* vm, ObjMemo* memo, int arg_count) {
+	Value* args = vm->stack_top - arg_count;
+	Value result;
+
+	if ( arg_count <= MEMO_ARGS_MAX && memo_get(&memo->cache, arg_count, args, &result) ) {
+		vm->stack_top -= arg_count + 1;
+		push(vm, result);
+		return true;
+	}
+
+	if ( arg_count > MEMO_ARGS_MAX || vm->compiled_depth >= COMPILED_DEPTH_MAX ) {
+		args[-1] = memo->function;
+		return call_value(vm, memo->function, arg_count);
+	}
+
+	// The arguments stay below as the key, the function gets a copy of them
+	// it is free to assign to.
+	ensure_stack(vm, arg_count + 1);
+	args = vm->stack_top - arg_count;
+	push(vm, memo->function);
+	for ( int i=0; i < arg_count; i++ ) {
+		push(vm, args[i]);
+	}
+
+	int base_frames = vm->frame_count;
+	if ( !call_value(vm, memo->function, arg_count) ) return false;
+
+	if ( vm->frame_count > base_frames ) {
+		vm->compiled_depth++;
+		InterpretResult status = run_callee(vm, base_frames);
+		vm->compiled_depth--;
+		if ( status != INTERPRET_OK ) return false;
+	}
+
+	Value* key = vm->stack_top - 1 - arg_count;
+	result = vm->stack_top[-1];
+	memo_set(vm, &memo->cache, arg_count, key, result);
+	vm->stack_top -= arg_count + 2;
+	push(vm, result);
+	return true;
+}
+
+// Calls a closure or native from outside the VM and stores what it returns
+// in `result`. The VM must not be running, so a native can't use this to
+// call back into a script.
+InterpretResult call_from_host(VM* vm, Value callee, int arg_count, const Value* args, Value* result) {
+	if ( vm->frame_count != 0 ) {
+		fprintf(vm->err, "Cannot call a function while the VM is running.\n");
+		return INTERPRET_RUNTIME_ERROR;
+	}
+
+	ensure_stack(vm, arg_count + 1);
+	push(vm, callee);
+	for ( int i=0; i < arg_count; i++ ) {
+		push(vm, args[i]);
+	}
+
+	if ( !call_value(vm, callee, arg_count) ) return INTERPRET_RUNTIME_ERROR;
+
+	if ( vm->frame_count != 0 ) {
+		InterpretResult status = run_callee(vm, 0);
+		if ( status != INTERPRET_OK ) return status;
+	}
+
+	*result = pop(vm);
+	return INTERPRET_OK;
+}
+
+bool rt_get_global(VM* vm, ObjString* name) {
+	Value value;
+
+	if ( !table_get(&vm->globals, name, &value) ) {
+		runtime_error(vm, "Undefined variable '%s'.", name->chars);
+		return false;
+	}
+
+	push(vm, value);
+	return true;
+}
+
+bool rt_set_global(VM* vm, ObjString* name) {
+	note_global_write(vm, name);
+	if ( table_set(vm, &vm->globals, name, peek(vm, 0)) ) {
+		table_delete(&vm->globals, name);
+		runtime_error(vm, "Undefined variable '%s'.", name->chars);
+		return false;
+	}
+
+	return true;
+}
+
+bool rt_define_global(VM* vm, ObjString* name) {
+	note_global_write(vm, name);
+	table_set(vm, &vm->globals, name, peek(vm, 0));
+	pop(vm);
+	return true;
+}
+
+bool rt_compound_local(VM* vm, CallFrame* frame, int kind, int slot) {
+	Value result;
+
+	if ( !compound_value(vm, kind, frame->slots[slot], peek(vm, 0), &result) ) {
+		return false;
+	}
+
+	frame->slots[slot] = result;
+	vm->stack_top[-1] = result;
+	return true;
+}
+
+bool rt_inc_local(VM* vm, CallFrame* frame, int kind, int slot) {
+	Value initial = frame->slots[slot];
+
+	if ( !IS_NUMBER(initial) ) {
+		runtime_error(vm, "Operand of '%s' must be a number.", compound_names[kind]);
+		return false;
+	}
+
+	frame->slots[slot] = add_numbers(vm, initial, INT_VAL(kind == OP_INC_LOCAL - OP_SET_LOCAL ? 1 : -1));
+	return true;
+}
+
+bool rt_compound_global(VM* vm, ObjString* name, int kind) {
+	Value initial;
+	Value result;
+
+	if ( !table_get(&vm->globals, name, &initial) ) {
+		runtime_error(vm, "Undefined variable '%s'.", name->chars);
+		return false;
+	}
+
+	if ( kind == OP_INC_GLOBAL - OP_SET_GLOBAL || kind == OP_DEC_GLOBAL - OP_SET_GLOBAL ) {
+		if ( !IS_NUMBER(initial) ) {
+			runtime_error(vm, "Operand of '%s' must be a number.", compound_names[kind]);
+			return false;
+		}
+
+		result = add_numbers(vm, initial, INT_VAL(kind == OP_INC_GLOBAL - OP_SET_GLOBAL ? 1 : -1));
+	} else {
+		if ( !compound_value(vm, kind, initial, peek(vm, 0), &result) ) {
+			return false;
+		}
+
+		// Keep the result reachable while the table may grow.
+		vm->stack_top[-1] = result;
+	}
+
+	note_global_write(vm, name);
+	table_set(vm, &vm->globals, name, result);
+	return true;
+}
+
+static bool compound_location(VM* vm, Value* location, int kind) {
+	Value result;
+
+	if ( kind == OP_INC_UPVALUE - OP_SET_UPVALUE || kind == OP_DEC_UPVALUE - OP_SET_UPVALUE ) {
+		if ( !IS_NUMBER(*location) ) {
+			runtime_error(vm, "Operand of '%s' must be a number.", compound_names[kind]);
+			return false;
+		}
+
+		*location = add_numbers(vm, *location, INT_VAL(kind == OP_INC_UPVALUE - OP_SET_UPVALUE ? 1 : -1));
+		return true;
+	}
+
+	if ( !compound_value(vm, kind, *location, peek(vm, 0), &result) ) {
+		return false;
+	}
+
+	*location = result;
+	vm->stack_top[-1] = result;
+	return true;
+}
+
+bool rt_compound_upvalue(VM* vm, CallFrame* frame, int slot, int kind) {
+	return compound_location(vm, frame->closure->upvalues[slot]->location, kind);
+}
+
+bool rt_compound_enclosing(VM* vm, CallFrame* frame, int slot, int kind) {
+	return compound_location(vm, &frame[-1].slots[slot], kind);
+}
+
+bool rt_binary(VM* vm, int op) {
+	Value b = peek(vm, 0);
+	Value a = peek(vm, 1);
+
+	if ( op >= OP_ANDB && op <= OP_SHIFTL ) {
+		Value result;
+
+		if ( IS_BOOL(a) && IS_BOOL(b) ) {
+			bool x = AS_BOOL(a);
+			bool y = AS_BOOL(b);
+
+			switch ( op ) {
+				case OP_ANDB:   result = BOOL_VAL(x & y); break;
+				case OP_ORB:    result = BOOL_VAL(x | y); break;
+				case OP_XORB:   result = BOOL_VAL(x ^ y); break;
+				case OP_SHIFTR: result = BOOL_VAL(x >> y); break;
+				default:        result = BOOL_VAL(x << y); break;
+			}
+		} else if ( IS_NUMBER(a) && IS_NUMBER(b) ) {
+			int32_t xi;
+			int32_t yi;
+
+			if ( !number_to_int(a, &xi) || !number_to_int(b, &yi) ) {
+				runtime_error(vm, "Operands of bitwise operator must be integers not floats.");
+				return false;
+			}
+
+			switch ( op ) {
+				case OP_ANDB:   result = INT32_VAL(vm, xi & yi); break;
+				case OP_ORB:    result = INT32_VAL(vm, xi | yi); break;
+				case OP_XORB:   result = INT32_VAL(vm, xi ^ yi); break;
+				case OP_SHIFTR: result = INT32_VAL(vm, xi >> yi); break;
+				default:        result = INT32_VAL(vm, xi << yi); break;
+			}
+		} else {
+			runtime_error(vm, "Operands of a bitwise operator must be an integer or a boolean.");
+			return false;
+		}
+
+		vm->stack_top--;
+		vm->stack_top[-1] = result;
+		return true;
+	}
+
+	if ( op == OP_ADD ) {
+		if ( IS_STRING(a) && IS_STRING(b) ) {
+			concatenate(vm);
+			return true;
+		}
+
+		if ( !IS_NUMBER(a) || !IS_NUMBER(b) ) {
+			runtime_error(vm, "Operands must be two numbers or two strings.");
+			return false;
+		}
+	} else if ( !IS_NUMBER(a) || !IS_NUMBER(b) ) {
+		runtime_error(vm, "Operands must be numbers.");
+		return false;
+	}
+
+	double x = AS_NUMBER(a);
+	double y = AS_NUMBER(b);
+	Value result;
+
+	switch ( op ) {
+		case OP_GREATER:  result = BOOL_VAL(x > y); break;
+		case OP_LESSER:   result = BOOL_VAL(x < y); break;
+		case OP_ADD:      result = add_numbers(vm, a, b); break;
+		case OP_SUBTRACT: result = subtract_numbers(vm, a, b); break;
+		case OP_MULTIPLY: result = multiply_numbers(vm, a, b); break;
+		case OP_DIVIDE:   result = divide_numbers(vm, a, b); break;
+		case OP_POW:      result = NUMBER_VAL(vm, pow(x, y)); break;
+		default: {
+			int32_t xi;
+			int32_t yi;
+
+			if ( !number_to_int(a, &xi) || !number_to_int(b, &yi) ) {
+				runtime_error(vm, "Operands of modulo must be integers.");
+				return false;
+			}
+
+			if ( yi == 0 ) {
+				runtime_error(vm, "Modulo by zero.");
+				return false;
+			}
+
+			result = INT32_VAL(vm, yi == -1 ? 0 : xi % yi);
+			break;
+		}
+	}
+
+	vm->stack_top--;
+	vm->stack_top[-1] = result;
+	return true;
+}
+
+bool rt_negate(VM* vm) {
+	if ( !IS_NUMBER(peek(vm, 0)) ) {
+		runtime_error(vm, "Operand must be a number.");
+		return false;
+	}
+
+	vm->stack_top[-1] = negate_number(vm, peek(vm, 0));
+	return true;
+}
+
+bool rt_equal(VM* vm) {
+	Value b = pop(vm);
+	vm->stack_top[-1] = BOOL_VAL(values_equal(peek(vm, 0), b));
+	return true;
+}
+
+bool rt_type(VM* vm) {
+	type_value(vm, pop(vm));
+	return true;
+}
+
+bool rt_wait(VM* vm) {
+	return wait_millis(vm, pop(vm));
+}
+
+bool rt_create_list(VM* vm, int count) {
+	ObjList* list = new_list(vm);
+
+	push(vm, OBJ_VAL(list));
+	for ( int i=count; i > 0; i-- ) {
+		append_to_list(vm, list, peek(vm, i));
+	}
+
+	vm->stack_top -= count + 1;
+	push(vm, OBJ_VAL(list));
+	return true;
+}
+
+bool rt_subscript(VM* vm) {
+	Value result;
+
+	if ( !subscript_value(vm, peek(vm, 1), peek(vm, 0), &result) ) {
+		return false;
+	}
+
+	vm->stack_top--;
+	vm->stack_top[-1] = result;
+	return true;
+}
+
+bool rt_set_subscript(VM* vm) {
+	Value value = peek(vm, 0);
+	Value index = peek(vm, 1);
+	Value object = peek(vm, 2);
+
+	if ( !IS_NUMBER(index) ) {
+		runtime_error(vm, "The index of a list must be an integer");
+		return false;
+	}
+
+	if ( IS_LIST(object) ) {
+		if ( AS_NUMBER(index) < 0 && abs((int)AS_NUMBER(index)) <= AS_LIST(object)->count ) {
+		} else if ( AS_LIST(object)->count - 1 < AS_NUMBER(index) || AS_NUMBER(index) < 0 ) {
+			runtime_error(vm, "List index out of range.");
+			return false;
+		}
+
+		set_in_list(AS_LIST(object), (int)AS_NUMBER(index), value);
+	} else if ( IS_STRING(object) ) {
+		if ( !IS_STRING(value) ) {
+			runtime_error(vm, "Only characters can be added into a string");
+			return false;
+		}
+
+		set_in_string(vm, AS_STRING(object), (int)AS_NUMBER(index), *AS_STRING(value)->chars);
+	} else {
+		runtime_error(vm, "Subscripting is only available for lists and strings.");
+		return false;
+	}
+
+	vm->stack_top -= 2;
+	vm->stack_top[-1] = value;
+	return true;
+}
+
+bool rt_iter_init(VM* vm) {
+	if ( !IS_LIST(peek(vm, 0)) && !IS_STRING(peek(vm, 0)) ) {
+		runtime_error(vm, "Can only iterate over lists and strings.");
+		return false;
+	}
+
+	push(vm, INT_VAL(0));
+	return true;
+}
+
+bool rt_iter_next(VM* vm, CallFrame* frame, int slot) {
+	Obj* sequence = AS_OBJ(frame->slots[slot]);
+	int index = AS_INT(frame->slots[slot + 1]);
+
+	if ( sequence->type == OBJ_LIST ) {
+		ObjList* list = (ObjList*)sequence;
+		if ( index >= list->count ) return false;
+
+		push(vm, list->items[index]);
+	} else {
+		ObjString* string = (ObjString*)sequence;
+		if ( index >= string->length ) return false;
+
+		push(vm, OBJ_VAL(new_string(vm, &string->chars[index], 1)));
+	}
+
+	frame->slots[slot + 1] = INT_VAL(index + 1);
+	return true;
+}
+
+CallFrame* rt_call_native(VM* vm, int index, int arg_count) {
+	const NativeDef* native = &natives[index];
+
+	if ( vm->shadowed_natives[index] ) {
+		load_shadowed_native(vm, native, arg_count);
+		return rt_call(vm, arg_count);
+	}
+
+	Value* args = vm->stack_top - arg_count;
+	Value result;
+
+	if ( !check_native_args(vm, native, arg_count, args) ||
+			!native->function(vm, arg_count, args, &result) ) {
+		return NULL;
+	}
+
+	*args = result;
+	vm->stack_top = args + 1;
+	return &vm->frames[vm->frame_count - 1];
+}
+
+bool rt_closure(VM* vm, CallFrame* frame, int offset) {
+	uint8_t* code = frame->closure->function->chunk.code + offset;
+	ObjFunction* function = AS_FUNCTION(frame->closure->function->chunk.constants.values[code[1]]);
+	ObjClosure* closure = new_closure(vm, function);
+	push(vm, OBJ_VAL(closure));
+
+	for ( int i=0; i < closure->upvalue_count; i++ ) {
+		uint8_t is_local = code[2 + 2 * i];
+		uint8_t index = code[3 + 2 * i];
+
+		if ( is_local == CAPTURE_LOCAL ) {
+			closure->upvalues[i] = capture_upvalue(vm, frame->slots + index);
+		} else if ( is_local == CAPTURE_UPVALUE ) {
+			closure->upvalues[i] = frame->closure->upvalues[index];
+		}
+	}
+
+	return true;
+}
+
+bool rt_close_upvalue(VM* vm) {
+	close_upvalues(vm, vm->stack_top - 1);
+	pop(vm);
+	return true;
+}
+
+bool rt_return(VM* vm, CallFrame* frame) {
+	Value result = peek(vm, 0);
+	close_upvalues(vm, frame->slots);
+	vm->frame_count--;
+
+	*frame->slots = result;
+	vm->stack_top = frame->slots + 1;
+	return true;
+}
+
+CallFrame* rt_call(VM* vm, int arg_count) {
+	int frames = vm->frame_count;
+
+	if ( !call_value(vm, peek(vm, arg_count), arg_count) ) return NULL;
+
+	if ( vm->frame_count > frames && run_callee(vm, frames) != INTERPRET_OK ) {
+		return NULL;
+	}
 
-	return run();
+	return &vm->frames[vm->frame_count - 1];
 }
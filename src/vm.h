@@ -3,10 +3,22 @@
 
 #include "object.h"
 #include "table.h"
+#include "trace.h"
 #include "value.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+#define FRAMES_MAX 65536
+#define FRAMES_INITIAL 8
+
+// The most stack slots a single frame can use, its locals and the
+// temporaries of the expression it is evaluating. The stack is grown on each
+// call so that the new frame always has this much room.
+#define FRAME_SLOTS_MAX (2 * UINT8_COUNT)
+
+// How many functions running as machine code, compiled by the JIT or emitted
+// as C, may be nested on the C stack. Deeper calls are interpreted, so
+// recursion can still go as deep as FRAMES_MAX. Memoized calls that run their
+// function to completion count towards it too, and past it are not cached.
+#define COMPILED_DEPTH_MAX 256
 
 typedef struct {
 	ObjClosure* closure;
@@ -14,14 +26,19 @@ typedef struct {
 	Value* slots;
 } CallFrame;
 
-typedef struct {
-	CallFrame frames[FRAMES_MAX];
+struct VM {
+	CallFrame* frames;
 	int frame_count;
+	int frame_capacity;
 
-	Value stack[STACK_MAX];
+	Value* stack;
 	Value* stack_top;
+	int stack_capacity;
 	Table globals;
 	Table strings;
+	// The builtins whose names have been given another value. OP_CALL_NATIVE
+	// calls what those names hold now instead.
+	bool shadowed_natives[UINT8_COUNT];
 	ObjUpvalue* open_upvalues;
 	
 	size_t bytes_allocated;
@@ -31,7 +48,39 @@ typedef struct {
 	int gray_count;
 	int gray_capacity;
 	Obj** gray_stack;
-} VM;
+	ObjMemo* marked_memos;
+	ObjFunction* marked_functions;
+
+	// Where print and type write, and where errors are reported.
+	FILE* out;
+	FILE* err;
+
+	// What init_vm() leaves behind, the builtins and their interned names.
+	// reset_vm() frees everything newer and puts these back.
+	Obj* base_objects;
+	Table base_globals;
+	Table base_strings;
+
+	// Natives defined by an embedding host, owned by the VM.
+	NativeDef** host_natives;
+	int host_native_count;
+	int host_native_capacity;
+
+	// The heap image the VM was started from, if any, the file it was mapped
+	// from, and the objects in it.
+	char* image;
+	int image_fd;
+	size_t image_size;
+	Obj** image_objects;
+	int image_object_count;
+
+	// Functions running as machine code inside each other on the C stack.
+	int compiled_depth;
+
+	// While prerendering, what type and wait would do is recorded here
+	// instead of being done.
+	Trace* trace;
+};
 
 typedef enum {
 	INTERPRET_OK,
@@ -39,16 +88,34 @@ typedef enum {
 	INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
-extern VM vm;
+void init_vm(VM* vm);
+
+bool init_vm_from_image(VM* vm, const char* path);
+
+void free_vm(VM* vm);
+
+void reset_vm(VM* vm);
+
+InterpretResult interpret(VM* vm, const char* source);
+
+void runtime_error(VM* vm, const char* format, ...);
+
+void define_native(VM* vm, const NativeDef* native);
+
+InterpretResult call_from_host(VM* vm, Value callee, int arg_count, const Value* args, Value* result);
 
-void init_vm();
+void ensure_stack(VM* vm, int needed);
 
-void free_vm();
+void push(VM* vm, Value value);
 
-InterpretResult interpret(const char* source);
+void shadow_native(VM* vm, ObjString* name);
 
-void push(Value value);
+// Every write to a global goes through here, so that a builtin whose name is
+// given another value stops being called directly.
+static inline void note_global_write(VM* vm, ObjString* name) {
+	if ( name->builtin ) shadow_native(vm, name);
+}
 
-Value pop();
+Value pop(VM* vm);
 
 #endif // !pikey_vm_h
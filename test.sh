@@ -0,0 +1,49 @@
+#!/bin/bash
+
+# Runs the tests against ./dist/pikey, so build first with the same
+# settings: PIKEY_JIT=1 ./build.sh && PIKEY_JIT=1 ./test.sh.
+#
+# Each test/*.pk is run and what it prints, errors included, followed by
+# "[exit N]", is compared with the .out file next to it. Scripts in
+# test/nan_boxing/ and test/compact/ only run on builds with that Value
+# representation. Each test/*.sh checks one of the other modes itself and is
+# given the path to pikey; it fails by exiting with a non-zero status.
+#
+# ./test.sh --update rewrites the .out files from what the scripts print.
+
+cd "$(dirname "$0")"
+
+PIKEY="$PWD/dist/pikey"
+failed=0
+
+if [ "$PIKEY_COMPACT" = "1" ]; then
+	scripts="test/*.pk test/compact/*.pk"
+else
+	scripts="test/*.pk test/nan_boxing/*.pk"
+fi
+
+for script in $scripts; do
+	[ -f "$script" ] || continue
+	expected="${script%.pk}.out"
+	actual=$(timeout 60 "$PIKEY" "$script" 2>&1; echo "[exit $?]")
+
+	if [ "$1" = "--update" ]; then
+		echo "$actual" > "$expected"
+	elif [ "$actual" != "$(cat "$expected")" ]; then
+		echo "FAIL $script"
+		diff <(echo "$actual") "$expected" | head -20
+		failed=1
+	fi
+done
+
+for check in test/*.sh; do
+	[ -f "$check" ] || continue
+	if ! output=$(timeout 120 bash "$check" "$PIKEY" 2>&1); then
+		echo "FAIL $check"
+		echo "$output" | head -20
+		failed=1
+	fi
+done
+
+[ $failed = 0 ] && echo "All tests passed."
+exit $failed
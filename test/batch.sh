@@ -0,0 +1,44 @@
+#!/bin/bash
+
+# --batch runs every script on the worker pool, then prints each script's
+# output under its name and a summary. Scripts don't see each other's
+# globals, and the exit status is that of the first script that failed.
+
+PIKEY="$1"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+mkdir "$dir/scripts"
+for i in 1 2 3 4 5 6 7 8; do
+	printf 'let shared = %d;\nlet total = 0;\nfor (let k = 0; k < 20000; k++) total += k;\ntype "%d:" + "done";\ntype total;\n' $i $i > "$dir/scripts/ok$i.pk"
+done
+printf 'type shared;\n' > "$dir/scripts/p_runtime.pk"
+printf 'type 1 +;\n' > "$dir/scripts/q_compile.pk"
+
+PIKEY_JOBS=3 "$PIKEY" --batch "$dir/scripts" > "$dir/out" 2> "$dir/err"
+status=$?
+
+fail() {
+	echo "$1"
+	cat "$dir/out" "$dir/err" | head -40
+	exit 1
+}
+
+[ $status = 70 ] || fail "exit $status, expected the runtime error's 70"
+
+for i in 1 2 3 4 5 6 7 8; do
+	grep -A2 "^==> $dir/scripts/ok$i.pk <==" "$dir/out" | tail -2 | tr '\n' ' ' | grep -qx "$i:done 199990000 " ||
+		fail "ok$i.pk's output is missing or mixed with another script's"
+done
+
+grep -q "Undefined variable 'shared'" "$dir/err" || fail "a global leaked from one script into another"
+grep -q "Expect expression" "$dir/err" || fail "the compile error was not reported"
+grep -q "^10 scripts: 8 ok, 1 compile errors, 1 runtime errors, 0 unreadable in .* on 3 threads$" "$dir/out" ||
+	fail "wrong summary"
+
+# A list file names the scripts instead, and a missing one is unreadable.
+printf '%s\n%s\n' "$dir/scripts/ok1.pk" "$dir/missing.pk" > "$dir/list"
+"$PIKEY" --batch "$dir/list" > "$dir/out" 2> "$dir/err"
+status=$?
+[ $status = 74 ] || fail "exit $status, expected the missing script's 74"
+grep -q "^2 scripts: 1 ok, 0 compile errors, 0 runtime errors, 1 unreadable" "$dir/out" || fail "wrong summary for the list"
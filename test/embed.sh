@@ -0,0 +1,115 @@
+#!/bin/bash
+
+# A host program built against libpikey runs scripts, calls into them and
+# back, and passes numbers, strings and lists both ways. Hosts of a compact
+# build see the same API with one word values.
+
+PIKEY="$1"
+dist=$(dirname "$PIKEY")
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+flags=
+[ "$PIKEY_COMPACT" = "1" ] && flags=-DCOMPACT_VALUES
+
+cat > "$dir/host.c" <<'HOST'
+#include <stdio.h>
+#include <string.h>
+
+#include "pikey.h"
+
+static bool host_add(PikeyVM* vm, int arg_count, PikeyValue* args, PikeyValue* result) {
+	if ( !pikey_is_number(args[0]) || !pikey_is_number(args[1]) ) {
+		pikey_error(vm, "host_add takes two numbers.");
+		return false;
+	}
+
+	*result = pikey_number(vm, pikey_as_number(args[0]) + pikey_as_number(args[1]));
+	return true;
+}
+
+int main(int argc, char* argv[]) {
+	PikeyVM* vm = pikey_new_vm();
+	pikey_define_native(vm, "host_add", host_add, 2, 2);
+
+	if ( pikey_run(vm, "def greet(name) { return \"hi \" + name; }\nlet total = host_add(2, 3.5);\n") != PIKEY_OK ) return 1;
+
+	PikeyValue total;
+	pikey_get_global(vm, "total", &total);
+	printf("total %g\n", pikey_as_number(total));
+
+	PikeyValue greet;
+	pikey_get_global(vm, "greet", &greet);
+	PikeyValue name = pikey_string(vm, "host", 4);
+	pikey_push_root(vm, name);
+	PikeyValue greeting;
+	if ( pikey_call(vm, greet, 1, &name, &greeting) != PIKEY_OK ) return 1;
+	pikey_pop_root(vm);
+
+	size_t length;
+	const char* chars = pikey_as_string(greeting, &length);
+	printf("greet %.*s\n", (int)length, chars);
+
+	// A number too big for a compact value is boxed, and a root keeps it
+	// alive while the script below collects.
+	PikeyValue big = pikey_number(vm, 10000000000.0);
+	pikey_push_root(vm, big);
+	PikeyValue list = pikey_new_list(vm);
+	pikey_push_root(vm, list);
+	for ( int i=0; i < 3; i++ ) pikey_list_append(vm, list, pikey_number(vm, i * 1.5));
+	pikey_set_global(vm, "items", list);
+	pikey_pop_root(vm);
+
+	if ( pikey_run(vm, "let s = \"\";\nfor (let i = 0; i < 5000; i++) s = s + \"x\";\ntype length(items);\ntype items[2];\n") != PIKEY_OK ) return 1;
+	printf("big %.0f\n", pikey_as_number(big));
+	pikey_pop_root(vm);
+
+	printf("runtime %d\n", pikey_run(vm, "host_add(1, \"two\");\n") == PIKEY_RUNTIME_ERROR);
+	printf("compile %d\n", pikey_run(vm, "let = ;\n") == PIKEY_COMPILE_ERROR);
+
+	pikey_free_vm(vm);
+
+	// An image keeps what the scripts defined, as long as it uses no host
+	// natives.
+	vm = pikey_new_vm();
+	if ( pikey_run(vm, "def greet(name) { return \"hi \" + name; }\n") != PIKEY_OK ) return 1;
+	if ( !pikey_save_image(vm, argv[1]) ) return 1;
+	pikey_free_vm(vm);
+
+	vm = pikey_new_vm_from_image(argv[1]);
+	if ( vm == NULL ) return 1;
+	pikey_get_global(vm, "greet", &greet);
+	name = pikey_string(vm, "image", 5);
+	pikey_push_root(vm, name);
+	if ( pikey_call(vm, greet, 1, &name, &greeting) != PIKEY_OK ) return 1;
+	pikey_pop_root(vm);
+	chars = pikey_as_string(greeting, &length);
+	printf("greet %.*s\n", (int)length, chars);
+	pikey_free_vm(vm);
+
+	return 0;
+}
+HOST
+
+gcc $flags -I "$dist" -o "$dir/host" "$dir/host.c" "$dist/libpikey.a" -lm -lpthread || exit 1
+"$dir/host" "$dir/host.img" > "$dir/out" 2> "$dir/err"
+status=$?
+
+expected='total 5.5
+greet hi host
+3
+3
+big 10000000000
+runtime 1
+compile 1
+greet hi image'
+
+errors='host_add takes two numbers.
+[line 1] in script
+[line 1] Error at '"'"'='"'"': Expect variable name.'
+
+if [ $status != 0 ] || [ "$(cat "$dir/out")" != "$expected" ] || [ "$(cat "$dir/err")" != "$errors" ]; then
+	echo "exit $status"
+	diff <(cat "$dir/out" "$dir/err") <(echo "$expected"; echo "$errors")
+	exit 1
+fi
@@ -0,0 +1,48 @@
+#!/bin/bash
+
+# Every script in the suite, emitted as C with --emit-c and built against
+# libpikey, prints the same thing and exits the same way as when pikey runs it.
+
+PIKEY="$1"
+dist=$(dirname "$PIKEY")
+src="$dist/../src"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+flags=
+[ "$PIKEY_JIT" = "1" ] && flags="$flags -DPIKEY_JIT"
+
+if [ "$PIKEY_COMPACT" = "1" ]; then
+	flags="$flags -DCOMPACT_VALUES"
+	scripts="test/*.pk test/compact/*.pk"
+else
+	scripts="test/*.pk test/nan_boxing/*.pk"
+fi
+
+failed=0
+
+for script in $scripts; do
+	[ -f "$script" ] || continue
+	name=$(basename "${script%.pk}")
+
+	if ! "$PIKEY" --emit-c "$script" "$dir/$name.c"; then
+		echo "--emit-c failed on $script"
+		failed=1
+		continue
+	fi
+
+	if ! gcc -O2 -Werror=int-conversion $flags -I "$src" "$dir/$name.c" "$dist/libpikey.a" -lm -lpthread -o "$dir/$name"; then
+		echo "the C emitted for $script does not build"
+		failed=1
+		continue
+	fi
+
+	actual=$(timeout 60 "$dir/$name" 2>&1; echo "[exit $?]")
+	if [ "$actual" != "$(cat "${script%.pk}.out")" ]; then
+		echo "$script emitted as C:"
+		diff <(echo "$actual") "${script%.pk}.out" | head -10
+		failed=1
+	fi
+done
+
+exit $failed
@@ -0,0 +1,88 @@
+#!/bin/bash
+
+# A heap image saved after a prelude brings back its globals in a later run:
+# strings, lists, closures with closed upvalues, memos, numbers and builtin
+# names given other values, even in a run that gives them one after the
+# image's functions were compiled. Runs from an image don't change it, and a
+# file that isn't an image from this build is refused.
+
+PIKEY="$1"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+cat > "$dir/prelude.pk" <<'SCRIPT'
+let greeting = "hello";
+let numbers = [1, 2.5, 3];
+def make_counter() {
+	let n = 0;
+	def bump() { n++; return n; }
+	return bump;
+}
+let counter = make_counter();
+counter();
+def square(x) { return x * x; }
+let fast_square = memoize(square);
+let big = 10000000000;
+let half = 0.5;
+def upper(s) { return "shadowed " + s; }
+def shout(s) { return lower(s); }
+SCRIPT
+
+cat > "$dir/use.pk" <<'SCRIPT'
+type greeting + " world";
+type greeting == "hello";
+type numbers[1] * 2;
+type counter();
+type counter();
+append(numbers, 4);
+type length(numbers);
+type fast_square(12);
+type big - 9999999999;
+type half;
+type upper("upper");
+type shout("LOUD");
+def lower(s) { return "quiet"; }
+let said = "";
+for (let i = 0; i < 2000; i++) said = shout("LOUD");
+type said;
+SCRIPT
+
+expected='hello world
+true
+5
+2
+3
+4
+144
+1
+0.5
+shadowed upper
+loud
+quiet'
+
+fail() {
+	echo "$1"
+	cat "$dir/out" 2>/dev/null | head -20
+	exit 1
+}
+
+"$PIKEY" --save-image "$dir/heap.img" "$dir/prelude.pk" || fail "could not save the image"
+
+for run in 1 2; do
+	"$PIKEY" --image "$dir/heap.img" "$dir/use.pk" > "$dir/out" 2>&1 || fail "run $run failed"
+	[ "$(cat "$dir/out")" = "$expected" ] || fail "run $run printed something else"
+done
+
+echo "not an image" > "$dir/bad.img"
+"$PIKEY" --image "$dir/bad.img" "$dir/use.pk" > "$dir/out" 2>&1
+[ $? = 74 ] && grep -q "is not an image" "$dir/out" || fail "a text file was loaded"
+
+head -c 200 "$dir/heap.img" > "$dir/short.img"
+"$PIKEY" --image "$dir/short.img" "$dir/use.pk" > "$dir/out" 2>&1
+[ $? = 74 ] && grep -q "is not an image" "$dir/out" || fail "a truncated image was loaded"
+
+# The version follows the 8 byte magic.
+cp "$dir/heap.img" "$dir/old.img"
+printf '\377' | dd of="$dir/old.img" bs=1 seek=8 conv=notrunc 2>/dev/null
+"$PIKEY" --image "$dir/old.img" "$dir/use.pk" > "$dir/out" 2>&1
+[ $? = 74 ] && grep -q "was made by a different build" "$dir/out" || fail "an image of another version was loaded"
@@ -0,0 +1,91 @@
+#!/bin/bash
+
+# --serve runs requests side by side: a quick script gets its answer while a
+# slow one is still waiting. Each request also starts from a reset VM, or
+# from the heap image the server was given.
+
+PIKEY="$1"
+dir=$(mktemp -d)
+server=
+
+cleanup() {
+	[ -n "$server" ] && kill "$server" 2>/dev/null
+	rm -rf "$dir"
+}
+trap cleanup EXIT
+
+PIKEY_JOBS=2 "$PIKEY" --serve "$dir/sock" &
+server=$!
+
+# The socket file shows up before the server listens on it, so this waits
+# for an empty script to get an answer.
+touch "$dir/empty.pk"
+wait_for() {
+	for i in $(seq 50); do
+		"$PIKEY" --client "$1" "$dir/empty.pk" 2> /dev/null && return
+		sleep 0.1
+	done
+}
+
+wait_for "$dir/sock"
+
+printf 'wait 3000;\ntype "slow";\n' > "$dir/slow.pk"
+printf 'let left = 1;\ntype 1 + 2;\n' > "$dir/quick.pk"
+printf 'type left;\n' > "$dir/reset.pk"
+
+"$PIKEY" --client "$dir/sock" "$dir/slow.pk" > "$dir/slow.out" &
+slow=$!
+sleep 0.5
+
+quick=$("$PIKEY" --client "$dir/sock" "$dir/quick.pk")
+if [ "$quick" != "3" ]; then
+	echo "quick request printed '$quick'"
+	exit 1
+fi
+if ! kill -0 "$slow" 2>/dev/null; then
+	echo "the quick request waited for the slow one"
+	exit 1
+fi
+
+wait "$slow"
+if [ "$(cat "$dir/slow.out")" != "slow" ]; then
+	echo "slow request printed '$(cat "$dir/slow.out")'"
+	exit 1
+fi
+
+"$PIKEY" --client "$dir/sock" "$dir/reset.pk" 2> "$dir/reset.err"
+status=$?
+if [ $status != 70 ] || ! grep -q "Undefined variable" "$dir/reset.err"; then
+	echo "a global outlived its request: exit $status"
+	cat "$dir/reset.err"
+	exit 1
+fi
+
+# A script over the size limit is refused without taking the worker down.
+head -c $((17 * 1024 * 1024)) /dev/zero | tr '\0' ' ' > "$dir/big.pk"
+"$PIKEY" --client "$dir/sock" "$dir/big.pk" > /dev/null 2> "$dir/big.err"
+[ $? = 74 ] && grep -q "too large" "$dir/big.err" || { echo "an oversized script was run"; exit 1; }
+[ "$("$PIKEY" --client "$dir/sock" "$dir/quick.pk")" = "3" ] || { echo "the server stopped after an oversized script"; exit 1; }
+
+# With an image, every request starts from the image as it was saved, even
+# after one changed the objects in it.
+printf 'let items = [1];\ndef count() { return length(items); }\n' > "$dir/prelude.pk"
+"$PIKEY" --save-image "$dir/heap.img" "$dir/prelude.pk" || { echo "could not save the image"; exit 1; }
+printf 'append(items, "new" + "item");\ntype count();\ntype items[1];\n' > "$dir/change.pk"
+
+PIKEY_JOBS=1 "$PIKEY" --serve "$dir/image.sock" "$dir/heap.img" &
+image_server=$!
+trap 'kill "$image_server" 2>/dev/null; cleanup' EXIT
+
+wait_for "$dir/image.sock"
+
+for run in 1 2 3; do
+	changed=$("$PIKEY" --client "$dir/image.sock" "$dir/change.pk")
+	if [ "$changed" != "$(printf '2\nnewitem')" ]; then
+		echo "request $run from the image printed '$changed'"
+		exit 1
+	fi
+done
+
+"$PIKEY" --serve "$dir/bad.sock" "$dir/prelude.pk" 2> "$dir/bad.err"
+[ $? = 74 ] && grep -q "is not an image" "$dir/bad.err" || { echo "a server started from a script as its image"; exit 1; }
@@ -0,0 +1,66 @@
+#!/bin/bash
+
+# --prerender runs a script without typing or waiting, and --play gives back
+# what it would have typed, with its pauses. Scripts calling clock or the
+# rand family are warned about, and failed runs leave no trace behind.
+
+PIKEY="$1"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+fail() {
+	echo "$1"
+	exit 1
+}
+
+now_ms() {
+	echo $(( $(date +%s%N) / 1000000 ))
+}
+
+cat > "$dir/show.pk" <<'SCRIPT'
+def greet(name) { return "hello " + name; }
+type greet("trace");
+wait 300;
+let total = 0;
+for (let i = 1; i <= 10; i++) total += i;
+type total;
+wait 200;
+wait 200;
+type 2.5;
+SCRIPT
+
+start=$(now_ms)
+"$PIKEY" --prerender "$dir/show.pk" "$dir/show.trace" > "$dir/prerender.out" 2>&1 || fail "--prerender failed"
+[ $(( $(now_ms) - start )) -lt 500 ] || fail "--prerender waited"
+[ -s "$dir/prerender.out" ] && fail "--prerender typed: $(cat "$dir/prerender.out")"
+
+start=$(now_ms)
+played=$("$PIKEY" --play "$dir/show.trace") || fail "--play failed"
+[ $(( $(now_ms) - start )) -ge 700 ] || fail "--play skipped the waits"
+[ "$played" = "$("$PIKEY" "$dir/show.pk")" ] || fail "--play typed \"$played\""
+
+# Playing twice gives the same text.
+[ "$("$PIKEY" --play "$dir/show.trace")" = "$played" ] || fail "a second --play differs"
+
+cat > "$dir/random.pk" <<'SCRIPT'
+type "dice";
+type rand_int(1, 6) > 0;
+type rand_int(1, 6) > 0;
+SCRIPT
+
+warnings=$("$PIKEY" --prerender "$dir/random.pk" "$dir/random.trace" 2>&1) || fail "--prerender of rand_int failed"
+[ "$warnings" = "[line 2] Warning: rand_int() makes the trace differ from run to run." ] ||
+	fail "unexpected warnings: $warnings"
+[ "$("$PIKEY" --play "$dir/random.trace")" = "dice
+true
+true" ] || fail "the random trace plays wrong"
+
+printf 'type "before";\nwait 10;\ntype 1 + "x";\n' > "$dir/error.pk"
+"$PIKEY" --prerender "$dir/error.pk" "$dir/error.trace" > /dev/null 2>&1
+[ $? = 70 ] || fail "a runtime error should exit with 70"
+[ -e "$dir/error.trace" ] && fail "a failed run wrote a trace"
+
+"$PIKEY" --play "$dir/show.pk" > /dev/null 2>&1
+[ $? = 74 ] || fail "--play of a script should exit with 74"
+
+exit 0